@@ -52,6 +52,11 @@ struct ngx_listening_s {
     ngx_rbtree_t        rbtree;
     ngx_rbtree_node_t   sentinel;
 
+    /* sessions of plain udp listening sockets */
+    ngx_udp_connection_t  **udp_hash;
+    ngx_uint_t          udp_hash_size;
+    ngx_uint_t          udp_nsessions;
+
     ngx_uint_t          worker;
 
     unsigned            open:1;
@@ -74,6 +79,7 @@ struct ngx_listening_s {
     unsigned            add_reuseport:1;
     unsigned            keepalive:2;
     unsigned            quic:1;
+    unsigned            sessionless:1;
 
     unsigned            deferred_accept:1;
     unsigned            delete_deferred:1;
@@ -9,17 +9,77 @@
 #include <ngx_core.h>
 
 
+static ngx_int_t ngx_hash_perfect_init(ngx_hash_init_t *hinit,
+    ngx_hash_key_t *names, ngx_uint_t nelts);
+static int ngx_libc_cdecl ngx_hash_cmp_keys(const void *one, const void *two);
+
+
+/*
+ * perfect hashing uses the "hash and displace" scheme: the mixed key
+ * selects a group, and the seed found for the group at build time
+ * places all keys of the group into distinct buckets
+ */
+
+static ngx_inline uint64_t
+ngx_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_hash_perfect_bucket(uint64_t h, uint16_t seed, ngx_uint_t size)
+{
+    uint32_t  x;
+
+    x = (uint32_t) (h >> 32) ^ ((uint32_t) seed * 0x9e3779b9);
+
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+
+    return (ngx_uint_t) (((uint64_t) x * size) >> 32);
+}
+
+
+#define ngx_hash_perfect_tag(h)  (u_char) ((h) >> 24)
+
+
 void *
 ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
 {
-    ngx_uint_t       i;
+    uint64_t         h;
+    ngx_uint_t       b;
     ngx_hash_elt_t  *elt;
 
 #if 0
     ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "hf:\"%*s\"", len, name);
 #endif
 
-    elt = hash->buckets[key % hash->size];
+    if (hash->seeds) {
+        h = ngx_hash_mix(key);
+        b = ngx_hash_perfect_bucket(h, hash->seeds[h & hash->mask],
+                                    hash->size);
+
+        /* most misses are detected without reading the bucket */
+
+        if (hash->tags[b] != ngx_hash_perfect_tag(h)) {
+            return NULL;
+        }
+
+        elt = hash->buckets[b];
+
+    } else {
+        elt = hash->buckets[key % hash->size];
+    }
 
     if (elt == NULL) {
         return NULL;
@@ -30,10 +90,8 @@ ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
             goto next;
         }
 
-        for (i = 0; i < len; i++) {
-            if (name[i] != elt->name[i]) {
-                goto next;
-            }
+        if (ngx_memcmp(name, elt->name, len) != 0) {
+            goto next;
         }
 
         return elt->value;
@@ -254,6 +312,7 @@ ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
     u_char          *elts;
     size_t           len;
     u_short         *test;
+    ngx_int_t        rc;
     ngx_uint_t       i, n, key, size, start, bucket_size;
     ngx_hash_elt_t  *elt, **buckets;
 
@@ -288,6 +347,14 @@ ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
         }
     }
 
+    if (nelts >= NGX_HASH_PERFECT_MIN) {
+        rc = ngx_hash_perfect_init(hinit, names, nelts);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     test = ngx_alloc(hinit->max_size * sizeof(u_short), hinit->pool->log);
     if (test == NULL) {
         return NGX_ERROR;
@@ -451,6 +518,9 @@ found:
 
     hinit->hash->buckets = buckets;
     hinit->hash->size = size;
+    hinit->hash->seeds = NULL;
+    hinit->hash->tags = NULL;
+    hinit->hash->mask = 0;
 
 #if 0
 
@@ -486,6 +556,336 @@ found:
 }
 
 
+static ngx_int_t
+ngx_hash_perfect_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    u_char          *elts, *taken, *tags;
+    size_t           len;
+    uint16_t        *seeds;
+    uint32_t        *lens;
+    uint64_t        *keys, *grouped, h;
+    ngx_int_t        rc;
+    ngx_uint_t       i, j, k, m, n, g, b, size, ngroups, mask, max;
+    ngx_uint_t      *first, *order, *nsize, *pos;
+    ngx_hash_elt_t  *elt, **buckets;
+
+    keys = NULL;
+    grouped = NULL;
+    first = NULL;
+    order = NULL;
+    nsize = NULL;
+    pos = NULL;
+    taken = NULL;
+    lens = NULL;
+    seeds = NULL;
+
+    rc = NGX_ERROR;
+
+    keys = ngx_alloc(nelts * sizeof(uint64_t), hinit->pool->log);
+    if (keys == NULL) {
+        goto done;
+    }
+
+    n = 0;
+
+    for (i = 0; i < nelts; i++) {
+        if (names[i].key.data == NULL) {
+            continue;
+        }
+
+        keys[n++] = ngx_hash_mix(names[i].key_hash);
+    }
+
+    /* names with equal hash keys share a bucket */
+
+    ngx_qsort(keys, n, sizeof(uint64_t), ngx_hash_cmp_keys);
+
+    for (i = 1, j = 0; i < n; i++) {
+        if (keys[i] != keys[j]) {
+            keys[++j] = keys[i];
+        }
+    }
+
+    n = n ? j + 1 : 0;
+
+    /* about 1.5% of buckets are left empty to keep the seed search short */
+
+    size = n + n / 64 + 1;
+
+    if (n == 0 || size > hinit->max_size) {
+        rc = NGX_DECLINED;
+        goto done;
+    }
+
+    for (ngroups = 1; ngroups < n / 4; ngroups <<= 1) { /* void */ }
+
+    mask = ngroups - 1;
+
+    grouped = ngx_alloc(n * sizeof(uint64_t), hinit->pool->log);
+    first = ngx_calloc((ngroups + 1) * sizeof(ngx_uint_t), hinit->pool->log);
+    order = ngx_alloc(ngroups * sizeof(ngx_uint_t), hinit->pool->log);
+    taken = ngx_calloc(size, hinit->pool->log);
+    seeds = ngx_calloc(ngroups * sizeof(uint16_t), hinit->pool->log);
+
+    if (grouped == NULL || first == NULL || order == NULL || taken == NULL
+        || seeds == NULL)
+    {
+        goto done;
+    }
+
+    /* sort the keys by group, first[g] is the start of group g */
+
+    for (i = 0; i < n; i++) {
+        first[(keys[i] & mask) + 1]++;
+    }
+
+    max = 0;
+
+    for (g = 0; g < ngroups; g++) {
+        max = ngx_max(max, first[g + 1]);
+        first[g + 1] += first[g];
+        order[g] = first[g];
+    }
+
+    for (i = 0; i < n; i++) {
+        grouped[order[keys[i] & mask]++] = keys[i];
+    }
+
+    /* larger groups are placed first, while most buckets are free */
+
+    nsize = ngx_calloc((max + 2) * sizeof(ngx_uint_t), hinit->pool->log);
+    pos = ngx_alloc(max * sizeof(ngx_uint_t), hinit->pool->log);
+
+    if (nsize == NULL || pos == NULL) {
+        goto done;
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        nsize[max - (first[g + 1] - first[g]) + 1]++;
+    }
+
+    for (k = 0; k <= max; k++) {
+        nsize[k + 1] += nsize[k];
+    }
+
+    for (g = 0; g < ngroups; g++) {
+        order[nsize[max - (first[g + 1] - first[g])]++] = g;
+    }
+
+    for (i = 0; i < ngroups; i++) {
+        g = order[i];
+        m = first[g + 1] - first[g];
+
+        if (m == 0) {
+            break;
+        }
+
+        for (k = 0; k < NGX_HASH_PERFECT_TRIES; k++) {
+
+            for (j = 0; j < m; j++) {
+                b = ngx_hash_perfect_bucket(grouped[first[g] + j],
+                                            (uint16_t) k, size);
+
+                if (taken[b]) {
+                    break;
+                }
+
+                taken[b] = 1;
+                pos[j] = b;
+            }
+
+            if (j == m) {
+                seeds[g] = (uint16_t) k;
+                break;
+            }
+
+            while (j) {
+                taken[pos[--j]] = 0;
+            }
+        }
+
+        if (k == NGX_HASH_PERFECT_TRIES) {
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, hinit->pool->log, 0,
+                           "no perfect hash found for %s", hinit->name);
+            rc = NGX_DECLINED;
+            goto done;
+        }
+    }
+
+    lens = ngx_calloc(size * sizeof(uint32_t), hinit->pool->log);
+    if (lens == NULL) {
+        goto done;
+    }
+
+    for (i = 0; i < nelts; i++) {
+        if (names[i].key.data == NULL) {
+            continue;
+        }
+
+        h = ngx_hash_mix(names[i].key_hash);
+        b = ngx_hash_perfect_bucket(h, seeds[h & mask], size);
+
+        lens[b] += NGX_HASH_ELT_SIZE(&names[i]);
+
+        if (lens[b] + sizeof(void *) > hinit->bucket_size) {
+            rc = NGX_DECLINED;
+            goto done;
+        }
+    }
+
+    len = 0;
+
+    for (b = 0; b < size; b++) {
+        if (lens[b]) {
+            len += lens[b] + sizeof(void *);
+        }
+    }
+
+    if (hinit->hash == NULL) {
+        hinit->hash = ngx_pcalloc(hinit->pool, sizeof(ngx_hash_wildcard_t)
+                                             + size * sizeof(ngx_hash_elt_t *));
+        if (hinit->hash == NULL) {
+            goto done;
+        }
+
+        buckets = (ngx_hash_elt_t **)
+                      ((u_char *) hinit->hash + sizeof(ngx_hash_wildcard_t));
+
+    } else {
+        buckets = ngx_pcalloc(hinit->pool, size * sizeof(ngx_hash_elt_t *));
+        if (buckets == NULL) {
+            goto done;
+        }
+    }
+
+    elts = ngx_palloc(hinit->pool, len + ngx_cacheline_size);
+    if (elts == NULL) {
+        goto done;
+    }
+
+    elts = ngx_align_ptr(elts, ngx_cacheline_size);
+
+    tags = ngx_pcalloc(hinit->pool, size);
+    if (tags == NULL) {
+        goto done;
+    }
+
+    /* buckets are packed, they mostly have a single element */
+
+    for (b = 0; b < size; b++) {
+        if (lens[b] == 0) {
+            continue;
+        }
+
+        buckets[b] = (ngx_hash_elt_t *) elts;
+        elts += lens[b] + sizeof(void *);
+
+        lens[b] = 0;
+    }
+
+    for (i = 0; i < nelts; i++) {
+        if (names[i].key.data == NULL) {
+            continue;
+        }
+
+        h = ngx_hash_mix(names[i].key_hash);
+        b = ngx_hash_perfect_bucket(h, seeds[h & mask], size);
+
+        elt = (ngx_hash_elt_t *) ((u_char *) buckets[b] + lens[b]);
+
+        tags[b] = ngx_hash_perfect_tag(h);
+
+        elt->value = names[i].value;
+        elt->len = (u_short) names[i].key.len;
+
+        ngx_strlow(elt->name, names[i].key.data, names[i].key.len);
+
+        lens[b] += NGX_HASH_ELT_SIZE(&names[i]);
+    }
+
+    for (b = 0; b < size; b++) {
+        if (buckets[b] == NULL) {
+            continue;
+        }
+
+        elt = (ngx_hash_elt_t *) ((u_char *) buckets[b] + lens[b]);
+
+        elt->value = NULL;
+    }
+
+    hinit->hash->seeds = ngx_palloc(hinit->pool, ngroups * sizeof(uint16_t));
+    if (hinit->hash->seeds == NULL) {
+        goto done;
+    }
+
+    ngx_memcpy(hinit->hash->seeds, seeds, ngroups * sizeof(uint16_t));
+
+    hinit->hash->buckets = buckets;
+    hinit->hash->size = size;
+    hinit->hash->tags = tags;
+    hinit->hash->mask = mask;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, hinit->pool->log, 0,
+                   "%s: perfect hash, buckets:%ui groups:%ui",
+                   hinit->name, size, ngroups);
+
+    rc = NGX_OK;
+
+done:
+
+    if (keys) {
+        ngx_free(keys);
+    }
+
+    if (grouped) {
+        ngx_free(grouped);
+    }
+
+    if (first) {
+        ngx_free(first);
+    }
+
+    if (order) {
+        ngx_free(order);
+    }
+
+    if (nsize) {
+        ngx_free(nsize);
+    }
+
+    if (pos) {
+        ngx_free(pos);
+    }
+
+    if (taken) {
+        ngx_free(taken);
+    }
+
+    if (lens) {
+        ngx_free(lens);
+    }
+
+    if (seeds) {
+        ngx_free(seeds);
+    }
+
+    return rc;
+}
+
+
+static int ngx_libc_cdecl
+ngx_hash_cmp_keys(const void *one, const void *two)
+{
+    uint64_t  a, b;
+
+    a = *(uint64_t *) one;
+    b = *(uint64_t *) two;
+
+    return (a > b) - (a < b);
+}
+
+
 ngx_int_t
 ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts)
@@ -23,6 +23,11 @@ typedef struct {
 typedef struct {
     ngx_hash_elt_t  **buckets;
     ngx_uint_t        size;
+
+    /* perfect hashing: per-group displacement seeds, or NULL */
+    uint16_t         *seeds;
+    u_char           *tags;
+    ngx_uint_t        mask;
 } ngx_hash_t;
 
 
@@ -68,6 +73,9 @@ typedef struct {
 #define NGX_HASH_LARGE_ASIZE      16384
 #define NGX_HASH_LARGE_HSIZE      10007
 
+#define NGX_HASH_PERFECT_MIN      256
+#define NGX_HASH_PERFECT_TRIES    65536
+
 #define NGX_HASH_WILDCARD_KEY     1
 #define NGX_HASH_READONLY_KEY     2
 
@@ -13,14 +13,35 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void ngx_pool_free_large(ngx_pool_large_t *l);
+static ngx_inline ngx_uint_t ngx_pool_cache_slot(size_t *size);
+static void *ngx_pool_cache_alloc(size_t size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
+static void ngx_pool_cache_trim(void);
+
+
+#define ngx_pool_cacheable(size)                                              \
+    (ngx_pool_cache.max_size && (size) <= NGX_POOL_CACHE_MAX)
+
+
+ngx_pool_cache_t  ngx_pool_cache;
 
 
 ngx_pool_t *
 ngx_create_pool(size_t size, ngx_log_t *log)
 {
+    ngx_uint_t   cached;
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    cached = ngx_pool_cacheable(size);
+
+    if (cached) {
+        p = ngx_pool_cache_alloc(size, log);
+
+    } else {
+        p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -38,6 +59,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
     p->large = NULL;
     p->cleanup = NULL;
     p->log = log;
+    p->cached = cached;
 
     return p;
 }
@@ -46,6 +68,8 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
+    size_t               size;
+    ngx_uint_t           cached;
     ngx_pool_t          *p, *n;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
@@ -82,12 +106,22 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
         }
     }
 
+    /* all blocks of a pool are of the same size */
+
+    size = (size_t) (pool->d.end - (u_char *) pool);
+    cached = pool->cached;
+
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        if (cached) {
+            ngx_pool_cache_free(p, size);
+
+        } else {
+            ngx_free(p);
+        }
 
         if (n == NULL) {
             break;
@@ -104,7 +138,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
         }
     }
 
@@ -183,7 +217,13 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    if (pool->cached) {
+        m = ngx_pool_cache_alloc(psize, pool->log);
+
+    } else {
+        m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    }
+
     if (m == NULL) {
         return NULL;
     }
@@ -217,7 +257,14 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    if (ngx_pool_cacheable(size)) {
+        p = ngx_pool_cache_alloc(size, pool->log);
+
+    } else {
+        p = ngx_alloc(size, pool->log);
+        size = 0;
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -227,6 +274,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -237,11 +285,18 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
-        ngx_free(p);
+        if (size) {
+            ngx_pool_cache_free(p, size);
+
+        } else {
+            ngx_free(p);
+        }
+
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -267,6 +322,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -283,7 +339,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -294,6 +350,18 @@ ngx_pfree(ngx_pool_t *pool, void *p)
 }
 
 
+static void
+ngx_pool_free_large(ngx_pool_large_t *l)
+{
+    if (l->size) {
+        ngx_pool_cache_free(l->alloc, l->size);
+
+    } else {
+        ngx_free(l->alloc);
+    }
+}
+
+
 void *
 ngx_pcalloc(ngx_pool_t *pool, size_t size)
 {
@@ -401,30 +469,156 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+/*
+ * the per-process cache keeps freed pool blocks and large allocations
+ * on free lists of power of two size classes, so steady state request
+ * processing does not call malloc() and free(); a block is only returned
+ * to the cache if it was allocated from it, as it is of the class size
+ *
+ * the free lists are not locked: other threads, e.g. of thread pools,
+ * allocate and free class sized blocks without the cache
+ */
+
+void
+ngx_pool_cache_init(size_t max_size)
+{
+    ngx_pool_cache.max_size = max_size;
+
+#if (NGX_THREADS)
+    ngx_pool_cache.thread = pthread_self();
+#endif
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_pool_cache_slot(size_t *size)
+{
+    size_t      s;
+    ngx_uint_t  i;
+
+    for (i = 0, s = NGX_POOL_CACHE_MIN; s < *size; i++, s <<= 1) {
+        /* void */
+    }
+
+    *size = s;
+
+    return i;
+}
+
 
 static void *
-ngx_get_cached_block(size_t size)
+ngx_pool_cache_alloc(size_t size, ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+    ngx_uint_t              i;
+    ngx_pool_cached_t      *b;
+    ngx_pool_cache_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
+    i = ngx_pool_cache_slot(&size);
+
+#if (NGX_THREADS)
+    if (!pthread_equal(pthread_self(), ngx_pool_cache.thread)) {
+        return ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
     }
+#endif
+
+    slot = &ngx_pool_cache.slots[i];
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    b = slot->free;
 
-    slot->tries++;
+    if (b == NULL) {
+        ngx_pool_cache.misses++;
+        return ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    }
+
+    slot->free = b->next;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+    if (--slot->nfree < slot->low) {
+        slot->low = slot->nfree;
     }
 
-    return NULL;
+    ngx_pool_cache.size -= size;
+    ngx_pool_cache.hits++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                   "pool cache: %p:%uz", b, size);
+
+    return b;
 }
 
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+    ngx_uint_t              i;
+    ngx_pool_cached_t      *b;
+    ngx_pool_cache_slot_t  *slot;
+
+#if (NGX_THREADS)
+    if (!pthread_equal(pthread_self(), ngx_pool_cache.thread)) {
+        ngx_free(p);
+        return;
+    }
 #endif
+
+    if (ngx_current_msec - ngx_pool_cache.last_trim >= NGX_POOL_CACHE_TRIM) {
+        ngx_pool_cache_trim();
+    }
+
+    i = ngx_pool_cache_slot(&size);
+
+    if (ngx_pool_cache.size + size > ngx_pool_cache.max_size) {
+        ngx_free(p);
+        return;
+    }
+
+    slot = &ngx_pool_cache.slots[i];
+
+    b = p;
+    b->next = slot->free;
+    slot->free = b;
+    slot->nfree++;
+
+    ngx_pool_cache.size += size;
+}
+
+
+static void
+ngx_pool_cache_trim(void)
+{
+    size_t                  size;
+    ngx_uint_t              i, n;
+    ngx_pool_cached_t      *b;
+    ngx_pool_cache_slot_t  *slot;
+
+    ngx_pool_cache.last_trim = ngx_current_msec;
+
+    /*
+     * the low water mark is the number of blocks of a class which
+     * were not used during the last interval; half of them are freed,
+     * so the cache shrinks to the working set over several intervals
+     */
+
+    size = NGX_POOL_CACHE_MIN;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++, size <<= 1) {
+        slot = &ngx_pool_cache.slots[i];
+
+        for (n = (slot->low + 1) / 2; n; n--) {
+            b = slot->free;
+            slot->free = b->next;
+            slot->nfree--;
+
+            ngx_free(b);
+
+            ngx_pool_cache.size -= size;
+            ngx_pool_cache.trimmed++;
+        }
+
+        slot->low = slot->nfree;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "pool cache trim: %uz, hits:%ui misses:%ui",
+                   ngx_pool_cache.size, ngx_pool_cache.hits,
+                   ngx_pool_cache.misses);
+}
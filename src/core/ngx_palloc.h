@@ -26,6 +26,12 @@
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
 
+/* pool blocks and large allocations cached by power of two size classes */
+#define NGX_POOL_CACHE_MIN       256
+#define NGX_POOL_CACHE_SLOTS     9
+#define NGX_POOL_CACHE_MAX       (64 * 1024)
+#define NGX_POOL_CACHE_TRIM      1000
+
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -43,6 +49,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;
     void                 *alloc;
+    size_t                size;     /* non-zero if allocated from cache */
 };
 
 
@@ -62,9 +69,41 @@ struct ngx_pool_s {
     ngx_pool_large_t     *large;
     ngx_pool_cleanup_t   *cleanup;
     ngx_log_t            *log;
+    ngx_uint_t            cached;   /* unsigned  cached:1; */
+};
+
+
+typedef struct ngx_pool_cached_s  ngx_pool_cached_t;
+
+struct ngx_pool_cached_s {
+    ngx_pool_cached_t    *next;
 };
 
 
+typedef struct {
+    ngx_pool_cached_t    *free;
+    ngx_uint_t            nfree;
+    ngx_uint_t            low;
+} ngx_pool_cache_slot_t;
+
+
+typedef struct {
+    size_t                max_size;
+    size_t                size;
+    ngx_msec_t            last_trim;
+
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            trimmed;
+
+#if (NGX_THREADS)
+    pthread_t             thread;
+#endif
+
+    ngx_pool_cache_slot_t slots[NGX_POOL_CACHE_SLOTS];
+} ngx_pool_cache_t;
+
+
 typedef struct {
     ngx_fd_t              fd;
     u_char               *name;
@@ -82,6 +121,8 @@ void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
 void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
 ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
 
+void ngx_pool_cache_init(size_t max_size);
+
 
 ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
 void ngx_pool_run_cleanup_file(ngx_pool_t *p, ngx_fd_t fd);
@@ -89,4 +130,7 @@ void ngx_pool_cleanup_file(void *data);
 void ngx_pool_delete_file(void *data);
 
 
+extern ngx_pool_cache_t  ngx_pool_cache;
+
+
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
@@ -23,9 +23,6 @@ struct ngx_thread_task_s {
 };
 
 
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
-
-
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
 
@@ -95,9 +95,30 @@ struct io_event {
 #endif /* NGX_TEST_BUILD_EPOLL */
 
 
+#if (NGX_HAVE_EPOLL_BUSY_POLL && !defined EPIOCSPARAMS)
+
+/* appeared in Linux 6.9, glibc 2.40 */
+
+struct epoll_params {
+    uint32_t    busy_poll_usecs;
+    uint16_t    busy_poll_budget;
+    uint8_t     prefer_busy_poll;
+    uint8_t     __pad;
+};
+
+#define EPIOCSPARAMS  _IOW(0x8A, 0x01, struct epoll_params)
+
+#endif
+
+
 typedef struct {
     ngx_uint_t  events;
     ngx_uint_t  aio_requests;
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+    ngx_uint_t  busy_poll;
+    ngx_uint_t  busy_poll_budget;
+    ngx_uint_t  prefer_busy_poll;
+#endif
 } ngx_epoll_conf_t;
 
 
@@ -109,6 +130,10 @@ static void ngx_epoll_notify_handler(ngx_event_t *ev);
 #if (NGX_HAVE_EPOLLRDHUP)
 static void ngx_epoll_test_rdhup(ngx_cycle_t *cycle);
 #endif
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+static void ngx_epoll_busy_poll_init(ngx_cycle_t *cycle,
+    ngx_epoll_conf_t *epcf);
+#endif
 static void ngx_epoll_done(ngx_cycle_t *cycle);
 static ngx_int_t ngx_epoll_add_event(ngx_event_t *ev, ngx_int_t event,
     ngx_uint_t flags);
@@ -129,6 +154,10 @@ static void ngx_epoll_eventfd_handler(ngx_event_t *ev);
 
 static void *ngx_epoll_create_conf(ngx_cycle_t *cycle);
 static char *ngx_epoll_init_conf(ngx_cycle_t *cycle, void *conf);
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+static char *ngx_epoll_busy_poll(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
 
 static int                  ep = -1;
 static struct epoll_event  *event_list;
@@ -154,6 +183,10 @@ static ngx_connection_t     ngx_eventfd_conn;
 ngx_uint_t                  ngx_use_epoll_rdhup;
 #endif
 
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+ngx_uint_t                  ngx_use_epoll_busy_poll;
+#endif
+
 static ngx_str_t      epoll_name = ngx_string("epoll");
 
 static ngx_command_t  ngx_epoll_commands[] = {
@@ -172,6 +205,17 @@ static ngx_command_t  ngx_epoll_commands[] = {
       offsetof(ngx_epoll_conf_t, aio_requests),
       NULL },
 
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+
+    { ngx_string("epoll_busy_poll"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE123,
+      ngx_epoll_busy_poll,
+      0,
+      0,
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -348,6 +392,10 @@ ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer)
 #if (NGX_HAVE_EPOLLRDHUP)
         ngx_epoll_test_rdhup(cycle);
 #endif
+
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+        ngx_epoll_busy_poll_init(cycle, epcf);
+#endif
     }
 
     if (nevents < epcf->events) {
@@ -459,6 +507,47 @@ ngx_epoll_notify_handler(ngx_event_t *ev)
 #endif
 
 
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+
+static void
+ngx_epoll_busy_poll_init(ngx_cycle_t *cycle, ngx_epoll_conf_t *epcf)
+{
+    struct epoll_params  params;
+
+    if (epcf->busy_poll == 0) {
+        return;
+    }
+
+    /*
+     * epoll_wait() polls the NIC queue of the sockets in the epoll set
+     * for up to the specified time before sleeping; sockets of one queue,
+     * as identified by SO_INCOMING_NAPI_ID, should be served by one worker,
+     * for example, with "reuseport_bpf" and matching IRQ affinity
+     */
+
+    ngx_memzero(&params, sizeof(struct epoll_params));
+
+    params.busy_poll_usecs = (uint32_t) epcf->busy_poll;
+    params.busy_poll_budget = (uint16_t) epcf->busy_poll_budget;
+    params.prefer_busy_poll = (uint8_t) epcf->prefer_busy_poll;
+
+    if (ioctl(ep, EPIOCSPARAMS, &params) == -1) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                      "ioctl(EPIOCSPARAMS) failed, ignored");
+        return;
+    }
+
+    ngx_use_epoll_busy_poll = 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "epoll busy poll: %uD usecs, budget:%uD, prefer:%uD",
+                   params.busy_poll_usecs, (uint32_t) params.busy_poll_budget,
+                   (uint32_t) params.prefer_busy_poll);
+}
+
+#endif
+
+
 #if (NGX_HAVE_EPOLLRDHUP)
 
 static void
@@ -1034,6 +1123,11 @@ ngx_epoll_create_conf(ngx_cycle_t *cycle)
 
     epcf->events = NGX_CONF_UNSET;
     epcf->aio_requests = NGX_CONF_UNSET;
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+    epcf->busy_poll = NGX_CONF_UNSET_UINT;
+    epcf->busy_poll_budget = NGX_CONF_UNSET_UINT;
+    epcf->prefer_busy_poll = NGX_CONF_UNSET_UINT;
+#endif
 
     return epcf;
 }
@@ -1046,6 +1140,83 @@ ngx_epoll_init_conf(ngx_cycle_t *cycle, void *conf)
 
     ngx_conf_init_uint_value(epcf->events, 512);
     ngx_conf_init_uint_value(epcf->aio_requests, 32);
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+    ngx_conf_init_uint_value(epcf->busy_poll, 0);
+    ngx_conf_init_uint_value(epcf->busy_poll_budget, 8);
+    ngx_conf_init_uint_value(epcf->prefer_busy_poll, 0);
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+
+static char *
+ngx_epoll_busy_poll(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_epoll_conf_t *epcf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+    ngx_uint_t  i;
+
+    if (epcf->busy_poll != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts > 2) {
+            return "has invalid number of arguments";
+        }
+
+        epcf->busy_poll = 0;
+        return NGX_CONF_OK;
+    }
+
+    /* the time is in microseconds, as the kernel accepts it */
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0 || n > NGX_MAX_INT32_VALUE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid busy poll time \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    epcf->busy_poll = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == NGX_ERROR || n == 0 || n > 0xffff) {
+                goto invalid;
+            }
+
+            epcf->busy_poll_budget = n;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "prefer") == 0) {
+            epcf->prefer_busy_poll = 1;
+            continue;
+        }
+
+        goto invalid;
+    }
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
+
+#endif
@@ -498,6 +498,9 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_time_t          *tp;
     ngx_core_conf_t     *ccf;
     ngx_event_conf_t    *ecf;
+#if !(NGX_WIN32)
+    size_t               wakeup;
+#endif
 
     cf = ngx_get_conf(cycle->conf_ctx, ngx_events_module);
     ecf = (*cf)[ngx_event_core_module.ctx_index];
@@ -565,6 +568,14 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_writing */
            + cl;         /* ngx_stat_waiting */
 
+#endif
+
+#if !(NGX_WIN32)
+
+    wakeup = size;
+
+    size += NGX_MAX_PROCESSES * sizeof(ngx_atomic_t);  /* ngx_wakeup_pending */
+
 #endif
 
     shm.size = size;
@@ -611,6 +622,12 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
 
+#endif
+
+#if !(NGX_WIN32)
+
+    ngx_wakeup_pending = (ngx_atomic_t *) (shared + wakeup);
+
 #endif
 
     return NGX_OK;
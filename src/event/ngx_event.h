@@ -187,6 +187,9 @@ extern ngx_event_actions_t   ngx_event_actions;
 #if (NGX_HAVE_EPOLLRDHUP)
 extern ngx_uint_t            ngx_use_epoll_rdhup;
 #endif
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+extern ngx_uint_t            ngx_use_epoll_busy_poll;
+#endif
 
 
 /*
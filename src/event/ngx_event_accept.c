@@ -297,6 +297,28 @@ ngx_event_accept(ngx_event_t *ev)
                            "*%uA accept: %V fd:%d", c->number, &addr, s);
         }
 
+#if (NGX_HAVE_EPOLL_BUSY_POLL)
+
+        if ((ngx_event_flags & NGX_USE_EPOLL_EVENT)
+            && ngx_use_epoll_busy_poll
+            && (log->log_level & NGX_LOG_DEBUG_EVENT))
+        {
+            int        napi_id;
+            socklen_t  len;
+
+            len = sizeof(int);
+
+            if (getsockopt(s, SOL_SOCKET, SO_INCOMING_NAPI_ID,
+                           (void *) &napi_id, &len)
+                != -1)
+            {
+                ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                               "*%uA accept: napi id:%d", c->number, napi_id);
+            }
+        }
+
+#endif
+
         }
 #endif
 
@@ -8,6 +8,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
@@ -18,6 +21,19 @@ typedef struct {
 } ngx_openssl_conf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_connection_t           *connection;
+    int                         n;
+    int                         sslerr;
+    unsigned                    error:1;
+    unsigned                    fatal:1;
+} ngx_ssl_handshake_thread_ctx_t;
+
+#endif
+
+
 static X509 *ngx_ssl_load_certificate(ngx_pool_t *pool, char **err,
     ngx_str_t *cert, STACK_OF(X509) **chain);
 static EVP_PKEY *ngx_ssl_load_certificate_key(ngx_pool_t *pool, char **err,
@@ -33,6 +49,15 @@ static int ngx_ssl_new_client_session(ngx_ssl_conn_t *ssl_conn,
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ngx_int_t ngx_ssl_try_early_data(ngx_connection_t *c);
 #endif
+static ngx_uint_t ngx_ssl_handshake_error(ngx_connection_t *c, int sslerr,
+    ngx_err_t err);
+#if (NGX_THREADS)
+static ngx_int_t ngx_ssl_handshake_thread(ngx_connection_t *c, int *n);
+static ngx_int_t ngx_ssl_handshake_thread_post(ngx_connection_t *c);
+static void ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev);
+static void ngx_ssl_handshake_thread_wait_handler(ngx_event_t *ev);
+#endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ssize_t ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf,
@@ -44,6 +69,7 @@ static void ngx_ssl_write_handler(ngx_event_t *wev);
 static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
     size_t size);
 #endif
+static char *ngx_ssl_ktls_state(ngx_connection_t *c, ngx_uint_t send);
 static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
     size_t size);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
@@ -61,11 +87,22 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     const
 #endif
     u_char *id, int len, int *copy);
+static ngx_ssl_sess_id_t *ngx_ssl_session_cache_insert(
+    ngx_ssl_session_cache_t *cache, ngx_slab_pool_t *shpool, u_char *id,
+    size_t id_len, u_char *buf, size_t len, time_t expire);
+static void ngx_ssl_session_sync_queue(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, u_char *id, size_t id_len);
+static void ngx_ssl_session_slot_set(ngx_slab_pool_t *shpool,
+    ngx_ssl_session_bucket_t *bucket, ngx_ssl_sess_id_t *sess_id,
+    uint32_t hash, u_char *id, size_t id_len, u_char *session, size_t len,
+    time_t expire);
+static void ngx_ssl_session_cache_expire(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_uint_t n, ngx_uint_t force);
+static ngx_ssl_sess_id_t *ngx_ssl_session_cache_lookup_locked(
+    ngx_ssl_session_cache_t *cache, u_char *id, size_t len);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
-static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_ssl_get_session_cache_counter(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s, size_t offset);
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 static int ngx_ssl_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
@@ -1554,6 +1591,26 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 }
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#if (defined SSL_OP_ENABLE_KTLS && defined BIO_get_ktls_send && !NGX_WIN32)
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_ktls\" is not supported on this platform, ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
 {
@@ -1773,10 +1830,27 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return ngx_ssl_ocsp_validate(c);
     }
 
+#if (NGX_THREADS)
+
+    rc = c->ssl->thread_task ? ngx_ssl_handshake_thread(c, &n) : NGX_DECLINED;
+
+    if (rc == NGX_DECLINED) {
+        ngx_ssl_clear_error(c->log);
+
+        n = SSL_do_handshake(c->ssl->connection);
+
+    } else if (rc != NGX_OK) {
+        return rc;
+    }
+
+#else
+
     ngx_ssl_clear_error(c->log);
 
     n = SSL_do_handshake(c->ssl->connection);
 
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
@@ -1822,6 +1896,16 @@ ngx_ssl_handshake(ngx_connection_t *c)
             c->ssl->sendfile = 1;
         }
 
+#endif
+
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_recv(): 1");
+            c->ssl->ktls_recv = 1;
+        }
+
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -1877,33 +1961,264 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_THREADS)
+
+    if (sslerr == SSL_ERROR_WANT_X509_LOOKUP && c->ssl->thread_pool) {
+        return ngx_ssl_handshake_thread_post(c);
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
     c->ssl->no_send_shutdown = 1;
     c->read->eof = 1;
 
+    if (ngx_ssl_handshake_error(c, sslerr, err)) {
+        c->read->error = 1;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_uint_t
+ngx_ssl_handshake_error(ngx_connection_t *c, int sslerr, ngx_err_t err)
+{
     if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
         ngx_connection_error(c, err,
                              "peer closed connection in SSL handshake");
 
-        return NGX_ERROR;
+        return 0;
     }
 
     if (c->ssl->handshake_rejected) {
         ngx_connection_error(c, err, "handshake rejected");
         ERR_clear_error();
 
+        return 0;
+    }
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+
+    return 1;
+}
+
+
+#if (NGX_THREADS)
+
+int
+ngx_ssl_handshake_offload(ngx_ssl_conn_t *ssl_conn, void *arg)
+{
+    ngx_ssl_t  *ssl = arg;
+
+    ngx_connection_t  *c;
+
+    c = ngx_ssl_get_connection(ssl_conn);
+
+    /*
+     * The certificate callback is the last one called before private
+     * key operations, after the ClientHello and SNI callbacks, which
+     * are thus always run in the worker.  The handshake is suspended
+     * here, and the next step, which signs the handshake with the
+     * certificate key, is done in a thread.  Retrying the step calls
+     * the callback again, now in the thread, and it only returns.
+     *
+     * The same step calls the certificate status callback, and with
+     * TLSv1.2 the ALPN callback.  Staples are copied for the status
+     * callback here, see ngx_ssl_stapling_offload(), and both callbacks
+     * check ngx_ssl_handshake_offloaded() to only use these copies and
+     * configuration.
+     *
+     * QUIC handshakes are driven by the QUIC code and not offloaded.
+     */
+
+    if (c->ssl->thread_pool || c->type != SOCK_STREAM) {
+        return 1;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL handshake offload");
+
+    if (ngx_ssl_stapling_offload(c) != NGX_OK) {
+        return 0;
+    }
+
+    c->ssl->thread_pool = ssl->thread_pool;
+
+    return -1;
+}
+
+
+static ngx_int_t
+ngx_ssl_handshake_thread(ngx_connection_t *c, int *n)
+{
+    ngx_thread_task_t               *task;
+    ngx_ssl_handshake_thread_ctx_t  *ctx;
+
+    task = c->ssl->thread_task;
+
+    if (task->event.active) {
+        return NGX_AGAIN;
+    }
+
+    if (!task->event.complete) {
+        return NGX_DECLINED;
+    }
+
+    task->event.complete = 0;
+
+    ctx = task->ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_do_handshake in thread: %d, %d",
+                   ctx->n, ctx->sslerr);
+
+    if (ctx->error) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+        c->read->eof = 1;
+
+        if (ctx->fatal) {
+            c->read->error = 1;
+        }
+
         return NGX_ERROR;
     }
 
-    c->read->error = 1;
+    /*
+     * the socket readiness is not tracked while the step runs
+     * in a thread, so the handshake is continued in the worker
+     * if an event has been reported in the meantime
+     */
 
-    ngx_ssl_connection_error(c, sslerr, err, "SSL_do_handshake() failed");
+    if ((ctx->sslerr == SSL_ERROR_WANT_READ && c->read->ready)
+        || (ctx->sslerr == SSL_ERROR_WANT_WRITE && c->write->ready))
+    {
+        return NGX_DECLINED;
+    }
 
-    return NGX_ERROR;
+    /* SSL_get_error() checks the error queue of the calling thread */
+
+    ngx_ssl_clear_error(c->log);
+
+    *n = ctx->n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_handshake_thread_post(ngx_connection_t *c)
+{
+    ngx_thread_task_t               *task;
+    ngx_ssl_handshake_thread_ctx_t  *ctx;
+
+    task = c->ssl->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool,
+                                     sizeof(ngx_ssl_handshake_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_ssl_handshake_thread_handler;
+        task->event.handler = ngx_ssl_handshake_thread_event_handler;
+        task->event.data = c;
+        task->event.log = c->log;
+
+        ctx = task->ctx;
+        ctx->connection = c;
+
+        c->ssl->thread_task = task;
+    }
+
+    /*
+     * the connection is not touched by the worker until the task
+     * completes: events only mark readiness and timeouts
+     */
+
+    c->read->ready = 0;
+    c->write->ready = 0;
+
+    c->read->handler = ngx_ssl_handshake_thread_wait_handler;
+    c->write->handler = ngx_ssl_handshake_thread_wait_handler;
+
+    if (ngx_thread_task_post(c->ssl->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_handshake_thread_ctx_t *ctx = data;
+
+    ngx_err_t          err;
+    ngx_connection_t  *c;
+
+    c = ctx->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "SSL handshake thread");
+
+    ngx_ssl_clear_error(c->log);
+
+    ctx->n = SSL_do_handshake(c->ssl->connection);
+    ctx->sslerr = 0;
+    ctx->error = 0;
+    ctx->fatal = 0;
+
+    if (ctx->n == 1) {
+        return;
+    }
+
+    ctx->sslerr = SSL_get_error(c->ssl->connection, ctx->n);
+
+    if (ctx->sslerr == SSL_ERROR_WANT_READ
+        || ctx->sslerr == SSL_ERROR_WANT_WRITE)
+    {
+        return;
+    }
+
+    /*
+     * the OpenSSL error queue is per thread, so errors are logged here,
+     * while the connection flags are set in the worker on completion
+     */
+
+    err = (ctx->sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ctx->fatal = ngx_ssl_handshake_error(c, ctx->sslerr, err);
+    ctx->error = 1;
+}
+
+
+static void
+ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    c->read->handler = ngx_ssl_handshake_handler;
+    c->write->handler = ngx_ssl_handshake_handler;
+
+    ngx_ssl_handshake_handler(c->read);
+}
+
+
+static void
+ngx_ssl_handshake_thread_wait_handler(ngx_event_t *ev)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "SSL handshake thread wait handler: %d", ev->write);
 }
 
+#endif
+
 
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 
@@ -1967,6 +2282,16 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
             c->ssl->sendfile = 1;
         }
 
+#endif
+
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_recv(): 1");
+            c->ssl->ktls_recv = 1;
+        }
+
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -3868,6 +4193,7 @@ ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     size_t                    len;
+    ngx_uint_t                n;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_session_cache_t  *cache;
 
@@ -3883,7 +4209,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    cache = ngx_slab_calloc(shpool, sizeof(ngx_ssl_session_cache_t));
     if (cache == NULL) {
         return NGX_ERROR;
     }
@@ -3891,16 +4217,33 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
+    /*
+     * a bucket per kilobyte of the zone: with typical sessions
+     * the buckets take about a quarter of the zone
+     */
+
+    n = shm_zone->shm.size / 1024;
 
-    ngx_queue_init(&cache->expire_queue);
+    cache->buckets = ngx_slab_calloc(shpool,
+                                     n * sizeof(ngx_ssl_session_bucket_t));
+    if (cache->buckets == NULL) {
+        return NGX_ERROR;
+    }
 
-    cache->ticket_keys[0].expire = 0;
-    cache->ticket_keys[1].expire = 0;
-    cache->ticket_keys[2].expire = 0;
+    cache->nbuckets = n;
 
-    cache->fail_time = 0;
+    /*
+     * set by ngx_slab_calloc():
+     *
+     *     cache->sweep = 0;
+     *     cache->hits = 0;
+     *     cache->misses = 0;
+     *     cache->evictions = 0;
+     *     cache->ticket_keys[].expire = 0;
+     *     cache->ticket_keys_time = 0;
+     *     cache->fail_time = 0;
+     *     cache->sync = NULL;
+     */
 
     len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
@@ -3924,12 +4267,15 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * Typical length of the external ASN1 representation of a session
  * is about 150 bytes plus SNI server name.
  *
- * On 32-bit platforms we allocate an rbtree node, a session id, and
- * an ASN1 representation in a single allocation, it typically takes
- * 256 bytes.
- *
- * On 64-bit platforms we allocate separately an rbtree node + session_id,
- * and an ASN1 representation, they take accordingly 128 and 256 bytes.
+ * Sessions are kept in a hash table of buckets with a few slots each,
+ * the ASN1 representation is allocated separately.  Modifications are
+ * made under the shared pool mutex, and each bucket has a sequence
+ * counter which is odd while the bucket is being modified: lookups
+ * copy the session without locking and retry if the counter changed.
+ * Session memory is freed only after the counter is updated, so
+ * a lookup racing with an update at most reads stale data, which is
+ * then discarded.  Expired sessions are removed by the background
+ * sweep, or when their slots are reused.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
  * so they are outside the code locked by shared pool mutex
@@ -3940,8 +4286,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 {
     int                       len;
     u_char                   *p, *session_id;
-    size_t                    n;
-    uint32_t                  hash;
     SSL_CTX                  *ssl_ctx;
     unsigned int              session_id_length;
     ngx_shm_zone_t           *shm_zone;
@@ -3997,360 +4341,529 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
-
-#if (NGX_PTR_SIZE == 8)
-    n = sizeof(ngx_ssl_sess_id_t);
-#else
-    n = offsetof(ngx_ssl_sess_id_t, session) + len;
-#endif
-
-    sess_id = ngx_slab_alloc_locked(shpool, n);
+    sess_id = ngx_ssl_session_cache_insert(cache, shpool, session_id,
+                                           session_id_length, buf, len,
+                                           ngx_time()
+                                           + SSL_CTX_get_timeout(ssl_ctx));
 
     if (sess_id == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
 
-        /* drop the oldest non-expired session and try once more */
+        if (cache->fail_time != ngx_time()) {
+            cache->fail_time = ngx_time();
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "could not allocate new session%s",
+                          shpool->log_ctx);
+        }
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        return 0;
+    }
 
-        sess_id = ngx_slab_alloc_locked(shpool, n);
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl new session: %08XD:%ud:%d",
+                   sess_id->hash, session_id_length, len);
 
-        if (sess_id == NULL) {
-            goto failed;
-        }
+    if (shm_zone->sync) {
+        ngx_ssl_session_sync_queue(cache, shpool, session_id,
+                                   session_id_length);
     }
 
-#if (NGX_PTR_SIZE == 8)
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    sess_id->session = ngx_slab_alloc_locked(shpool, len);
+    return 0;
+}
 
-    if (sess_id->session == NULL) {
 
-        /* drop the oldest non-expired session and try once more */
+static ngx_ssl_sess_id_t *
+ngx_ssl_session_cache_insert(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, u_char *id, size_t id_len, u_char *buf,
+    size_t len, time_t expire)
+{
+    u_char                    *session;
+    uint32_t                   hash;
+    ngx_uint_t                 i;
+    ngx_ssl_sess_id_t         *sess_id, *slot;
+    ngx_ssl_session_bucket_t  *bucket;
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+    hash = ngx_crc32_short(id, id_len);
+    bucket = &cache->buckets[hash % cache->nbuckets];
 
-        sess_id->session = ngx_slab_alloc_locked(shpool, len);
+    /*
+     * use the slot of the same session, a free slot, or
+     * the slot of the session which expires first
+     */
 
-        if (sess_id->session == NULL) {
-            goto failed;
-        }
-    }
+    slot = NULL;
 
-#endif
+    for (i = 0; i < NGX_SSL_SESSION_SLOTS; i++) {
+        sess_id = &bucket->slots[i];
 
-    ngx_memcpy(sess_id->session, buf, len);
-    ngx_memcpy(sess_id->id, session_id, session_id_length);
+        if (sess_id->len == 0) {
+            if (slot == NULL || slot->len) {
+                slot = sess_id;
+            }
 
-    hash = ngx_crc32_short(session_id, session_id_length);
+            continue;
+        }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl new session: %08XD:%ud:%d",
-                   hash, session_id_length, len);
+        if (sess_id->hash == hash
+            && ngx_memn2cmp(id, sess_id->id, id_len, sess_id->id_len) == 0)
+        {
+            slot = sess_id;
+            break;
+        }
 
-    sess_id->node.key = hash;
-    sess_id->node.data = (u_char) session_id_length;
-    sess_id->len = len;
+        if (slot == NULL || (slot->len && sess_id->expire < slot->expire)) {
+            slot = sess_id;
+        }
+    }
 
-    sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
+    session = ngx_slab_alloc_locked(shpool, len);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    if (session == NULL) {
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+        /* drop expired sessions and try once more */
 
-    ngx_shmtx_unlock(&shpool->mutex);
+        ngx_ssl_session_cache_expire(cache, shpool, cache->nbuckets / 16 + 1,
+                                     0);
 
-    return 0;
+        session = ngx_slab_alloc_locked(shpool, len);
 
-failed:
+        /* drop a few live sessions */
 
-    if (sess_id) {
-        ngx_slab_free_locked(shpool, sess_id);
+        for (i = 0; session == NULL && i < 4; i++) {
+            ngx_ssl_session_cache_expire(cache, shpool, 1, 1);
+            session = ngx_slab_alloc_locked(shpool, len);
+        }
+
+        if (session == NULL) {
+            return NULL;
+        }
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_memcpy(session, buf, len);
 
-    if (cache->fail_time != ngx_time()) {
-        cache->fail_time = ngx_time();
-        ngx_log_error(NGX_LOG_WARN, c->log, 0,
-                      "could not allocate new session%s", shpool->log_ctx);
+    if (slot->len
+        && slot->expire > ngx_time()
+        && ngx_memn2cmp(id, slot->id, id_len, slot->id_len) != 0)
+    {
+        (void) ngx_atomic_fetch_add(&cache->evictions, 1);
     }
 
-    return 0;
+    ngx_ssl_session_slot_set(shpool, bucket, slot, hash, id, id_len,
+                             session, len, expire);
+
+    return slot;
 }
 
 
-static ngx_ssl_session_t *
-ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
-#if OPENSSL_VERSION_NUMBER >= 0x10100003L
-    const
-#endif
-    u_char *id, int len, int *copy)
+static void
+ngx_ssl_session_slot_set(ngx_slab_pool_t *shpool,
+    ngx_ssl_session_bucket_t *bucket, ngx_ssl_sess_id_t *sess_id,
+    uint32_t hash, u_char *id, size_t id_len, u_char *session, size_t len,
+    time_t expire)
 {
-    size_t                    slen;
-    uint32_t                  hash;
-    ngx_int_t                 rc;
-    const u_char             *p;
-    ngx_shm_zone_t           *shm_zone;
-    ngx_slab_pool_t          *shpool;
-    ngx_rbtree_node_t        *node, *sentinel;
-    ngx_ssl_session_t        *sess;
-    ngx_ssl_sess_id_t        *sess_id;
-    ngx_ssl_session_cache_t  *cache;
-    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
-    ngx_connection_t         *c;
+    u_char  *old;
+    size_t   old_len;
 
-    hash = ngx_crc32_short((u_char *) (uintptr_t) id, (size_t) len);
-    *copy = 0;
-
-    c = ngx_ssl_get_connection(ssl_conn);
-
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl get session: %08XD:%d", hash, len);
-
-    shm_zone = SSL_CTX_get_ex_data(c->ssl->session_ctx,
-                                   ngx_ssl_session_cache_index);
+    old = sess_id->len ? sess_id->session : NULL;
+    old_len = sess_id->len;
 
-    cache = shm_zone->data;
+    (void) ngx_atomic_fetch_add(&bucket->seq, 1);
+    ngx_memory_barrier();
 
-    sess = NULL;
+    sess_id->hash = hash;
+    sess_id->id_len = (u_char) id_len;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (id_len) {
+        ngx_memcpy(sess_id->id, id, id_len);
+    }
 
-    ngx_shmtx_lock(&shpool->mutex);
+    sess_id->len = len;
+    sess_id->expire = expire;
+    sess_id->session = session;
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    ngx_memory_barrier();
+    (void) ngx_atomic_fetch_add(&bucket->seq, 1);
 
-    while (node != sentinel) {
+    if (old) {
+        ngx_explicit_memzero(old, old_len);
+        ngx_slab_free_locked(shpool, old);
+    }
+}
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
+static void
+ngx_ssl_session_cache_expire(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_uint_t n, ngx_uint_t force)
+{
+    time_t                     now;
+    ngx_uint_t                 i;
+    ngx_ssl_sess_id_t         *sess_id, *oldest;
+    ngx_ssl_session_bucket_t  *bucket;
 
-        /* hash == node->key */
+    now = ngx_time();
 
-        sess_id = (ngx_ssl_sess_id_t *) node;
+    if (n > cache->nbuckets) {
+        n = cache->nbuckets;
+    }
 
-        rc = ngx_memn2cmp((u_char *) (uintptr_t) id, sess_id->id,
-                          (size_t) len, (size_t) node->data);
+    while (n--) {
+        bucket = &cache->buckets[cache->sweep];
 
-        if (rc == 0) {
+        if (++cache->sweep == cache->nbuckets) {
+            cache->sweep = 0;
+        }
 
-            if (sess_id->expire > ngx_time()) {
-                slen = sess_id->len;
+        oldest = NULL;
 
-                ngx_memcpy(buf, sess_id->session, slen);
+        for (i = 0; i < NGX_SSL_SESSION_SLOTS; i++) {
+            sess_id = &bucket->slots[i];
 
-                ngx_shmtx_unlock(&shpool->mutex);
+            if (sess_id->len == 0) {
+                continue;
+            }
 
-                p = buf;
-                sess = d2i_SSL_SESSION(NULL, &p, slen);
+            if (sess_id->expire <= now) {
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                               "expire session: %08XD", sess_id->hash);
 
-                return sess;
+                ngx_ssl_session_slot_set(shpool, bucket, sess_id, 0, NULL, 0,
+                                         NULL, 0, 0);
+                continue;
             }
 
-            ngx_queue_remove(&sess_id->queue);
+            if (oldest == NULL || sess_id->expire < oldest->expire) {
+                oldest = sess_id;
+            }
+        }
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+        if (force && oldest) {
+            ngx_ssl_session_slot_set(shpool, bucket, oldest, 0, NULL, 0,
+                                     NULL, 0, 0);
 
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
+            (void) ngx_atomic_fetch_add(&cache->evictions, 1);
+        }
+    }
+}
 
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
 
-            sess = NULL;
+void
+ngx_ssl_session_cache_sweep(ngx_shm_zone_t *shm_zone)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_cache_t  *cache;
 
-            goto done;
-        }
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-        node = (rc < 0) ? node->left : node->right;
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        return;
     }
 
-done:
+    /* the whole cache is swept in about 16 calls */
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_ssl_session_cache_expire(cache, shpool, cache->nbuckets / 16 + 1, 0);
 
-    return sess;
+    ngx_shmtx_unlock(&shpool->mutex);
 }
 
 
-void
-ngx_ssl_remove_cached_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
+static void
+ngx_ssl_session_sync_queue(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, u_char *id, size_t id_len)
 {
-    SSL_CTX_remove_session(ssl, sess);
+    u_char                  *p;
+    ngx_ssl_session_sync_t  *sync;
 
-    ngx_ssl_remove_session(ssl, sess);
+    sync = cache->sync;
+
+    if (sync == NULL) {
+        sync = ngx_slab_calloc_locked(shpool, sizeof(ngx_ssl_session_sync_t));
+        if (sync == NULL) {
+            return;
+        }
+
+        cache->sync = sync;
+    }
+
+    if (sync->npending == NGX_SSL_SESSION_SYNC_PENDING) {
+        sync->lost++;
+        return;
+    }
+
+    p = sync->pending[sync->npending++];
+
+    *p++ = (u_char) id_len;
+    ngx_memcpy(p, id, id_len);
 }
 
 
-static void
-ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
+ngx_int_t
+ngx_ssl_session_cache_add(ngx_shm_zone_t *shm_zone, u_char *id,
+    size_t id_len, u_char *buf, size_t len, time_t expire, ngx_log_t *log)
 {
-    u_char                   *id;
-    uint32_t                  hash;
-    ngx_int_t                 rc;
-    unsigned int              len;
-    ngx_shm_zone_t           *shm_zone;
     ngx_slab_pool_t          *shpool;
-    ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
     ngx_ssl_session_cache_t  *cache;
 
-    shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
-
-    if (shm_zone == NULL) {
-        return;
+    if (id_len > 32 || len == 0 || len > NGX_SSL_MAX_SESSION_SIZE) {
+        return NGX_DECLINED;
     }
 
     cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    id = (u_char *) SSL_SESSION_get_id(sess, &len);
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (ngx_ssl_session_cache_lookup_locked(cache, id, id_len) != NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    sess_id = ngx_ssl_session_cache_insert(cache, shpool, id, id_len, buf, len,
+                                           expire);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (sess_id == NULL) {
+        if (cache->fail_time != ngx_time()) {
+            cache->fail_time = ngx_time();
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "could not allocate new session%s",
+                          shpool->log_ctx);
+        }
+
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl add session: %08XD:%uz:%uz",
+                   ngx_crc32_short(id, id_len), id_len, len);
+
+    return NGX_OK;
+}
+
+
+static ngx_ssl_sess_id_t *
+ngx_ssl_session_cache_lookup_locked(ngx_ssl_session_cache_t *cache,
+    u_char *id, size_t len)
+{
+    uint32_t                   hash;
+    ngx_uint_t                 i;
+    ngx_ssl_sess_id_t         *sess_id;
+    ngx_ssl_session_bucket_t  *bucket;
 
     hash = ngx_crc32_short(id, len);
+    bucket = &cache->buckets[hash % cache->nbuckets];
+
+    for (i = 0; i < NGX_SSL_SESSION_SLOTS; i++) {
+        sess_id = &bucket->slots[i];
+
+        if (sess_id->len
+            && sess_id->hash == hash
+            && ngx_memn2cmp(id, sess_id->id, len, sess_id->id_len) == 0)
+        {
+            return sess_id;
+        }
+    }
+
+    return NULL;
+}
 
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
-                   "ssl remove session: %08XD:%ud", hash, len);
 
+size_t
+ngx_ssl_session_cache_get(ngx_shm_zone_t *shm_zone, u_char *id, size_t len,
+    u_char *buf, time_t *expire)
+{
+    size_t                     size;
+    time_t                     valid;
+    uint32_t                   hash;
+    ngx_uint_t                 i, tries;
+    ngx_atomic_uint_t          seq;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_sess_id_t         *sess_id;
+    ngx_ssl_session_cache_t   *cache;
+    ngx_ssl_session_bucket_t  *bucket;
+
+    cache = shm_zone->data;
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    ngx_shmtx_lock(&shpool->mutex);
+    hash = ngx_crc32_short(id, len);
+    bucket = &cache->buckets[hash % cache->nbuckets];
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    for (tries = 0; tries < 16; tries++) {
 
-    while (node != sentinel) {
+        seq = bucket->seq;
 
-        if (hash < node->key) {
-            node = node->left;
+        if (seq & 1) {
+            ngx_cpu_pause();
             continue;
         }
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
+        ngx_memory_barrier();
 
-        /* hash == node->key */
+        size = 0;
+        valid = 0;
 
-        sess_id = (ngx_ssl_sess_id_t *) node;
+        for (i = 0; i < NGX_SSL_SESSION_SLOTS; i++) {
+            sess_id = &bucket->slots[i];
 
-        rc = ngx_memn2cmp(id, sess_id->id, len, (size_t) node->data);
+            if (sess_id->len == 0
+                || sess_id->hash != hash
+                || sess_id->id_len != len
+                || ngx_memcmp(id, sess_id->id, len) != 0)
+            {
+                continue;
+            }
 
-        if (rc == 0) {
+            size = sess_id->len;
+            valid = sess_id->expire;
 
-            ngx_queue_remove(&sess_id->queue);
+            /* the slot may be concurrently modified, check the bounds */
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            if (size > NGX_SSL_MAX_SESSION_SIZE
+                || sess_id->session < shpool->start
+                || sess_id->session + size > shpool->end)
+            {
+                size = 0;
+                break;
+            }
 
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
+            ngx_memcpy(buf, sess_id->session, size);
+            break;
+        }
 
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
+        ngx_memory_barrier();
 
-            goto done;
+        if (bucket->seq != seq) {
+            continue;
+        }
+
+        if (size == 0 || valid <= ngx_time()) {
+            return 0;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        *expire = valid;
+
+        return size;
     }
 
-done:
+    /* the bucket is too busy, fall back to locking */
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sess_id = ngx_ssl_session_cache_lookup_locked(cache, id, len);
+
+    if (sess_id == NULL || sess_id->expire <= ngx_time()) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return 0;
+    }
+
+    size = sess_id->len;
+    *expire = sess_id->expire;
+
+    ngx_memcpy(buf, sess_id->session, size);
 
     ngx_shmtx_unlock(&shpool->mutex);
+
+    return size;
 }
 
 
-static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+static ngx_ssl_session_t *
+ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
+#if OPENSSL_VERSION_NUMBER >= 0x10100003L
+    const
+#endif
+    u_char *id, int len, int *copy)
 {
-    time_t              now;
-    ngx_queue_t        *q;
-    ngx_ssl_sess_id_t  *sess_id;
+    size_t                    slen;
+    time_t                    expire;
+    const u_char             *p;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_connection_t         *c;
+    ngx_ssl_session_cache_t  *cache;
+    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
-    now = ngx_time();
+    *copy = 0;
 
-    while (n < 3) {
+    c = ngx_ssl_get_connection(ssl_conn);
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
-            return;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl get session: %08XD:%d",
+                   ngx_crc32_short((u_char *) (uintptr_t) id, (size_t) len),
+                   len);
 
-        q = ngx_queue_last(&cache->expire_queue);
+    shm_zone = SSL_CTX_get_ex_data(c->ssl->session_ctx,
+                                   ngx_ssl_session_cache_index);
 
-        sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
+    cache = shm_zone->data;
 
-        if (n++ != 0 && sess_id->expire > now) {
-            return;
-        }
+    slen = ngx_ssl_session_cache_get(shm_zone, (u_char *) (uintptr_t) id,
+                                     (size_t) len, buf, &expire);
+
+    if (slen == 0) {
+        (void) ngx_atomic_fetch_add(&cache->misses, 1);
+        return NULL;
+    }
 
-        ngx_queue_remove(q);
+    (void) ngx_atomic_fetch_add(&cache->hits, 1);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
-                       "expire session: %08Xi", sess_id->node.key);
+    p = buf;
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+    return d2i_SSL_SESSION(NULL, &p, slen);
+}
 
-        ngx_explicit_memzero(sess_id->session, sess_id->len);
 
-#if (NGX_PTR_SIZE == 8)
-        ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-        ngx_slab_free_locked(shpool, sess_id);
-    }
+void
+ngx_ssl_remove_cached_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
+{
+    SSL_CTX_remove_session(ssl, sess);
+
+    ngx_ssl_remove_session(ssl, sess);
 }
 
 
 static void
-ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 {
-    ngx_rbtree_node_t  **p;
-    ngx_ssl_sess_id_t   *sess_id, *sess_id_temp;
+    u_char                    *id;
+    unsigned int               len;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_sess_id_t         *sess_id;
+    ngx_ssl_session_cache_t   *cache;
+    ngx_ssl_session_bucket_t  *bucket;
 
-    for ( ;; ) {
+    shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
 
-        if (node->key < temp->key) {
+    if (shm_zone == NULL) {
+        return;
+    }
 
-            p = &temp->left;
+    cache = shm_zone->data;
 
-        } else if (node->key > temp->key) {
+    id = (u_char *) SSL_SESSION_get_id(sess, &len);
 
-            p = &temp->right;
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "ssl remove session: %08XD:%ud",
+                   ngx_crc32_short(id, len), len);
 
-        } else { /* node->key == temp->key */
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-            sess_id = (ngx_ssl_sess_id_t *) node;
-            sess_id_temp = (ngx_ssl_sess_id_t *) temp;
+    ngx_shmtx_lock(&shpool->mutex);
 
-            p = (ngx_memn2cmp(sess_id->id, sess_id_temp->id,
-                              (size_t) node->data, (size_t) temp->data)
-                 < 0) ? &temp->left : &temp->right;
-        }
+    sess_id = ngx_ssl_session_cache_lookup_locked(cache, id, len);
 
-        if (*p == sentinel) {
-            break;
-        }
+    if (sess_id) {
+        bucket = &cache->buckets[sess_id->hash % cache->nbuckets];
 
-        temp = *p;
+        ngx_ssl_session_slot_set(shpool, bucket, sess_id, 0, NULL, 0, NULL, 0,
+                                 0);
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    ngx_shmtx_unlock(&shpool->mutex);
 }
 
 
@@ -4730,6 +5243,8 @@ ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
          */
 
         key[2] = key[0];
+
+        cache->ticket_keys_time = now;
     }
 
     if (key[1].expire < now) {
@@ -4743,6 +5258,8 @@ ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
         key[1] = key[0];
         key[0] = key[2];
 
+        cache->ticket_keys_time = now;
+
         if (RAND_bytes(buf, 80) != 1) {
             ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
             ngx_shmtx_unlock(&shpool->mutex);
@@ -4772,10 +5289,14 @@ ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
         key[0].expire = expire;
     }
 
-    /* sync keys to the worker process memory */
+    /*
+     * sync keys to the worker process memory; the next key is copied
+     * as well, so tickets issued by nodes of a session sync cluster
+     * which already switched to it can be decrypted
+     */
 
     ngx_memcpy(keys->elts, cache->ticket_keys,
-               2 * sizeof(ngx_ssl_ticket_key_t));
+               3 * sizeof(ngx_ssl_ticket_key_t));
 
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -5241,6 +5762,154 @@ ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_session_cache_hits(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_counter(c, pool, s,
+                           offsetof(ngx_ssl_session_cache_t, hits));
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_cache_misses(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_counter(c, pool, s,
+                           offsetof(ngx_ssl_session_cache_t, misses));
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_cache_evictions(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    return ngx_ssl_get_session_cache_counter(c, pool, s,
+                           offsetof(ngx_ssl_session_cache_t, evictions));
+}
+
+
+static ngx_int_t
+ngx_ssl_get_session_cache_counter(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s, size_t offset)
+{
+    ngx_shm_zone_t  *shm_zone;
+
+    shm_zone = SSL_CTX_get_ex_data(c->ssl->session_ctx,
+                                   ngx_ssl_session_cache_index);
+
+    if (shm_zone == NULL) {
+        s->len = 0;
+        return NGX_OK;
+    }
+
+    s->data = ngx_pnalloc(pool, NGX_ATOMIC_T_LEN);
+    if (s->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->len = ngx_sprintf(s->data, "%uA",
+                         *(ngx_atomic_t *) ((u_char *) shm_zone->data + offset))
+             - s->data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_ktls_send(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    s->data = (u_char *) ngx_ssl_ktls_state(c, 1);
+    s->len = ngx_strlen(s->data);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_ktls_recv(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    s->data = (u_char *) ngx_ssl_ktls_state(c, 0);
+    s->len = ngx_strlen(s->data);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Kernel TLS is either "on", or the reason it is not used: "off" if not
+ * enabled in the configuration, "unsupported" if not supported by the
+ * SSL library, "protocol" or "cipher" if the negotiated parameters are
+ * not supported by the library or kernel, "kernel" if the kernel refused
+ * to enable it (e.g., the "tls" module is not loaded)
+ */
+
+static char *
+ngx_ssl_ktls_state(ngx_connection_t *c, ngx_uint_t send)
+{
+#if (defined SSL_OP_ENABLE_KTLS && defined BIO_get_ktls_send && !NGX_WIN32)
+
+    int                nid;
+    const SSL_CIPHER  *cipher;
+
+    if (send ? c->ssl->sendfile : c->ssl->ktls_recv) {
+        return "on";
+    }
+
+    if (!(SSL_get_options(c->ssl->connection) & SSL_OP_ENABLE_KTLS)) {
+        return "off";
+    }
+
+    switch (SSL_version(c->ssl->connection)) {
+
+    case TLS1_2_VERSION:
+        break;
+
+#ifdef TLS1_3_VERSION
+    case TLS1_3_VERSION:
+
+#if (OPENSSL_VERSION_NUMBER < 0x30200000L)
+        /* receiving is supported for TLSv1.3 since OpenSSL 3.2 */
+
+        if (!send) {
+            return "protocol";
+        }
+#endif
+
+        break;
+#endif
+
+    default:
+        return "protocol";
+    }
+
+    cipher = SSL_get_current_cipher(c->ssl->connection);
+    if (cipher == NULL) {
+        return "cipher";
+    }
+
+    nid = SSL_CIPHER_get_cipher_nid(cipher);
+
+    if (nid != NID_aes_128_gcm
+        && nid != NID_aes_256_gcm
+#ifdef NID_chacha20_poly1305
+        && nid != NID_chacha20_poly1305
+#endif
+        && nid != NID_aes_128_ccm)
+    {
+        return "cipher";
+    }
+
+    return "kernel";
+
+#else
+
+    return "unsupported";
+
+#endif
+}
+
+
 ngx_int_t
 ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
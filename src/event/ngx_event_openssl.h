@@ -90,6 +90,9 @@ struct ngx_ssl_s {
     SSL_CTX                    *ctx;
     ngx_log_t                  *log;
     size_t                      buffer_size;
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+#endif
 };
 
 
@@ -111,6 +114,12 @@ struct ngx_ssl_connection_s {
 
     ngx_ssl_ocsp_t             *ocsp;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *thread_task;
+    ngx_array_t                *staples;
+#endif
+
     u_char                      early_buf;
 
     unsigned                    handshaked:1;
@@ -118,6 +127,7 @@ struct ngx_ssl_connection_s {
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    sendfile:1;
+    unsigned                    ktls_recv:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    shutdown_without_free:1;
@@ -139,20 +149,22 @@ struct ngx_ssl_connection_s {
 
 #define NGX_SSL_MAX_SESSION_SIZE  4096
 
-typedef struct ngx_ssl_sess_id_s  ngx_ssl_sess_id_t;
+#define NGX_SSL_SESSION_SLOTS     4
 
-struct ngx_ssl_sess_id_s {
-    ngx_rbtree_node_t           node;
+typedef struct {
+    uint32_t                    hash;
+    u_char                      id_len;
+    u_char                      id[32];
     size_t                      len;
-    ngx_queue_t                 queue;
     time_t                      expire;
-    u_char                      id[32];
-#if (NGX_PTR_SIZE == 8)
     u_char                     *session;
-#else
-    u_char                      session[1];
-#endif
-};
+} ngx_ssl_sess_id_t;
+
+
+typedef struct {
+    ngx_atomic_t                seq;
+    ngx_ssl_sess_id_t           slots[NGX_SSL_SESSION_SLOTS];
+} ngx_ssl_session_bucket_t;
 
 
 typedef struct {
@@ -165,12 +177,27 @@ typedef struct {
 } ngx_ssl_ticket_key_t;
 
 
+#define NGX_SSL_SESSION_SYNC_PENDING  1024
+
+
+typedef struct {
+    ngx_uint_t                  npending;
+    ngx_uint_t                  lost;
+    u_char                      pending[NGX_SSL_SESSION_SYNC_PENDING][33];
+} ngx_ssl_session_sync_t;
+
+
 typedef struct {
-    ngx_rbtree_t                session_rbtree;
-    ngx_rbtree_node_t           sentinel;
-    ngx_queue_t                 expire_queue;
+    ngx_ssl_session_bucket_t   *buckets;
+    ngx_uint_t                  nbuckets;
+    ngx_uint_t                  sweep;
+    ngx_atomic_t                hits;
+    ngx_atomic_t                misses;
+    ngx_atomic_t                evictions;
     ngx_ssl_ticket_key_t        ticket_keys[3];
+    time_t                      ticket_keys_time;
     time_t                      fail_time;
+    ngx_ssl_session_sync_t     *sync;
 } ngx_ssl_session_cache_t;
 
 
@@ -197,6 +224,12 @@ ngx_int_t ngx_ssl_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords);
 ngx_int_t ngx_ssl_connection_certificate(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords);
+#if (NGX_THREADS)
+int ngx_ssl_handshake_offload(ngx_ssl_conn_t *ssl_conn, void *arg);
+#define ngx_ssl_handshake_offloaded(c)  ((c)->ssl->thread_pool != NULL)
+#else
+#define ngx_ssl_handshake_offloaded(c)  0
+#endif
 
 ngx_int_t ngx_ssl_ciphers(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *ciphers,
     ngx_uint_t prefer_server_ciphers);
@@ -209,6 +242,9 @@ ngx_int_t ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_str_t *file, ngx_str_t *responder, ngx_uint_t verify);
 ngx_int_t ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_resolver_t *resolver, ngx_msec_t resolver_timeout);
+#if (NGX_THREADS)
+ngx_int_t ngx_ssl_stapling_offload(ngx_connection_t *c);
+#endif
 ngx_int_t ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone);
 ngx_int_t ngx_ssl_ocsp_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
@@ -226,6 +262,7 @@ ngx_int_t ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file);
 ngx_int_t ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name);
 ngx_int_t ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_uint_t enable);
+ngx_int_t ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable);
 ngx_int_t ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *commands);
 
@@ -237,6 +274,12 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_int_t ngx_ssl_session_cache_add(ngx_shm_zone_t *shm_zone, u_char *id,
+    size_t id_len, u_char *buf, size_t len, time_t expire, ngx_log_t *log);
+size_t ngx_ssl_session_cache_get(ngx_shm_zone_t *shm_zone, u_char *id,
+    size_t len, u_char *buf, time_t *expire);
+void ngx_ssl_session_cache_sweep(ngx_shm_zone_t *shm_zone);
+ngx_int_t ngx_ssl_session_cache_sync(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone);
 
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
@@ -275,8 +318,18 @@ ngx_int_t ngx_ssl_get_session_id(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_hits(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_misses(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_cache_evictions(ngx_connection_t *c,
+    ngx_pool_t *pool, ngx_str_t *s);
 ngx_int_t ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_ktls_send(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_ktls_recv(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
 ngx_int_t ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_alpn_protocol(ngx_connection_t *c, ngx_pool_t *pool,
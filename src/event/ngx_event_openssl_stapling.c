@@ -43,6 +43,16 @@ typedef struct {
 } ngx_ssl_stapling_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    X509                        *cert;
+    ngx_str_t                    staple;
+} ngx_ssl_stapling_copy_t;
+
+#endif
+
+
 typedef struct {
     ngx_addr_t                  *addrs;
     ngx_uint_t                   naddrs;
@@ -154,6 +164,10 @@ static ngx_int_t ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
 
 static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
     void *data);
+#if (NGX_THREADS)
+static int ngx_ssl_certificate_status_offloaded(ngx_connection_t *c,
+    X509 *cert);
+#endif
 static void ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx);
 
@@ -572,9 +586,6 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 
     c = ngx_ssl_get_connection(ssl_conn);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "SSL certificate status callback");
-
     rc = SSL_TLSEXT_ERR_NOACK;
 
     cert = SSL_get_certificate(ssl_conn);
@@ -583,6 +594,17 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         return rc;
     }
 
+#if (NGX_THREADS)
+
+    if (ngx_ssl_handshake_offloaded(c)) {
+        return ngx_ssl_certificate_status_offloaded(c, cert);
+    }
+
+#endif
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL certificate status callback");
+
     staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
 
     if (staple == NULL) {
@@ -613,6 +635,118 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 }
 
 
+#if (NGX_THREADS)
+
+ngx_int_t
+ngx_ssl_stapling_offload(ngx_connection_t *c)
+{
+    X509                     *cert;
+    SSL_CTX                  *ssl_ctx;
+    ngx_ssl_stapling_t       *staple;
+    ngx_ssl_stapling_copy_t  *copy;
+
+    /*
+     * The status callback is called in the handshake step offloaded
+     * to a thread, after the certificate is selected.  Staples of all
+     * certificates are thus copied here, in the worker, and the update
+     * of staples, which uses the resolver, timers and connections,
+     * is started here as well.
+     */
+
+#ifdef SSL_CTRL_GET_TLSEXT_STATUS_REQ_TYPE
+
+    if (SSL_get_tlsext_status_type(c->ssl->connection)
+        != TLSEXT_STATUSTYPE_ocsp)
+    {
+        return NGX_OK;
+    }
+
+#endif
+
+    ssl_ctx = SSL_get_SSL_CTX(c->ssl->connection);
+
+    for (cert = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+        if (staple == NULL) {
+            continue;
+        }
+
+        if (staple->staple.len
+            && staple->valid >= ngx_time())
+        {
+            if (c->ssl->staples == NULL) {
+                c->ssl->staples = ngx_array_create(c->pool, 2,
+                                              sizeof(ngx_ssl_stapling_copy_t));
+                if (c->ssl->staples == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            copy = ngx_array_push(c->ssl->staples);
+            if (copy == NULL) {
+                return NGX_ERROR;
+            }
+
+            copy->cert = cert;
+            copy->staple.len = staple->staple.len;
+
+            copy->staple.data = ngx_pstrdup(c->pool, &staple->staple);
+            if (copy->staple.data == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_ssl_stapling_update(staple);
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_ssl_certificate_status_offloaded(ngx_connection_t *c, X509 *cert)
+{
+    u_char                   *p;
+    ngx_uint_t                i;
+    ngx_ssl_stapling_copy_t  *copy;
+
+    /* called in a thread: only the copies made in the worker are used */
+
+    if (c->ssl->staples == NULL) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    copy = c->ssl->staples->elts;
+
+    for (i = 0; i < c->ssl->staples->nelts; i++) {
+
+        if (copy[i].cert != cert) {
+            continue;
+        }
+
+        p = OPENSSL_malloc(copy[i].staple.len);
+        if (p == NULL) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+
+        ngx_memcpy(p, copy[i].staple.data, copy[i].staple.len);
+
+        SSL_set_tlsext_status_ocsp_resp(c->ssl->connection, p,
+                                        copy[i].staple.len);
+
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+#endif
+
+
 static void
 ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
 {
@@ -2729,6 +2863,17 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+#if (NGX_THREADS)
+
+ngx_int_t
+ngx_ssl_stapling_offload(ngx_connection_t *c)
+{
+    return NGX_OK;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone)
@@ -0,0 +1,1297 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * Shared SSL session caches with the "sync" parameter are replicated
+ * between nodes: new sessions are queued in the shared memory zone and
+ * periodically sent to all peers over UDP, lookups stay local.  Ticket
+ * keys kept in such caches are exchanged as well: a node adopts the
+ * current and the next keys of a peer which switched to its current key
+ * later, so that after a rotation all nodes converge on the same keys.
+ *
+ * Datagrams are encrypted and authenticated with AES-256-GCM using
+ * the key from the "ssl_session_sync_key" file:
+ *
+ *     "NSSS" version:1 type:1 nonce:12 ciphertext tag:16
+ *
+ * with the plaintext being:
+ *
+ *     time:8 name_len:1 name payload
+ *
+ * where the payload of the "sessions" type is:
+ *
+ *     { id_len:1 ttl:4 len:2 id session }...
+ *
+ * and the payload of the "keys" type is:
+ *
+ *     since:8 ttl:4 current:80 next:80
+ *
+ * The module also runs the background sweep of expired sessions for
+ * all shared SSL session caches, synced or not.
+ */
+
+#define NGX_SSL_SYNC_VERSION   1
+
+#define NGX_SSL_SYNC_SESSIONS  1
+#define NGX_SSL_SYNC_KEYS      2
+
+#define NGX_SSL_SYNC_HEADER    18
+#define NGX_SSL_SYNC_TAG       16
+#define NGX_SSL_SYNC_MTU       1400
+#define NGX_SSL_SYNC_BUFFER    8192
+#define NGX_SSL_SYNC_STAGING   8192
+
+#define NGX_SSL_SYNC_SKEW      30
+
+
+typedef struct {
+    ngx_addr_t                *listen;
+    ngx_array_t                peers;     /* ngx_addr_t */
+    ngx_array_t                zones;     /* ngx_shm_zone_t * */
+    ngx_msec_t                 interval;
+    u_char                    *key;
+} ngx_openssl_sync_conf_t;
+
+
+typedef struct {
+    ngx_connection_t          *connection;
+    ngx_event_t                event;
+    ngx_event_t                sweep;
+    time_t                     keys_sent;
+    ngx_openssl_sync_conf_t   *conf;
+} ngx_openssl_sync_t;
+
+
+static void ngx_ssl_sync_flush_sessions(ngx_openssl_sync_t *sync,
+    ngx_shm_zone_t *shm_zone);
+static void ngx_ssl_sync_flush_keys(ngx_openssl_sync_t *sync,
+    ngx_shm_zone_t *shm_zone);
+static void ngx_ssl_sync_send(ngx_openssl_sync_t *sync, ngx_uint_t type,
+    ngx_shm_zone_t *shm_zone, u_char *payload, size_t len);
+static void ngx_ssl_sync_timer_handler(ngx_event_t *ev);
+static void ngx_ssl_sync_sweep_handler(ngx_event_t *ev);
+static void ngx_ssl_sync_read_handler(ngx_event_t *rev);
+static void ngx_ssl_sync_process(ngx_openssl_sync_conf_t *oscf, u_char *buf,
+    size_t size, ngx_log_t *log);
+static void ngx_ssl_sync_apply_sessions(ngx_shm_zone_t *shm_zone, u_char *p,
+    u_char *last, ngx_log_t *log);
+static void ngx_ssl_sync_apply_keys(ngx_shm_zone_t *shm_zone, u_char *p,
+    u_char *last, ngx_log_t *log);
+
+static void *ngx_openssl_sync_create_conf(ngx_cycle_t *cycle);
+static char *ngx_openssl_sync_init_conf(ngx_cycle_t *cycle, void *conf);
+static char *ngx_openssl_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_openssl_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_openssl_sync_key(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static void ngx_openssl_sync_key_cleanup(void *data);
+static ngx_int_t ngx_openssl_sync_init_process(ngx_cycle_t *cycle);
+static void ngx_openssl_sync_exit_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_openssl_sync_commands[] = {
+
+    { ngx_string("ssl_session_sync_listen"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_openssl_sync_listen,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("ssl_session_sync_peer"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_openssl_sync_peer,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("ssl_session_sync_key"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_openssl_sync_key,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("ssl_session_sync_interval"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(ngx_openssl_sync_conf_t, interval),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_openssl_sync_module_ctx = {
+    ngx_string("openssl_sync"),
+    ngx_openssl_sync_create_conf,
+    ngx_openssl_sync_init_conf
+};
+
+
+ngx_module_t  ngx_openssl_sync_module = {
+    NGX_MODULE_V1,
+    &ngx_openssl_sync_module_ctx,          /* module context */
+    ngx_openssl_sync_commands,             /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_openssl_sync_init_process,         /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_openssl_sync_exit_process,         /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_openssl_sync_t  ngx_openssl_sync;
+
+static u_char  ngx_ssl_sync_staging[NGX_SSL_SYNC_STAGING];
+static u_char  ngx_ssl_sync_pending[NGX_SSL_SESSION_SYNC_PENDING][33];
+
+
+ngx_int_t
+ngx_ssl_session_cache_sync(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t                 i;
+    ngx_shm_zone_t           **zones, **zone;
+    ngx_openssl_sync_conf_t   *oscf;
+
+    oscf = (ngx_openssl_sync_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                    ngx_openssl_sync_module);
+
+    if (shm_zone->shm.name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "session cache name \"%V\" is too long for sync",
+                           &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    zones = oscf->zones.elts;
+
+    for (i = 0; i < oscf->zones.nelts; i++) {
+        if (zones[i] == shm_zone) {
+            return NGX_OK;
+        }
+    }
+
+    zone = ngx_array_push(&oscf->zones);
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    *zone = shm_zone;
+
+    shm_zone->sync = oscf;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_sync_flush_sessions(ngx_openssl_sync_t *sync,
+    ngx_shm_zone_t *shm_zone)
+{
+    u_char                   *p, *id, *start;
+    size_t                    id_len, len, mtu;
+    time_t                    now, ttl, expire;
+    ngx_uint_t                i, n, lost;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_sync_t   *ss;
+    ngx_ssl_session_cache_t  *cache;
+    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ss = cache->sync;
+
+    if (ss == NULL || (ss->npending == 0 && ss->lost == 0)) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    n = ss->npending;
+    ngx_memcpy(ngx_ssl_sync_pending, ss->pending, n * sizeof(ss->pending[0]));
+    ss->npending = 0;
+
+    lost = ss->lost;
+    ss->lost = 0;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (lost) {
+        ngx_log_error(NGX_LOG_WARN, sync->connection->log, 0,
+                      "%ui sessions were not synced, pending queue "
+                      "of SSL session shared cache \"%V\" is full",
+                      lost, &shm_zone->shm.name);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, sync->connection->log, 0,
+                   "ssl session sync flush: %ui sessions", n);
+
+    /* sessions are read without locking and packed into datagrams */
+
+    mtu = NGX_SSL_SYNC_MTU - NGX_SSL_SYNC_HEADER - NGX_SSL_SYNC_TAG
+          - 9 - shm_zone->shm.name.len;
+
+    now = ngx_time();
+
+    start = ngx_ssl_sync_staging;
+    p = start;
+
+    for (i = 0; i < n; i++) {
+        id = ngx_ssl_sync_pending[i];
+        id_len = id[0];
+
+        len = ngx_ssl_session_cache_get(shm_zone, id + 1, id_len, buf,
+                                        &expire);
+
+        if (len == 0 || expire <= now) {
+            continue;
+        }
+
+        if (p != start && (size_t) (p - start) + 7 + id_len + len > mtu) {
+            ngx_ssl_sync_send(sync, NGX_SSL_SYNC_SESSIONS, shm_zone, start,
+                              p - start);
+            p = start;
+        }
+
+        ttl = expire - now;
+
+        *p++ = (u_char) id_len;
+
+        *p++ = (u_char) (ttl >> 24);
+        *p++ = (u_char) (ttl >> 16);
+        *p++ = (u_char) (ttl >> 8);
+        *p++ = (u_char) ttl;
+
+        *p++ = (u_char) (len >> 8);
+        *p++ = (u_char) len;
+
+        p = ngx_cpymem(p, id + 1, id_len);
+        p = ngx_cpymem(p, buf, len);
+    }
+
+    if (p != start) {
+        ngx_ssl_sync_send(sync, NGX_SSL_SYNC_SESSIONS, shm_zone, start,
+                          p - start);
+    }
+
+    ngx_explicit_memzero(buf, sizeof(buf));
+}
+
+
+static void
+ngx_ssl_sync_flush_keys(ngx_openssl_sync_t *sync, ngx_shm_zone_t *shm_zone)
+{
+    u_char                   *p;
+    time_t                    now, ttl, since;
+    ngx_uint_t                i;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_ticket_key_t     *key;
+    ngx_ssl_session_cache_t  *cache;
+    u_char                    buf[12 + 2 * 80];
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    key = cache->ticket_keys;
+
+    if (key[0].expire == 0) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    since = cache->ticket_keys_time;
+    ttl = (key[0].expire > now) ? key[0].expire - now : 0;
+
+    p = buf;
+
+    for (i = 0; i < 8; i++) {
+        *p++ = (u_char) ((uint64_t) since >> (56 - i * 8));
+    }
+
+    *p++ = (u_char) (ttl >> 24);
+    *p++ = (u_char) (ttl >> 16);
+    *p++ = (u_char) (ttl >> 8);
+    *p++ = (u_char) ttl;
+
+    for (i = 0; i < 3; i += 2) {
+        p = ngx_cpymem(p, key[i].name, 16);
+        p = ngx_cpymem(p, key[i].hmac_key, 32);
+        p = ngx_cpymem(p, key[i].aes_key, 32);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_ssl_sync_send(sync, NGX_SSL_SYNC_KEYS, shm_zone, buf, p - buf);
+
+    ngx_explicit_memzero(buf, sizeof(buf));
+}
+
+
+static void
+ngx_ssl_sync_send(ngx_openssl_sync_t *sync, ngx_uint_t type,
+    ngx_shm_zone_t *shm_zone, u_char *payload, size_t len)
+{
+    int                 n;
+    u_char             *p;
+    size_t              size;
+    ssize_t             sent;
+    uint64_t            now;
+    ngx_err_t           err;
+    ngx_uint_t          i;
+    ngx_addr_t         *peers;
+    EVP_CIPHER_CTX     *ctx;
+    ngx_connection_t   *c;
+    u_char              plain[NGX_SSL_SYNC_BUFFER];
+    u_char              buf[NGX_SSL_SYNC_HEADER + NGX_SSL_SYNC_BUFFER
+                            + NGX_SSL_SYNC_TAG];
+
+    c = sync->connection;
+
+    if (9 + shm_zone->shm.name.len + len > NGX_SSL_SYNC_BUFFER) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "ssl session sync datagram is too big");
+        return;
+    }
+
+    now = (uint64_t) ngx_time();
+
+    p = plain;
+
+    for (i = 0; i < 8; i++) {
+        *p++ = (u_char) (now >> (56 - i * 8));
+    }
+
+    *p++ = (u_char) shm_zone->shm.name.len;
+    p = ngx_cpymem(p, shm_zone->shm.name.data, shm_zone->shm.name.len);
+    p = ngx_cpymem(p, payload, len);
+
+    size = p - plain;
+
+    p = ngx_cpymem(buf, "NSSS", 4);
+    *p++ = NGX_SSL_SYNC_VERSION;
+    *p++ = (u_char) type;
+
+    if (RAND_bytes(p, 12) != 1) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "RAND_bytes() failed");
+        return;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "EVP_CIPHER_CTX_new() failed");
+        return;
+    }
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, sync->conf->key, p)
+        != 1)
+    {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "EVP_EncryptInit_ex() failed");
+        goto failed;
+    }
+
+    if (EVP_EncryptUpdate(ctx, NULL, &n, buf, NGX_SSL_SYNC_HEADER) != 1
+        || EVP_EncryptUpdate(ctx, buf + NGX_SSL_SYNC_HEADER, &n, plain,
+                             (int) size)
+           != 1
+        || EVP_EncryptFinal_ex(ctx, buf + NGX_SSL_SYNC_HEADER + n, &n) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, NGX_SSL_SYNC_TAG,
+                               buf + NGX_SSL_SYNC_HEADER + size)
+           != 1)
+    {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "AES-GCM encryption failed");
+        goto failed;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    ngx_explicit_memzero(plain, size);
+
+    size += NGX_SSL_SYNC_HEADER + NGX_SSL_SYNC_TAG;
+
+    peers = sync->conf->peers.elts;
+
+    for (i = 0; i < sync->conf->peers.nelts; i++) {
+
+        sent = sendto(c->fd, buf, size, 0, peers[i].sockaddr,
+                      peers[i].socklen);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ssl session sync sendto: %z of %uz to %V",
+                       sent, size, &peers[i].name);
+
+        if (sent == -1) {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ERR, c->log, err,
+                              "sendto() to %V failed", &peers[i].name);
+            }
+        }
+    }
+
+    return;
+
+failed:
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    ngx_explicit_memzero(plain, size);
+}
+
+
+static void
+ngx_ssl_sync_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t           i;
+    ngx_shm_zone_t     **zones;
+    ngx_openssl_sync_t  *sync;
+
+    sync = ev->data;
+
+    if (sync->connection == NULL) {
+        return;
+    }
+
+    zones = sync->conf->zones.elts;
+
+    for (i = 0; i < sync->conf->zones.nelts; i++) {
+        ngx_ssl_sync_flush_sessions(sync, zones[i]);
+    }
+
+    /* ticket keys are announced once a second by the first worker */
+
+    if (ngx_worker == 0 && sync->keys_sent != ngx_time()) {
+        sync->keys_sent = ngx_time();
+
+        for (i = 0; i < sync->conf->zones.nelts; i++) {
+            ngx_ssl_sync_flush_keys(sync, zones[i]);
+        }
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, sync->conf->interval);
+    }
+}
+
+
+static void
+ngx_ssl_sync_sweep_handler(ngx_event_t *ev)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *shm_zone;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init == ngx_ssl_session_cache_init
+            && shm_zone[i].data)
+        {
+            ngx_ssl_session_cache_sweep(&shm_zone[i]);
+        }
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, 1000);
+    }
+}
+
+
+static void
+ngx_ssl_sync_read_handler(ngx_event_t *rev)
+{
+    ssize_t              n;
+    ngx_err_t            err;
+    ngx_uint_t           i;
+    socklen_t            socklen;
+    ngx_addr_t          *peers;
+    ngx_sockaddr_t       sa;
+    ngx_connection_t    *c;
+    ngx_openssl_sync_t  *sync;
+    u_char               buf[NGX_SSL_SYNC_HEADER + NGX_SSL_SYNC_BUFFER
+                             + NGX_SSL_SYNC_TAG];
+
+    c = rev->data;
+    sync = &ngx_openssl_sync;
+
+    if (c->close) {
+        ngx_close_connection(c);
+        sync->connection = NULL;
+
+        return;
+    }
+
+    peers = sync->conf->peers.elts;
+
+    for ( ;; ) {
+        socklen = sizeof(ngx_sockaddr_t);
+
+        n = recvfrom(c->fd, buf, sizeof(buf), 0, &sa.sockaddr, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, err, "recvfrom() failed");
+            }
+
+            break;
+        }
+
+        for (i = 0; i < sync->conf->peers.nelts; i++) {
+            if (ngx_cmp_sockaddr(&sa.sockaddr, socklen, peers[i].sockaddr,
+                                 peers[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i == sync->conf->peers.nelts) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "ssl session sync datagram "
+                          "from unknown peer ignored");
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ssl session sync recvfrom: %z from %V",
+                       n, &peers[i].name);
+
+        ngx_ssl_sync_process(sync->conf, buf, n, c->log);
+    }
+
+    rev->ready = 0;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "ssl session sync read event failed");
+    }
+}
+
+
+static void
+ngx_ssl_sync_process(ngx_openssl_sync_conf_t *oscf, u_char *buf, size_t size,
+    ngx_log_t *log)
+{
+    int                n, m;
+    u_char            *p, *last;
+    time_t             stamp;
+    size_t             len;
+    ngx_str_t          name;
+    ngx_uint_t         i, type;
+    EVP_CIPHER_CTX    *ctx;
+    ngx_shm_zone_t   **zones;
+    u_char             plain[NGX_SSL_SYNC_BUFFER];
+
+    if (size < NGX_SSL_SYNC_HEADER + NGX_SSL_SYNC_TAG + 9
+        || ngx_memcmp(buf, "NSSS", 4) != 0
+        || buf[4] != NGX_SSL_SYNC_VERSION)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "invalid ssl session sync datagram");
+        return;
+    }
+
+    type = buf[5];
+    len = size - NGX_SSL_SYNC_HEADER - NGX_SSL_SYNC_TAG;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "EVP_CIPHER_CTX_new() failed");
+        return;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, oscf->key, buf + 6)
+           != 1
+        || EVP_DecryptUpdate(ctx, NULL, &n, buf, NGX_SSL_SYNC_HEADER) != 1
+        || EVP_DecryptUpdate(ctx, plain, &n, buf + NGX_SSL_SYNC_HEADER,
+                             (int) len)
+           != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, NGX_SSL_SYNC_TAG,
+                               buf + NGX_SSL_SYNC_HEADER + len)
+           != 1
+        || EVP_DecryptFinal_ex(ctx, plain + n, &m) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        ERR_clear_error();
+
+        ngx_explicit_memzero(plain, len);
+
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "ssl session sync datagram authentication failed");
+        return;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    p = plain;
+    last = plain + len;
+
+    stamp = 0;
+
+    for (i = 0; i < 8; i++) {
+        stamp = (stamp << 8) | *p++;
+    }
+
+    if (stamp < ngx_time() - NGX_SSL_SYNC_SKEW
+        || stamp > ngx_time() + NGX_SSL_SYNC_SKEW)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "stale ssl session sync datagram ignored");
+        goto done;
+    }
+
+    name.len = *p++;
+    name.data = p;
+
+    if (name.len > (size_t) (last - p)) {
+        goto invalid;
+    }
+
+    p += name.len;
+
+    zones = oscf->zones.elts;
+
+    for (i = 0; i < oscf->zones.nelts; i++) {
+        if (zones[i]->shm.name.len == name.len
+            && ngx_strncmp(zones[i]->shm.name.data, name.data, name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == oscf->zones.nelts) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl session sync: unknown cache \"%V\"", &name);
+        goto done;
+    }
+
+    switch (type) {
+
+    case NGX_SSL_SYNC_SESSIONS:
+        ngx_ssl_sync_apply_sessions(zones[i], p, last, log);
+        break;
+
+    case NGX_SSL_SYNC_KEYS:
+        ngx_ssl_sync_apply_keys(zones[i], p, last, log);
+        break;
+
+    default:
+        goto invalid;
+    }
+
+done:
+
+    ngx_explicit_memzero(plain, len);
+
+    return;
+
+invalid:
+
+    ngx_explicit_memzero(plain, len);
+
+    ngx_log_error(NGX_LOG_INFO, log, 0, "invalid ssl session sync datagram");
+}
+
+
+static void
+ngx_ssl_sync_apply_sessions(ngx_shm_zone_t *shm_zone, u_char *p,
+    u_char *last, ngx_log_t *log)
+{
+    u_char  *id;
+    size_t   id_len, len;
+    time_t   ttl;
+
+    while (p < last) {
+
+        if (last - p < 7) {
+            goto invalid;
+        }
+
+        id_len = *p++;
+
+        ttl = ((time_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        p += 4;
+
+        len = (p[0] << 8) | p[1];
+        p += 2;
+
+        if (id_len + len > (size_t) (last - p)) {
+            goto invalid;
+        }
+
+        id = p;
+        p += id_len;
+
+        (void) ngx_ssl_session_cache_add(shm_zone, id, id_len, p, len,
+                                         ngx_time() + ttl, log);
+
+        p += len;
+    }
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, log, 0, "invalid ssl session sync datagram");
+}
+
+
+static void
+ngx_ssl_sync_apply_keys(ngx_shm_zone_t *shm_zone, u_char *p, u_char *last,
+    ngx_log_t *log)
+{
+    time_t                    since, ttl, expire;
+    ngx_uint_t                i;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_ticket_key_t     *key, current, next;
+    ngx_ssl_session_cache_t  *cache;
+
+    if (last - p != 12 + 2 * 80) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "invalid ssl session sync datagram");
+        return;
+    }
+
+    since = 0;
+
+    for (i = 0; i < 8; i++) {
+        since = (since << 8) | *p++;
+    }
+
+    ttl = ((time_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    p += 4;
+
+    ngx_memzero(&current, sizeof(ngx_ssl_ticket_key_t));
+
+    current.shared = 1;
+    current.size = 80;
+
+    next = current;
+
+    ngx_memcpy(current.name, p, 16);
+    ngx_memcpy(current.hmac_key, p + 16, 32);
+    ngx_memcpy(current.aes_key, p + 48, 32);
+
+    p += 80;
+
+    ngx_memcpy(next.name, p, 16);
+    ngx_memcpy(next.hmac_key, p + 16, 32);
+    ngx_memcpy(next.aes_key, p + 48, 32);
+
+    expire = ngx_time() + ttl;
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    key = cache->ticket_keys;
+
+    if (key[0].expire == 0) {
+
+        /* not initialized yet, start with the keys of the peer */
+
+        key[0] = current;
+        key[0].expire = expire;
+        key[1] = key[0];
+
+    } else if (since < cache->ticket_keys_time
+               || (since == cache->ticket_keys_time
+                   && ngx_memcmp(current.name, key[0].name, 16) >= 0))
+    {
+        /* our keys are newer, the peer will adopt them */
+        goto done;
+
+    } else if (ngx_memcmp(current.name, key[0].name, 16) != 0) {
+
+        /* keep the current key to decrypt tickets already issued */
+
+        key[1] = key[0];
+        key[0] = current;
+        key[0].expire = ngx_max(expire, key[1].expire);
+    }
+
+    key[2] = next;
+    cache->ticket_keys_time = since;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl session sync ticket keys: \"%*xs\"",
+                   (size_t) 16, key[0].name);
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_explicit_memzero(&current, sizeof(ngx_ssl_ticket_key_t));
+    ngx_explicit_memzero(&next, sizeof(ngx_ssl_ticket_key_t));
+}
+
+
+static void *
+ngx_openssl_sync_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_openssl_sync_conf_t  *oscf;
+
+    oscf = ngx_pcalloc(cycle->pool, sizeof(ngx_openssl_sync_conf_t));
+    if (oscf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     oscf->listen = NULL;
+     *     oscf->key = NULL;
+     */
+
+    if (ngx_array_init(&oscf->peers, cycle->pool, 4, sizeof(ngx_addr_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&oscf->zones, cycle->pool, 4, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    oscf->interval = NGX_CONF_UNSET_MSEC;
+
+    return oscf;
+}
+
+
+static char *
+ngx_openssl_sync_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_openssl_sync_conf_t *oscf = conf;
+
+    ngx_conf_init_msec_value(oscf->interval, 100);
+
+    if (oscf->zones.nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (oscf->listen == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "no \"ssl_session_sync_listen\" is defined "
+                      "for the session cache with the \"sync\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    if (oscf->key == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "no \"ssl_session_sync_key\" is defined "
+                      "for the session cache with the \"sync\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_openssl_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_openssl_sync_conf_t *oscf = conf;
+
+    ngx_str_t  *value;
+    ngx_url_t   u;
+
+    if (oscf->listen) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.listen = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"%V\" directive",
+                           &u.url, &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    oscf->listen = &u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_openssl_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_openssl_sync_conf_t *oscf = conf;
+
+    ngx_str_t   *value;
+    ngx_url_t    u;
+    ngx_uint_t   i;
+    ngx_addr_t  *addr;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"%V\" directive",
+                           &u.url, &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        addr = ngx_array_push(&oscf->peers);
+        if (addr == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *addr = u.addrs[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_openssl_sync_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_openssl_sync_conf_t *oscf = conf;
+
+    ssize_t              n;
+    ngx_str_t           *value;
+    ngx_file_t           file;
+    ngx_file_info_t      fi;
+    ngx_pool_cleanup_t  *cln;
+
+    if (oscf->key) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_conf_full_name(cf->cycle, &value[1], 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = value[1];
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &file.name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &file.name);
+        goto failed;
+    }
+
+    if (ngx_file_size(&fi) != 32) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must be 32 bytes", &file.name);
+        goto failed;
+    }
+
+    oscf->key = ngx_pnalloc(cf->pool, 32);
+    if (oscf->key == NULL) {
+        goto failed;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        goto failed;
+    }
+
+    cln->handler = ngx_openssl_sync_key_cleanup;
+    cln->data = oscf->key;
+
+    n = ngx_read_file(&file, oscf->key, 32, 0);
+
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_read_file_n " \"%V\" failed", &file.name);
+        goto failed;
+    }
+
+    if (n != 32) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
+                           ngx_read_file_n " \"%V\" returned only "
+                           "%z bytes instead of 32", &file.name, n);
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_openssl_sync_key_cleanup(void *data)
+{
+    u_char  *key = data;
+
+    ngx_explicit_memzero(key, 32);
+}
+
+
+static ngx_int_t
+ngx_openssl_sync_init_process(ngx_cycle_t *cycle)
+{
+    int                       reuse;
+    ngx_uint_t                i;
+    ngx_socket_t              s;
+    ngx_addr_t               *addr, *peers;
+    ngx_event_t              *rev;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_list_part_t          *part;
+    ngx_connection_t         *c;
+    ngx_openssl_sync_t       *sync;
+    ngx_openssl_sync_conf_t  *oscf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    sync = &ngx_openssl_sync;
+
+    /* expired sessions of shared caches are removed in the background */
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init == ngx_ssl_session_cache_init) {
+            sync->sweep.handler = ngx_ssl_sync_sweep_handler;
+            sync->sweep.log = cycle->log;
+            sync->sweep.cancelable = 1;
+
+            ngx_add_timer(&sync->sweep, 1000);
+            break;
+        }
+    }
+
+    oscf = (ngx_openssl_sync_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                    ngx_openssl_sync_module);
+
+    if (oscf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    addr = oscf->listen;
+
+    s = ngx_socket(addr->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " for ssl session sync failed");
+        return NGX_OK;
+    }
+
+    reuse = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEADDR) %V failed", &addr->name);
+        goto failed;
+    }
+
+#if (NGX_HAVE_REUSEPORT)
+
+    /* every worker binds to the address and receives a share of updates */
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEPORT) %V failed", &addr->name);
+        goto failed;
+    }
+
+#endif
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " %V failed", &addr->name);
+        goto failed;
+    }
+
+    if (bind(s, addr->sockaddr, addr->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "bind() to %V for ssl session sync failed",
+                      &addr->name);
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->type = SOCK_DGRAM;
+    c->idle = 1;
+
+    rev = c->read;
+    rev->handler = ngx_ssl_sync_read_handler;
+    rev->log = cycle->log;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_OK;
+    }
+
+    /* there is no point in sending datagrams to our own address */
+
+    peers = oscf->peers.elts;
+
+    for (i = 0; i < oscf->peers.nelts; /* void */) {
+
+        if (ngx_cmp_sockaddr(peers[i].sockaddr, peers[i].socklen,
+                             addr->sockaddr, addr->socklen, 1)
+            == NGX_OK)
+        {
+            peers[i] = peers[--oscf->peers.nelts];
+            continue;
+        }
+
+        i++;
+    }
+
+    sync->connection = c;
+    sync->conf = oscf;
+
+    sync->event.handler = ngx_ssl_sync_timer_handler;
+    sync->event.data = sync;
+    sync->event.log = cycle->log;
+    sync->event.cancelable = 1;
+
+    ngx_add_timer(&sync->event, oscf->interval);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_openssl_sync_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_openssl_sync_t  *sync;
+
+    sync = &ngx_openssl_sync;
+
+    if (sync->connection) {
+        ngx_close_connection(sync->connection);
+        sync->connection = NULL;
+    }
+}
@@ -15,6 +15,13 @@ static ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
+static ngx_int_t ngx_event_pipe_add_temp_file_buf(ngx_event_pipe_t *p,
+    off_t size);
+#if (NGX_HAVE_SPLICE)
+static ssize_t ngx_event_pipe_splice_to_temp_file(ngx_event_pipe_t *p,
+    off_t limit);
+static void ngx_event_pipe_splice_cleanup(void *data);
+#endif
 static ngx_inline void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 static ngx_int_t ngx_event_pipe_drain_chains(ngx_event_pipe_t *p);
 
@@ -217,6 +224,55 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
                 limit = 0;
             }
 
+#if (NGX_HAVE_SPLICE)
+
+            if (p->splice) {
+                n = ngx_event_pipe_splice_to_temp_file(p, limit);
+
+                if (n == NGX_ABORT) {
+                    return NGX_ABORT;
+                }
+
+                if (n == NGX_ERROR) {
+                    p->upstream_error = 1;
+                    break;
+                }
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                if (n != NGX_DECLINED) {
+                    p->read = 1;
+
+                    if (n == 0) {
+                        p->upstream_eof = 1;
+                        break;
+                    }
+
+                    p->read_length += n;
+
+                    if (p->length == 0) {
+                        p->upstream_done = 1;
+                        break;
+                    }
+
+                    if (p->limit_rate) {
+                        delay = (ngx_msec_t) n * 1000 / p->limit_rate;
+
+                        if (delay > 0) {
+                            p->upstream->read->delayed = 1;
+                            ngx_add_timer(p->upstream->read, delay);
+                            break;
+                        }
+                    }
+
+                    continue;
+                }
+            }
+
+#endif
+
             if (p->free_raw_bufs) {
 
                 /* use the free bufs if they exist */
@@ -740,7 +796,7 @@ ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
     ssize_t       size, bsize, n;
     ngx_buf_t    *b;
     ngx_uint_t    prev_last_shadow;
-    ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_out, **last_free;
+    ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_free;
 
 #if (NGX_THREADS)
 
@@ -865,50 +921,10 @@ done:
         out = out->next;
     }
 
-    if (n > 0) {
-        /* update previous buffer or add new buffer */
-
-        if (p->out) {
-            for (cl = p->out; cl->next; cl = cl->next) { /* void */ }
-
-            b = cl->buf;
-
-            if (b->file_last == p->temp_file->offset) {
-                p->temp_file->offset += n;
-                b->file_last = p->temp_file->offset;
-                goto free;
-            }
-
-            last_out = &cl->next;
-
-        } else {
-            last_out = &p->out;
-        }
-
-        cl = ngx_chain_get_free_buf(p->pool, &p->free);
-        if (cl == NULL) {
-            return NGX_ABORT;
-        }
-
-        b = cl->buf;
-
-        ngx_memzero(b, sizeof(ngx_buf_t));
-
-        b->tag = p->tag;
-
-        b->file = &p->temp_file->file;
-        b->file_pos = p->temp_file->offset;
-        p->temp_file->offset += n;
-        b->file_last = p->temp_file->offset;
-
-        b->in_file = 1;
-        b->temp_file = 1;
-
-        *last_out = cl;
+    if (n > 0 && ngx_event_pipe_add_temp_file_buf(p, n) != NGX_OK) {
+        return NGX_ABORT;
     }
 
-free:
-
     for (last_free = &p->free_raw_bufs;
          *last_free != NULL;
          last_free = &(*last_free)->next)
@@ -948,6 +964,229 @@ free:
 }
 
 
+static ngx_int_t
+ngx_event_pipe_add_temp_file_buf(ngx_event_pipe_t *p, off_t size)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, **last_out;
+
+    /* update previous buffer or add new buffer */
+
+    if (p->out) {
+        for (cl = p->out; cl->next; cl = cl->next) { /* void */ }
+
+        b = cl->buf;
+
+        if (b->file_last == p->temp_file->offset) {
+            p->temp_file->offset += size;
+            b->file_last = p->temp_file->offset;
+            return NGX_OK;
+        }
+
+        last_out = &cl->next;
+
+    } else {
+        last_out = &p->out;
+    }
+
+    cl = ngx_chain_get_free_buf(p->pool, &p->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->tag = p->tag;
+
+    b->file = &p->temp_file->file;
+    b->file_pos = p->temp_file->offset;
+    p->temp_file->offset += size;
+    b->file_last = p->temp_file->offset;
+
+    b->in_file = 1;
+    b->temp_file = 1;
+
+    *last_out = cl;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+static ssize_t
+ngx_event_pipe_splice_to_temp_file(ngx_event_pipe_t *p, off_t limit)
+{
+    int                 *fd;
+    size_t               size;
+    loff_t               offset;
+    ssize_t              n, sent;
+    ngx_int_t            rc;
+    ngx_err_t            err;
+    ngx_temp_file_t     *tf;
+    ngx_pool_cleanup_t  *cln;
+
+    /*
+     * the response body is moved from the upstream socket to the
+     * temporary file through a kernel pipe, bypassing the buffers;
+     * the data already read with the response header go first
+     */
+
+    if (p->in || p->buf_to_file) {
+        rc = ngx_event_pipe_write_chain_to_temp_file(p);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ABORT;
+        }
+    }
+
+    tf = p->temp_file;
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            return NGX_ABORT;
+        }
+
+        if (tf->log_level) {
+            ngx_log_error(tf->log_level, tf->file.log, 0, "%s %V",
+                          tf->warn, &tf->file.name);
+        }
+    }
+
+    fd = p->splice_fd;
+
+    if (fd == NULL) {
+        cln = ngx_pool_cleanup_add(p->pool, 2 * sizeof(int));
+        if (cln == NULL) {
+            return NGX_ABORT;
+        }
+
+        fd = cln->data;
+
+        if (pipe2(fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno,
+                          "pipe2() failed, splicing disabled");
+            p->splice = 0;
+            return NGX_DECLINED;
+        }
+
+        cln->handler = ngx_event_pipe_splice_cleanup;
+        p->splice_fd = fd;
+
+        size = p->bufs.num * p->bufs.size;
+
+        if (size > 65536 && fcntl(fd[0], F_SETPIPE_SZ, size) == -1) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, ngx_errno,
+                           "fcntl(F_SETPIPE_SZ, %uz) failed", size);
+        }
+    }
+
+    size = p->bufs.num * p->bufs.size;
+
+    if (p->length != -1 && p->length < (off_t) size) {
+        size = (size_t) p->length;
+    }
+
+    if (limit && limit < (off_t) size) {
+        size = (size_t) limit;
+    }
+
+    n = splice(p->upstream->fd, NULL, fd[1], NULL, size,
+               SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe splice: %z of %uz", n, size);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        /* the pipe is always drained, so the socket has no data */
+
+        if (err == NGX_EAGAIN) {
+            p->upstream->read->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        p->upstream->read->error = 1;
+        ngx_connection_error(p->upstream, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+
+    if (n == 0) {
+        p->upstream->read->ready = 0;
+        p->upstream->read->eof = 1;
+        return 0;
+    }
+
+    offset = tf->offset;
+
+    for (size = n; size; size -= sent) {
+        sent = splice(fd[0], NULL, tf->file.fd, &offset, size, SPLICE_F_MOVE);
+
+        if (sent == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                sent = 0;
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, p->log, err,
+                          "splice() to \"%s\" failed", tf->file.name.data);
+            return NGX_ABORT;
+        }
+
+        if (sent == 0) {
+            ngx_log_error(NGX_LOG_CRIT, p->log, 0,
+                          "splice() to \"%s\" returned zero",
+                          tf->file.name.data);
+            return NGX_ABORT;
+        }
+    }
+
+    tf->file.offset += n;
+
+    if (ngx_event_pipe_add_temp_file_buf(p, n) != NGX_OK) {
+        return NGX_ABORT;
+    }
+
+    if (p->length != -1) {
+        p->length -= n;
+    }
+
+    return n;
+}
+
+
+static void
+ngx_event_pipe_splice_cleanup(void *data)
+{
+    int  *fd = data;
+
+    if (close(fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+}
+
+#endif
+
+
 /* the copy input filter */
 
 ngx_int_t
@@ -66,6 +66,7 @@ struct ngx_event_pipe_s {
     unsigned           downstream_error:1;
     unsigned           cyclic_temp_file:1;
     unsigned           aio:1;
+    unsigned           splice:1;
 
     ngx_int_t          allocated;
     ngx_bufs_t         bufs;
@@ -95,6 +96,10 @@ struct ngx_event_pipe_s {
 
     ngx_temp_file_t   *temp_file;
 
+#if (NGX_HAVE_SPLICE)
+    int               *splice_fd;
+#endif
+
     /* STUB */ int     num;
 };
 
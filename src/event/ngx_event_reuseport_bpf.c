@@ -0,0 +1,679 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define ngx_reuseport_bpf_get_conf(cycle)                                     \
+    (ngx_reuseport_bpf_conf_t *) ngx_get_conf(cycle->conf_ctx,                \
+                                              ngx_reuseport_bpf_module)
+
+#define ngx_reuseport_bpf_get_old_conf(cycle)                                 \
+    cycle->old_cycle->conf_ctx ? ngx_reuseport_bpf_get_conf(cycle->old_cycle) \
+                               : NULL
+
+#define ngx_core_get_conf(cycle)                                              \
+    (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module)
+
+
+#if (NGX_HAVE_CPU_AFFINITY)
+#define NGX_REUSEPORT_BPF_MAX_CPUS  CPU_SETSIZE
+#else
+#define NGX_REUSEPORT_BPF_MAX_CPUS  ngx_ncpu
+#endif
+
+
+typedef struct {
+    ngx_queue_t           queue;
+    int                   map_fd;
+
+    struct sockaddr      *sockaddr;
+    socklen_t             socklen;
+} ngx_reuseport_bpf_group_t;
+
+
+typedef struct {
+    ngx_flag_t            enabled;
+    int                   cpu_map_fd;
+    ngx_queue_t           groups;     /* of ngx_reuseport_bpf_group_t */
+} ngx_reuseport_bpf_conf_t;
+
+
+static void *ngx_reuseport_bpf_create_conf(ngx_cycle_t *cycle);
+static ngx_int_t ngx_reuseport_bpf_module_init(ngx_cycle_t *cycle);
+
+static void ngx_reuseport_bpf_cleanup(void *data);
+static ngx_inline void ngx_reuseport_bpf_close(ngx_log_t *log, int fd,
+    const char *name);
+
+static ngx_int_t ngx_reuseport_bpf_create_cpu_map(ngx_cycle_t *cycle);
+#if (NGX_HAVE_CPU_AFFINITY)
+static ngx_cpuset_t *ngx_reuseport_bpf_cpu_affinity(ngx_core_conf_t *ccf,
+    ngx_uint_t n);
+#endif
+static ngx_reuseport_bpf_group_t *ngx_reuseport_bpf_find_group(
+    ngx_reuseport_bpf_conf_t *bcf, ngx_listening_t *ls);
+static ngx_reuseport_bpf_group_t *ngx_reuseport_bpf_get_group(
+    ngx_cycle_t *cycle, ngx_listening_t *ls);
+static ngx_int_t ngx_reuseport_bpf_add_socket(ngx_cycle_t *cycle,
+    ngx_listening_t *ls);
+static void ngx_reuseport_bpf_release(ngx_cycle_t *cycle);
+static void ngx_reuseport_bpf_detach(ngx_cycle_t *cycle);
+
+
+/*
+ * the program selects a socket of the worker process bound to the CPU
+ * which received the connection; if there is no such worker, or its socket
+ * is not in the array, the kernel falls back to hash-based selection
+ *
+ *     __u32  cpu, *worker;
+ *
+ *     cpu = bpf_get_smp_processor_id();
+ *
+ *     worker = bpf_map_lookup_elem(&ngx_reuseport_cpus, &cpu);
+ *     if (worker) {
+ *         bpf_sk_select_reuseport(ctx, &ngx_reuseport_sockets, worker, 0);
+ *     }
+ *
+ *     return SK_PASS;
+ */
+
+static ngx_bpf_reloc_t  ngx_reuseport_bpf_relocs[] = {
+    { "ngx_reuseport_cpus", 5 },
+    { "ngx_reuseport_sockets", 12 },
+};
+
+static struct bpf_insn  ngx_reuseport_bpf_insns[] = {
+    /* opcode dst          src         offset imm */
+    { 0xbf,   BPF_REG_6,   BPF_REG_1, (int16_t)      0,        0x0 },
+    { 0x85,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,
+                                          BPF_FUNC_get_smp_processor_id },
+    { 0x63,   BPF_REG_10,  BPF_REG_0, (int16_t)     -4,        0x0 },
+    { 0xbf,   BPF_REG_2,   BPF_REG_10, (int16_t)     0,        0x0 },
+    {  0x7,   BPF_REG_2,   BPF_REG_0, (int16_t)      0,         -4 },
+    { 0x18,   BPF_REG_1,   BPF_REG_0, (int16_t)      0,        0x0 },
+    {  0x0,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,        0x0 },
+    { 0x85,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,
+                                          BPF_FUNC_map_lookup_elem },
+    { 0x15,   BPF_REG_0,   BPF_REG_0, (int16_t)      9,        0x0 },
+    { 0x61,   BPF_REG_1,   BPF_REG_0, (int16_t)      0,        0x0 },
+    { 0x63,   BPF_REG_10,  BPF_REG_1, (int16_t)     -8,        0x0 },
+    { 0xbf,   BPF_REG_1,   BPF_REG_6, (int16_t)      0,        0x0 },
+    { 0x18,   BPF_REG_2,   BPF_REG_0, (int16_t)      0,        0x0 },
+    {  0x0,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,        0x0 },
+    { 0xbf,   BPF_REG_3,   BPF_REG_10, (int16_t)     0,        0x0 },
+    {  0x7,   BPF_REG_3,   BPF_REG_0, (int16_t)      0,         -8 },
+    { 0xb7,   BPF_REG_4,   BPF_REG_0, (int16_t)      0,        0x0 },
+    { 0x85,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,
+                                          BPF_FUNC_sk_select_reuseport },
+    { 0xb7,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,    SK_PASS },
+    { 0x95,   BPF_REG_0,   BPF_REG_0, (int16_t)      0,        0x0 },
+};
+
+
+static ngx_bpf_program_t  ngx_reuseport_bpf_program = {
+    .relocs = ngx_reuseport_bpf_relocs,
+    .nrelocs = sizeof(ngx_reuseport_bpf_relocs)
+               / sizeof(ngx_reuseport_bpf_relocs[0]),
+    .ins = ngx_reuseport_bpf_insns,
+    .nins = sizeof(ngx_reuseport_bpf_insns)
+            / sizeof(ngx_reuseport_bpf_insns[0]),
+    .license = "BSD",
+    .type = BPF_PROG_TYPE_SK_REUSEPORT,
+};
+
+
+static ngx_command_t  ngx_reuseport_bpf_commands[] = {
+
+    { ngx_string("reuseport_bpf"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_reuseport_bpf_conf_t, enabled),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_reuseport_bpf_module_ctx = {
+    ngx_string("reuseport_bpf"),
+    ngx_reuseport_bpf_create_conf,
+    NULL
+};
+
+
+ngx_module_t  ngx_reuseport_bpf_module = {
+    NGX_MODULE_V1,
+    &ngx_reuseport_bpf_module_ctx,         /* module context */
+    ngx_reuseport_bpf_commands,            /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_reuseport_bpf_module_init,         /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_reuseport_bpf_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_reuseport_bpf_conf_t  *bcf;
+
+    bcf = ngx_pcalloc(cycle->pool, sizeof(ngx_reuseport_bpf_conf_t));
+    if (bcf == NULL) {
+        return NULL;
+    }
+
+    bcf->enabled = NGX_CONF_UNSET;
+    bcf->cpu_map_fd = -1;
+
+    ngx_queue_init(&bcf->groups);
+
+    return bcf;
+}
+
+
+static ngx_int_t
+ngx_reuseport_bpf_module_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_core_conf_t           *ccf;
+    ngx_listening_t           *ls;
+    ngx_pool_cleanup_t        *cln;
+    ngx_reuseport_bpf_conf_t  *bcf;
+
+    if (ngx_test_config) {
+        /*
+         * during config test, SO_REUSEPORT socket option is
+         * not set, thus making further processing meaningless
+         */
+        return NGX_OK;
+    }
+
+    bcf = ngx_reuseport_bpf_get_conf(cycle);
+
+    ngx_conf_init_value(bcf->enabled, 0);
+
+    ngx_reuseport_bpf_release(cycle);
+
+    if (!bcf->enabled) {
+        ngx_reuseport_bpf_detach(cycle);
+        return NGX_OK;
+    }
+
+    ccf = ngx_core_get_conf(cycle);
+
+    if (ccf->cpu_affinity == NULL) {
+        /*
+         * without worker_cpu_affinity, a worker process may run on any CPU,
+         * so selecting it by the CPU which received the connection gives
+         * nothing but an uneven distribution
+         */
+
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"reuseport_bpf\" requires \"worker_cpu_affinity\", "
+                      "ignored");
+
+        ngx_reuseport_bpf_detach(cycle);
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        goto failed;
+    }
+
+    cln->data = bcf;
+    cln->handler = ngx_reuseport_bpf_cleanup;
+
+    if (ngx_reuseport_bpf_create_cpu_map(cycle) != NGX_OK) {
+        goto failed;
+    }
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+        if (ls[i].reuseport
+            && ls[i].type == SOCK_STREAM
+            && ls[i].fd != (ngx_socket_t) -1)
+        {
+            if (ngx_reuseport_bpf_add_socket(cycle, &ls[i]) != NGX_OK) {
+                goto failed;
+            }
+        }
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_is_init_cycle(cycle->old_cycle)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "ngx_reuseport_bpf_module failed to initialize, "
+                      "check limits");
+
+        /* refuse to start */
+        return NGX_ERROR;
+    }
+
+    /*
+     * as in ngx_quic_bpf_module, returning error now would make the master
+     * process exit leaving worker processes orphaned; connections are
+     * then distributed with the kernel hash-based selection
+     */
+
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                  "ngx_reuseport_bpf_module failed to initialize properly, "
+                  "ignored");
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_reuseport_bpf_cleanup(void *data)
+{
+    ngx_reuseport_bpf_conf_t  *bcf = data;
+
+    ngx_queue_t                *q;
+    ngx_reuseport_bpf_group_t  *grp;
+
+    for (q = ngx_queue_head(&bcf->groups);
+         q != ngx_queue_sentinel(&bcf->groups);
+         q = ngx_queue_next(q))
+    {
+        grp = ngx_queue_data(q, ngx_reuseport_bpf_group_t, queue);
+
+        ngx_reuseport_bpf_close(ngx_cycle->log, grp->map_fd, "sockets map");
+    }
+
+    if (bcf->cpu_map_fd != -1) {
+        ngx_reuseport_bpf_close(ngx_cycle->log, bcf->cpu_map_fd, "cpu map");
+    }
+}
+
+
+static ngx_inline void
+ngx_reuseport_bpf_close(ngx_log_t *log, int fd, const char *name)
+{
+    if (close(fd) != -1) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                  "reuseport bpf close %s fd:%d failed", name, fd);
+}
+
+
+static ngx_int_t
+ngx_reuseport_bpf_create_cpu_map(ngx_cycle_t *cycle)
+{
+    uint32_t                   cpu, worker, *workers, n, max;
+#if (NGX_HAVE_CPU_AFFINITY)
+    ngx_uint_t                 i;
+    ngx_cpuset_t              *mask;
+#endif
+    ngx_core_conf_t           *ccf;
+    ngx_reuseport_bpf_conf_t  *bcf;
+
+    ccf = ngx_core_get_conf(cycle);
+    bcf = ngx_reuseport_bpf_get_conf(cycle);
+
+    max = NGX_REUSEPORT_BPF_MAX_CPUS;
+
+    workers = ngx_palloc(cycle->pool, max * sizeof(uint32_t));
+    if (workers == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* each CPU is mapped to the first worker process bound to it */
+
+    for (cpu = 0; cpu < max; cpu++) {
+        workers[cpu] = (uint32_t) -1;
+    }
+
+    n = 0;
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+    for (i = 0; i < (ngx_uint_t) ccf->worker_processes; i++) {
+
+        mask = ngx_reuseport_bpf_cpu_affinity(ccf, i);
+        if (mask == NULL) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, mask) && workers[cpu] == (uint32_t) -1) {
+                workers[cpu] = i;
+                n++;
+            }
+        }
+    }
+
+#endif
+
+    if (n == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "reuseport bpf found no CPUs for worker processes");
+        return NGX_ERROR;
+    }
+
+    bcf->cpu_map_fd = ngx_bpf_map_create(cycle->log, BPF_MAP_TYPE_HASH,
+                                         sizeof(uint32_t), sizeof(uint32_t),
+                                         n, 0);
+    if (bcf->cpu_map_fd == -1) {
+        return NGX_ERROR;
+    }
+
+    for (cpu = 0; cpu < max; cpu++) {
+
+        worker = workers[cpu];
+
+        if (worker == (uint32_t) -1) {
+            continue;
+        }
+
+        if (ngx_bpf_map_update(bcf->cpu_map_fd, &cpu, &worker, BPF_ANY)
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "reuseport bpf failed to update cpu map");
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "reuseport bpf cpu:%uD worker:%uD", cpu, worker);
+    }
+
+    ngx_pfree(cycle->pool, workers);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+static ngx_cpuset_t *
+ngx_reuseport_bpf_cpu_affinity(ngx_core_conf_t *ccf, ngx_uint_t n)
+{
+    ngx_uint_t     i, j;
+    ngx_cpuset_t  *mask;
+
+    static ngx_cpuset_t  result;
+
+    /* see ngx_get_cpu_affinity(), which uses the current cycle */
+
+    if (ccf->cpu_affinity_auto) {
+        mask = &ccf->cpu_affinity[ccf->cpu_affinity_n - 1];
+
+        for (i = 0, j = n; i < CPU_SETSIZE * (n + 1); i++) {
+
+            if (CPU_ISSET(i % CPU_SETSIZE, mask) && j-- == 0) {
+                CPU_ZERO(&result);
+                CPU_SET(i % CPU_SETSIZE, &result);
+
+                return &result;
+            }
+        }
+
+        return NULL;
+    }
+
+    if (ccf->cpu_affinity_n > n) {
+        return &ccf->cpu_affinity[n];
+    }
+
+    return &ccf->cpu_affinity[ccf->cpu_affinity_n - 1];
+}
+
+#endif
+
+
+static ngx_reuseport_bpf_group_t *
+ngx_reuseport_bpf_find_group(ngx_reuseport_bpf_conf_t *bcf,
+    ngx_listening_t *ls)
+{
+    ngx_queue_t                *q;
+    ngx_reuseport_bpf_group_t  *grp;
+
+    for (q = ngx_queue_head(&bcf->groups);
+         q != ngx_queue_sentinel(&bcf->groups);
+         q = ngx_queue_next(q))
+    {
+        grp = ngx_queue_data(q, ngx_reuseport_bpf_group_t, queue);
+
+        if (ngx_cmp_sockaddr(ls->sockaddr, ls->socklen,
+                             grp->sockaddr, grp->socklen, 1)
+            == NGX_OK)
+        {
+            return grp;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_reuseport_bpf_group_t *
+ngx_reuseport_bpf_get_group(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    int                         progfd, failed;
+    ngx_core_conf_t            *ccf;
+    ngx_reuseport_bpf_conf_t   *bcf;
+    ngx_reuseport_bpf_group_t  *grp;
+
+    bcf = ngx_reuseport_bpf_get_conf(cycle);
+
+    grp = ngx_reuseport_bpf_find_group(bcf, ls);
+    if (grp) {
+        return grp;
+    }
+
+    grp = ngx_pcalloc(cycle->pool, sizeof(ngx_reuseport_bpf_group_t));
+    if (grp == NULL) {
+        return NULL;
+    }
+
+    grp->sockaddr = ls->sockaddr;
+    grp->socklen = ls->socklen;
+
+    ccf = ngx_core_get_conf(cycle);
+
+    grp->map_fd = ngx_bpf_map_create(cycle->log,
+                                     BPF_MAP_TYPE_REUSEPORT_SOCKARRAY,
+                                     sizeof(uint32_t), sizeof(uint32_t),
+                                     ccf->worker_processes, 0);
+    if (grp->map_fd == -1) {
+        return NULL;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "reuseport bpf sockarray created fd:%d for %V",
+                   grp->map_fd, &ls->addr_text);
+
+    ngx_queue_insert_tail(&bcf->groups, &grp->queue);
+
+    ngx_bpf_program_link(&ngx_reuseport_bpf_program,
+                         "ngx_reuseport_cpus", bcf->cpu_map_fd);
+    ngx_bpf_program_link(&ngx_reuseport_bpf_program,
+                         "ngx_reuseport_sockets", grp->map_fd);
+
+    progfd = ngx_bpf_load_program(cycle->log, &ngx_reuseport_bpf_program);
+    if (progfd < 0) {
+        return NULL;
+    }
+
+    failed = 0;
+
+    /* the program is attached to the whole reuseport group */
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+                   &progfd, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                      "reuseport bpf setsockopt(SO_ATTACH_REUSEPORT_EBPF) "
+                      "for %V failed", &ls->addr_text);
+        failed = 1;
+    }
+
+    ngx_reuseport_bpf_close(cycle->log, progfd, "program");
+
+    if (failed) {
+        return NULL;
+    }
+
+    return grp;
+}
+
+
+static ngx_int_t
+ngx_reuseport_bpf_add_socket(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    uint32_t                    key, fd;
+    ngx_reuseport_bpf_group_t  *grp;
+
+    grp = ngx_reuseport_bpf_get_group(cycle, ls);
+    if (grp == NULL) {
+        return NGX_ERROR;
+    }
+
+    key = (uint32_t) ls->worker;
+    fd = (uint32_t) ls->fd;
+
+    /* map[worker] = socket; for use in kernel helper */
+
+    if (ngx_bpf_map_update(grp->map_fd, &key, &fd, BPF_ANY) == -1) {
+
+        if (ngx_errno == NGX_EBUSY
+            && ngx_inherited && ngx_is_init_cycle(cycle->old_cycle))
+        {
+            /*
+             * during binary upgrade the socket is still in the array
+             * of the old binary; the kernel hash-based selection is used
+             * for it until the next reconfiguration
+             */
+
+            ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                          "reuseport bpf socket for %V, worker:%ui "
+                          "is used by the old binary",
+                          &ls->addr_text, ls->worker);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "reuseport bpf failed to update socket array "
+                      "for %V, worker:%ui", &ls->addr_text, ls->worker);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "reuseport bpf sockarray fd:%d add socket:%d worker:%ui",
+                   grp->map_fd, ls->fd, ls->worker);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_reuseport_bpf_release(ngx_cycle_t *cycle)
+{
+    uint32_t                    key;
+    ngx_queue_t                *q;
+    ngx_core_conf_t            *old_ccf;
+    ngx_reuseport_bpf_conf_t   *old_bcf;
+    ngx_reuseport_bpf_group_t  *grp;
+
+    /*
+     * a socket cannot be added to a socket array while it is still
+     * in another one, and the previous cycle keeps its arrays until
+     * its worker processes exit, so the sockets are removed from them
+     */
+
+    if (ngx_is_init_cycle(cycle->old_cycle)) {
+        return;
+    }
+
+    old_bcf = ngx_reuseport_bpf_get_old_conf(cycle);
+
+    if (old_bcf == NULL || old_bcf->enabled != 1) {
+        return;
+    }
+
+    old_ccf = ngx_core_get_conf(cycle->old_cycle);
+
+    for (q = ngx_queue_head(&old_bcf->groups);
+         q != ngx_queue_sentinel(&old_bcf->groups);
+         q = ngx_queue_next(q))
+    {
+        grp = ngx_queue_data(q, ngx_reuseport_bpf_group_t, queue);
+
+        for (key = 0; key < (uint32_t) old_ccf->worker_processes; key++) {
+            if (ngx_bpf_map_delete(grp->map_fd, &key) == -1
+                && ngx_errno != NGX_ENOENT)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                              "reuseport bpf failed to remove socket "
+                              "from sockarray fd:%d", grp->map_fd);
+            }
+        }
+    }
+}
+
+
+static void
+ngx_reuseport_bpf_detach(ngx_cycle_t *cycle)
+{
+#ifdef SO_DETACH_REUSEPORT_BPF
+    int                        dummy;
+    ngx_uint_t                 i;
+    ngx_listening_t           *ls;
+    ngx_reuseport_bpf_conf_t  *old_bcf;
+
+    /* the program attached by the previous configuration is removed */
+
+    if (ngx_is_init_cycle(cycle->old_cycle)) {
+        return;
+    }
+
+    old_bcf = ngx_reuseport_bpf_get_old_conf(cycle);
+
+    if (old_bcf == NULL || old_bcf->enabled != 1) {
+        return;
+    }
+
+    dummy = 0;
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+        if (!ls[i].reuseport
+            || ls[i].type != SOCK_STREAM
+            || ls[i].fd == (ngx_socket_t) -1)
+        {
+            continue;
+        }
+
+        if (setsockopt(ls[i].fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF,
+                       &dummy, sizeof(int))
+            == -1
+            && ngx_socket_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          "reuseport bpf setsockopt(SO_DETACH_REUSEPORT_BPF) "
+                          "for %V failed", &ls[i].addr_text);
+        }
+    }
+#endif
+}
@@ -12,9 +12,24 @@
 
 #if !(NGX_WIN32)
 
+#if (NGX_HAVE_RECVMMSG)
+#define NGX_UDP_RECV_BATCH  16
+#else
+#define NGX_UDP_RECV_BATCH  1
+#endif
+
+#define NGX_UDP_HASH_SIZE   64
+
+
+static ngx_int_t ngx_event_udp_handle(ngx_event_t *ev, struct msghdr *msg,
+    u_char *buffer, ssize_t n);
 static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
 static ssize_t ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf,
     size_t size);
+static uint32_t ngx_udp_hash(ngx_listening_t *ls, struct sockaddr *sockaddr,
+    socklen_t socklen, struct sockaddr *local_sockaddr,
+    socklen_t local_socklen);
+static ngx_int_t ngx_udp_hash_grow(ngx_listening_t *ls);
 static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c);
 static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
     struct sockaddr *sockaddr, socklen_t socklen,
@@ -25,22 +40,25 @@ void
 ngx_event_recvmsg(ngx_event_t *ev)
 {
     ssize_t            n;
-    ngx_buf_t          buf;
-    ngx_log_t         *log;
+    ngx_int_t          nmsgs;
     ngx_err_t          err;
-    socklen_t          socklen, local_socklen;
-    ngx_event_t       *rev, *wev;
-    struct iovec       iov[1];
-    struct msghdr      msg;
-    ngx_sockaddr_t     sa, lsa;
-    struct sockaddr   *sockaddr, *local_sockaddr;
     ngx_listening_t   *ls;
     ngx_event_conf_t  *ecf;
-    ngx_connection_t  *c, *lc;
-    static u_char      buffer[65535];
+    ngx_connection_t  *lc;
+    static u_char      buffer[NGX_UDP_RECV_BATCH][65535];
+    struct iovec       iov[NGX_UDP_RECV_BATCH];
+    ngx_sockaddr_t     sa[NGX_UDP_RECV_BATCH];
+
+#if (NGX_HAVE_RECVMMSG)
+    ngx_int_t          i;
+    struct mmsghdr     msgs[NGX_UDP_RECV_BATCH];
+#else
+    struct msghdr      msg;
+#endif
 
 #if (NGX_HAVE_ADDRINFO_CMSG)
-    u_char             msg_control[CMSG_SPACE(sizeof(ngx_addrinfo_t))];
+    u_char             msg_control[NGX_UDP_RECV_BATCH]
+                                  [CMSG_SPACE(sizeof(ngx_addrinfo_t))];
 #endif
 
     if (ev->timedout) {
@@ -65,22 +83,84 @@ ngx_event_recvmsg(ngx_event_t *ev)
                    "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
 
     do {
+
+#if (NGX_HAVE_RECVMMSG)
+
+        /*
+         * a single recvmmsg() call receives up to NGX_UDP_RECV_BATCH
+         * datagrams, each into its own static buffer; the buffers are
+         * only used until the datagram is dispatched
+         */
+
+        for (i = 0; i < NGX_UDP_RECV_BATCH; i++) {
+            ngx_memzero(&msgs[i].msg_hdr, sizeof(struct msghdr));
+
+            iov[i].iov_base = (void *) buffer[i];
+            iov[i].iov_len = sizeof(buffer[i]);
+
+            msgs[i].msg_hdr.msg_name = &sa[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(ngx_sockaddr_t);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+            if (ls->wildcard) {
+                msgs[i].msg_hdr.msg_control = &msg_control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(msg_control[i]);
+
+                ngx_memzero(&msg_control[i], sizeof(msg_control[i]));
+            }
+#endif
+        }
+
+        nmsgs = recvmmsg(lc->fd, msgs, NGX_UDP_RECV_BATCH, 0, NULL);
+
+        if (nmsgs == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                               "recvmmsg() not ready");
+                return;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmmsg() failed");
+
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "recvmmsg: %i datagrams", nmsgs);
+
+        /*
+         * the datagrams are already read from the socket, so a failure
+         * to handle one of them only drops it, not the rest of the batch
+         */
+
+        for (i = 0; i < nmsgs; i++) {
+            n = msgs[i].msg_len;
+
+            (void) ngx_event_udp_handle(ev, &msgs[i].msg_hdr, buffer[i], n);
+        }
+
+#else
+
         ngx_memzero(&msg, sizeof(struct msghdr));
 
-        iov[0].iov_base = (void *) buffer;
-        iov[0].iov_len = sizeof(buffer);
+        iov[0].iov_base = (void *) buffer[0];
+        iov[0].iov_len = sizeof(buffer[0]);
 
-        msg.msg_name = &sa;
+        msg.msg_name = &sa[0];
         msg.msg_namelen = sizeof(ngx_sockaddr_t);
         msg.msg_iov = iov;
         msg.msg_iovlen = 1;
 
 #if (NGX_HAVE_ADDRINFO_CMSG)
         if (ls->wildcard) {
-            msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
+            msg.msg_control = &msg_control[0];
+            msg.msg_controllen = sizeof(msg_control[0]);
 
-            ngx_memzero(&msg_control, sizeof(msg_control));
+            ngx_memzero(&msg_control[0], sizeof(msg_control[0]));
         }
 #endif
 
@@ -100,251 +180,292 @@ ngx_event_recvmsg(ngx_event_t *ev)
             return;
         }
 
-#if (NGX_HAVE_ADDRINFO_CMSG)
-        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
-            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
-                          "recvmsg() truncated data");
-            continue;
+        nmsgs = 1;
+
+        if (ngx_event_udp_handle(ev, &msg, buffer[0], n) != NGX_OK) {
+            return;
         }
+
+        if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+            ev->available -= n;
+        }
+
 #endif
 
-        sockaddr = msg.msg_name;
-        socklen = msg.msg_namelen;
+    } while (ev->available && nmsgs == NGX_UDP_RECV_BATCH);
+}
 
-        if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
-            socklen = sizeof(ngx_sockaddr_t);
-        }
 
-        if (socklen == 0) {
+static ngx_int_t
+ngx_event_udp_handle(ngx_event_t *ev, struct msghdr *msg, u_char *buffer,
+    ssize_t n)
+{
+    ngx_buf_t          buf;
+    ngx_log_t         *log;
+    socklen_t          socklen, local_socklen;
+    ngx_event_t       *rev, *wev;
+    ngx_sockaddr_t     lsa;
+    struct sockaddr   *sockaddr, *local_sockaddr;
+    ngx_listening_t   *ls;
+    ngx_connection_t  *c, *lc;
 
-            /*
-             * on Linux recvmsg() returns zero msg_namelen
-             * when receiving packets from unbound AF_UNIX sockets
-             */
+    lc = ev->data;
+    ls = lc->listening;
 
-            socklen = sizeof(struct sockaddr);
-            ngx_memzero(&sa, sizeof(struct sockaddr));
-            sa.sockaddr.sa_family = ls->sockaddr->sa_family;
-        }
+#if (NGX_HAVE_ADDRINFO_CMSG)
+    if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "recvmsg() truncated data");
+        return NGX_OK;
+    }
+#endif
+
+    sockaddr = msg->msg_name;
+    socklen = msg->msg_namelen;
+
+    if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
+        socklen = sizeof(ngx_sockaddr_t);
+    }
+
+    if (socklen == 0) {
 
-        local_sockaddr = ls->sockaddr;
-        local_socklen = ls->socklen;
+        /*
+         * on Linux recvmsg() returns zero msg_namelen
+         * when receiving packets from unbound AF_UNIX sockets
+         */
+
+        socklen = sizeof(struct sockaddr);
+        ngx_memzero(sockaddr, sizeof(struct sockaddr));
+        sockaddr->sa_family = ls->sockaddr->sa_family;
+    }
+
+    local_sockaddr = ls->sockaddr;
+    local_socklen = ls->socklen;
 
 #if (NGX_HAVE_ADDRINFO_CMSG)
 
-        if (ls->wildcard) {
-            struct cmsghdr  *cmsg;
-
-            ngx_memcpy(&lsa, local_sockaddr, local_socklen);
-            local_sockaddr = &lsa.sockaddr;
-
-            for (cmsg = CMSG_FIRSTHDR(&msg);
-                 cmsg != NULL;
-                 cmsg = CMSG_NXTHDR(&msg, cmsg))
-            {
-                if (ngx_get_srcaddr_cmsg(cmsg, local_sockaddr) == NGX_OK) {
-                    break;
-                }
+    if (ls->wildcard) {
+        struct cmsghdr  *cmsg;
+
+        ngx_memcpy(&lsa, local_sockaddr, local_socklen);
+        local_sockaddr = &lsa.sockaddr;
+
+        for (cmsg = CMSG_FIRSTHDR(msg);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+            if (ngx_get_srcaddr_cmsg(cmsg, local_sockaddr) == NGX_OK) {
+                break;
             }
         }
+    }
 
 #endif
 
+    if (ls->sessionless) {
+        c = NULL;
+
+    } else {
         c = ngx_lookup_udp_connection(ls, sockaddr, socklen, local_sockaddr,
                                       local_socklen);
+    }
 
-        if (c) {
+    if (c) {
 
 #if (NGX_DEBUG)
-            if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
-                ngx_log_handler_pt  handler;
+        if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
+            ngx_log_handler_pt  handler;
 
-                handler = c->log->handler;
-                c->log->handler = NULL;
+            handler = c->log->handler;
+            c->log->handler = NULL;
 
-                ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "recvmsg: fd:%d n:%z", c->fd, n);
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "recvmsg: fd:%d n:%z", c->fd, n);
 
-                c->log->handler = handler;
-            }
+            c->log->handler = handler;
+        }
 #endif
 
-            ngx_memzero(&buf, sizeof(ngx_buf_t));
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
 
-            buf.pos = buffer;
-            buf.last = buffer + n;
+        buf.pos = buffer;
+        buf.last = buffer + n;
 
-            rev = c->read;
+        rev = c->read;
 
-            c->udp->buffer = &buf;
+        c->udp->buffer = &buf;
 
-            rev->ready = 1;
-            rev->active = 0;
+        rev->ready = 1;
+        rev->active = 0;
 
-            rev->handler(rev);
+        rev->handler(rev);
 
-            if (c->udp) {
-                c->udp->buffer = NULL;
-            }
+        if (c->udp) {
+            c->udp->buffer = NULL;
+        }
 
-            rev->ready = 0;
-            rev->active = 1;
+        rev->ready = 0;
+        rev->active = 1;
 
-            goto next;
-        }
+        return NGX_OK;
+    }
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
 #endif
 
-        ngx_accept_disabled = ngx_cycle->connection_n / 8
-                              - ngx_cycle->free_connection_n;
+    ngx_accept_disabled = ngx_cycle->connection_n / 8
+                          - ngx_cycle->free_connection_n;
 
-        c = ngx_get_connection(lc->fd, ev->log);
-        if (c == NULL) {
-            return;
-        }
+    c = ngx_get_connection(lc->fd, ev->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
 
-        c->shared = 1;
-        c->type = SOCK_DGRAM;
-        c->socklen = socklen;
+    c->shared = 1;
+    c->type = SOCK_DGRAM;
+    c->socklen = socklen;
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
 
-        c->pool = ngx_create_pool(ls->pool_size, ev->log);
-        if (c->pool == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
-
-        c->sockaddr = ngx_palloc(c->pool, socklen);
-        if (c->sockaddr == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
+    c->pool = ngx_create_pool(ls->pool_size, ev->log);
+    if (c->pool == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-        ngx_memcpy(c->sockaddr, sockaddr, socklen);
+    c->sockaddr = ngx_palloc(c->pool, socklen);
+    if (c->sockaddr == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-        log = ngx_palloc(c->pool, sizeof(ngx_log_t));
-        if (log == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
+    ngx_memcpy(c->sockaddr, sockaddr, socklen);
 
-        *log = ls->log;
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-        c->recv = ngx_udp_shared_recv;
-        c->send = ngx_udp_send;
-        c->send_chain = ngx_udp_send_chain;
+    *log = ls->log;
 
-        c->need_flush_buf = 1;
+    c->recv = ngx_udp_shared_recv;
+    c->send = ngx_udp_send;
+    c->send_chain = ngx_udp_send_chain;
 
-        c->log = log;
-        c->pool->log = log;
-        c->listening = ls;
+    c->need_flush_buf = 1;
 
-        if (local_sockaddr == &lsa.sockaddr) {
-            local_sockaddr = ngx_palloc(c->pool, local_socklen);
-            if (local_sockaddr == NULL) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
+    c->log = log;
+    c->pool->log = log;
+    c->listening = ls;
 
-            ngx_memcpy(local_sockaddr, &lsa, local_socklen);
+    if (local_sockaddr == &lsa.sockaddr) {
+        local_sockaddr = ngx_palloc(c->pool, local_socklen);
+        if (local_sockaddr == NULL) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
         }
 
-        c->local_sockaddr = local_sockaddr;
-        c->local_socklen = local_socklen;
+        ngx_memcpy(local_sockaddr, &lsa, local_socklen);
+    }
 
-        c->buffer = ngx_create_temp_buf(c->pool, n);
-        if (c->buffer == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
+    c->local_sockaddr = local_sockaddr;
+    c->local_socklen = local_socklen;
 
-        c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
+    c->buffer = ngx_create_temp_buf(c->pool, n);
+    if (c->buffer == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-        rev = c->read;
-        wev = c->write;
+    c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
 
-        rev->active = 1;
-        wev->ready = 1;
+    rev = c->read;
+    wev = c->write;
 
-        rev->log = log;
-        wev->log = log;
+    rev->active = 1;
+    wev->ready = 1;
 
-        /*
-         * TODO: MT: - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         *
-         * TODO: MP: - allocated in a shared memory
-         *           - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         */
+    rev->log = log;
+    wev->log = log;
 
-        c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    /*
+     * TODO: MT: - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     *
+     * TODO: MP: - allocated in a shared memory
+     *           - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     */
 
-        c->start_time = ngx_current_msec;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    c->start_time = ngx_current_msec;
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
 #endif
 
-        if (ls->addr_ntop) {
-            c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
-            if (c->addr_text.data == NULL) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
+        }
 
-            c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
-                                             c->addr_text.data,
-                                             ls->addr_text_max_len, 0);
-            if (c->addr_text.len == 0) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
         }
+    }
 
 #if (NGX_DEBUG)
-        {
-        ngx_str_t  addr;
-        u_char     text[NGX_SOCKADDR_STRLEN];
+    {
+    ngx_str_t          addr;
+    ngx_event_conf_t  *ecf;
+    u_char             text[NGX_SOCKADDR_STRLEN];
 
-        ngx_debug_accepted_connection(ecf, c);
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
 
-        if (log->log_level & NGX_LOG_DEBUG_EVENT) {
-            addr.data = text;
-            addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
-                                     NGX_SOCKADDR_STRLEN, 1);
+    ngx_debug_accepted_connection(ecf, c);
 
-            ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
-                           "*%uA recvmsg: %V fd:%d n:%z",
-                           c->number, &addr, c->fd, n);
-        }
+    if (log->log_level & NGX_LOG_DEBUG_EVENT) {
+        addr.data = text;
+        addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
+                                 NGX_SOCKADDR_STRLEN, 1);
 
-        }
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "*%uA recvmsg: %V fd:%d n:%z",
+                       c->number, &addr, c->fd, n);
+    }
+
+    }
 #endif
 
+    /*
+     * in the sessionless mode each datagram starts a new session,
+     * which is never looked up by the client address
+     */
+
+    if (!ls->sessionless) {
         if (ngx_insert_udp_connection(c) != NGX_OK) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            return NGX_ERROR;
         }
+    }
 
-        log->data = NULL;
-        log->handler = NULL;
-
-        ls->handler(c);
-
-    next:
+    log->data = NULL;
+    log->handler = NULL;
 
-        if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
-            ev->available -= n;
-        }
+    ls->handler(c);
 
-    } while (ev->available);
+    return NGX_OK;
 }
 
 
@@ -443,10 +564,72 @@ ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+static uint32_t
+ngx_udp_hash(ngx_listening_t *ls, struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen)
+{
+    uint32_t  hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) sockaddr, socklen);
+
+    if (ls->wildcard) {
+        ngx_crc32_update(&hash, (u_char *) local_sockaddr, local_socklen);
+    }
+
+    ngx_crc32_final(hash);
+
+    return hash;
+}
+
+
+static ngx_int_t
+ngx_udp_hash_grow(ngx_listening_t *ls)
+{
+    ngx_uint_t              i, size, key;
+    ngx_udp_connection_t   *udp, *next, **hash;
+
+    size = ls->udp_hash_size ? ls->udp_hash_size * 2 : NGX_UDP_HASH_SIZE;
+
+    /* the table is reallocated as it grows, hence not from the pool */
+
+    hash = ngx_calloc(size * sizeof(ngx_udp_connection_t *), ngx_cycle->log);
+    if (hash == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ls->udp_hash_size; i++) {
+
+        for (udp = ls->udp_hash[i]; udp; udp = next) {
+            next = udp->next;
+
+            key = udp->node.key & (size - 1);
+
+            udp->next = hash[key];
+            hash[key] = udp;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "udp sessions hash of %V: %ui buckets",
+                   &ls->addr_text, size);
+
+    if (ls->udp_hash) {
+        ngx_free(ls->udp_hash);
+    }
+
+    ls->udp_hash = hash;
+    ls->udp_hash_size = size;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_insert_udp_connection(ngx_connection_t *c)
 {
-    uint32_t               hash;
+    ngx_uint_t             key;
+    ngx_listening_t       *ls;
     ngx_pool_cleanup_t    *cln;
     ngx_udp_connection_t  *udp;
 
@@ -454,6 +637,14 @@ ngx_insert_udp_connection(ngx_connection_t *c)
         return NGX_OK;
     }
 
+    ls = c->listening;
+
+    if (ls->udp_nsessions >= ls->udp_hash_size) {
+        if (ngx_udp_hash_grow(ls) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
     udp = ngx_pcalloc(c->pool, sizeof(ngx_udp_connection_t));
     if (udp == NULL) {
         return NGX_ERROR;
@@ -461,16 +652,8 @@ ngx_insert_udp_connection(ngx_connection_t *c)
 
     udp->connection = c;
 
-    ngx_crc32_init(hash);
-    ngx_crc32_update(&hash, (u_char *) c->sockaddr, c->socklen);
-
-    if (c->listening->wildcard) {
-        ngx_crc32_update(&hash, (u_char *) c->local_sockaddr, c->local_socklen);
-    }
-
-    ngx_crc32_final(hash);
-
-    udp->node.key = hash;
+    udp->node.key = ngx_udp_hash(ls, c->sockaddr, c->socklen,
+                                 c->local_sockaddr, c->local_socklen);
     udp->key.data = (u_char *) c->sockaddr;
     udp->key.len = c->socklen;
 
@@ -482,7 +665,11 @@ ngx_insert_udp_connection(ngx_connection_t *c)
     cln->data = c;
     cln->handler = ngx_delete_udp_connection;
 
-    ngx_rbtree_insert(&c->listening->rbtree, &udp->node);
+    key = udp->node.key & (ls->udp_hash_size - 1);
+
+    udp->next = ls->udp_hash[key];
+    ls->udp_hash[key] = udp;
+    ls->udp_nsessions++;
 
     c->udp = udp;
 
@@ -495,11 +682,25 @@ ngx_delete_udp_connection(void *data)
 {
     ngx_connection_t  *c = data;
 
+    ngx_listening_t        *ls;
+    ngx_udp_connection_t  **udpp;
+
     if (c->udp == NULL) {
         return;
     }
 
-    ngx_rbtree_delete(&c->listening->rbtree, &c->udp->node);
+    ls = c->listening;
+
+    for (udpp = &ls->udp_hash[c->udp->node.key & (ls->udp_hash_size - 1)];
+         *udpp;
+         udpp = &(*udpp)->next)
+    {
+        if (*udpp == c->udp) {
+            *udpp = c->udp->next;
+            ls->udp_nsessions--;
+            break;
+        }
+    }
 
     c->udp = NULL;
 }
@@ -510,9 +711,7 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
     socklen_t socklen, struct sockaddr *local_sockaddr, socklen_t local_socklen)
 {
     uint32_t               hash;
-    ngx_int_t              rc;
     ngx_connection_t      *c;
-    ngx_rbtree_node_t     *node, *sentinel;
     ngx_udp_connection_t  *udp;
 
 #if (NGX_HAVE_UNIX_DOMAIN)
@@ -531,49 +730,38 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
 
 #endif
 
-    node = ls->rbtree.root;
-    sentinel = ls->rbtree.sentinel;
-
-    ngx_crc32_init(hash);
-    ngx_crc32_update(&hash, (u_char *) sockaddr, socklen);
-
-    if (ls->wildcard) {
-        ngx_crc32_update(&hash, (u_char *) local_sockaddr, local_socklen);
+    if (ls->udp_nsessions == 0) {
+        return NULL;
     }
 
-    ngx_crc32_final(hash);
-
-    while (node != sentinel) {
-
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    hash = ngx_udp_hash(ls, sockaddr, socklen, local_sockaddr, local_socklen);
 
-        if (hash > node->key) {
-            node = node->right;
+    for (udp = ls->udp_hash[hash & (ls->udp_hash_size - 1)];
+         udp;
+         udp = udp->next)
+    {
+        if (udp->node.key != hash) {
             continue;
         }
 
-        /* hash == node->key */
-
-        udp = (ngx_udp_connection_t *) node;
-
         c = udp->connection;
 
-        rc = ngx_cmp_sockaddr(sockaddr, socklen,
-                              c->sockaddr, c->socklen, 1);
-
-        if (rc == 0 && ls->wildcard) {
-            rc = ngx_cmp_sockaddr(local_sockaddr, local_socklen,
-                                  c->local_sockaddr, c->local_socklen, 1);
+        if (ngx_cmp_sockaddr(sockaddr, socklen,
+                             c->sockaddr, c->socklen, 1)
+            != NGX_OK)
+        {
+            continue;
         }
 
-        if (rc == 0) {
-            return c;
+        if (ls->wildcard
+            && ngx_cmp_sockaddr(local_sockaddr, local_socklen,
+                                c->local_sockaddr, c->local_socklen, 1)
+               != NGX_OK)
+        {
+            continue;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        return c;
     }
 
     return NULL;
@@ -28,6 +28,7 @@ struct ngx_udp_connection_s {
     ngx_connection_t   *connection;
     ngx_buf_t          *buffer;
     ngx_str_t           key;
+    ngx_udp_connection_t  *next;
 };
 
 
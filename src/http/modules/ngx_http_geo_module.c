@@ -28,6 +28,9 @@ typedef struct {
 typedef struct {
     ngx_http_geo_range_t           **low;
     ngx_http_variable_value_t       *default_value;
+
+    /* a mapped binary base, ranges and values are offsets into it */
+    u_char                          *base;
 } ngx_http_geo_high_ranges_t;
 
 
@@ -105,6 +108,7 @@ static char *ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name);
 static ngx_int_t ngx_http_geo_include_binary_base(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *name);
+static void ngx_http_geo_unmap_binary_base(void *data);
 static void ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx);
 static u_char *ngx_http_geo_copy_values(u_char *base, u_char *p,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -249,6 +253,7 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 {
     ngx_http_geo_ctx_t *ctx = (ngx_http_geo_ctx_t *) data;
 
+    u_char                *base;
     in_addr_t              inaddr;
     ngx_addr_t             addr;
     ngx_uint_t             n;
@@ -304,12 +309,25 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         range = ctx->u.high.low[inaddr >> 16];
 
         if (range) {
+            base = ctx->u.high.base;
+
+            if (base) {
+                range = (ngx_http_geo_range_t *) (base + (size_t) range);
+            }
+
             n = inaddr & 0xffff;
             do {
                 if (n >= (ngx_uint_t) range->start
                     && n <= (ngx_uint_t) range->end)
                 {
-                    *v = *range->value;
+                    if (base == NULL) {
+                        *v = *range->value;
+                        break;
+                    }
+
+                    *v = *(ngx_http_variable_value_t *)
+                              (base + (size_t) range->value);
+                    v->data = base + (size_t) v->data;
                     break;
                 }
             } while ((++range)->value);
@@ -1406,25 +1424,19 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 {
     u_char                     *base, ch;
     time_t                      mtime;
-    size_t                      size, len;
-    ssize_t                     n;
-    uint32_t                    crc32;
+    size_t                      size;
+    ngx_fd_t                    fd;
     ngx_err_t                   err;
     ngx_int_t                   rc;
-    ngx_uint_t                  i;
-    ngx_file_t                  file;
     ngx_file_info_t             fi;
-    ngx_http_geo_range_t       *range, **ranges;
+    ngx_pool_cleanup_t         *cln;
+    ngx_file_mapping_t         *fm;
     ngx_http_geo_header_t      *header;
     ngx_http_variable_value_t  *vv;
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
-    file.name = *name;
-    file.log = cf->log;
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
-
-    if (file.fd == NGX_INVALID_FILE) {
+    if (fd == NGX_INVALID_FILE) {
         err = ngx_errno;
         if (err != NGX_ENOENT) {
             ngx_conf_log_error(NGX_LOG_CRIT, cf, err,
@@ -1449,7 +1461,7 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto done;
     }
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
         ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
                            ngx_fd_info_n " \"%s\" failed", name->data);
         goto failed;
@@ -1475,86 +1487,84 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto failed;
     }
 
-    base = ngx_palloc(ctx->pool, size);
-    if (base == NULL) {
+    if (size < sizeof(ngx_http_geo_header_t)
+                  + sizeof(ngx_http_variable_value_t)
+                  + 0x10000 * sizeof(ngx_http_geo_range_t *))
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+             "incompatible binary geo range base \"%s\"", name->data);
         goto failed;
     }
 
-    n = ngx_read_file(&file, base, size, 0);
+    /*
+     * the base is mapped read-only rather than read into the pool:
+     * it is shared by all worker processes through the page cache and
+     * its ranges and values are looked up as offsets without relocation
+     */
 
-    if (n == NGX_ERROR) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
-                           ngx_read_file_n " \"%s\" failed", name->data);
-        goto failed;
+    cln = ngx_pool_cleanup_add(ctx->pool, sizeof(ngx_file_mapping_t));
+    if (cln == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    fm = cln->data;
+
+    fm->name = ngx_pnalloc(ctx->pool, name->len + 1);
+    if (fm->name == NULL) {
+        rc = NGX_ERROR;
+        goto done;
     }
 
-    if ((size_t) n != size) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
-            ngx_read_file_n " \"%s\" returned only %z bytes instead of %z",
-            name->data, n, size);
+    (void) ngx_cpystrn(fm->name, name->data, name->len + 1);
+
+    fm->size = size;
+    fm->fd = fd;
+    fm->log = ctx->pool->log;
+
+    if (ngx_map_file(fm) != NGX_OK) {
         goto failed;
     }
 
+    base = fm->addr;
     header = (ngx_http_geo_header_t *) base;
 
-    if (size < 16 || ngx_memcmp(&ngx_http_geo_header, header, 12) != 0) {
+    if (ngx_memcmp(&ngx_http_geo_header, header, 12) != 0) {
         ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
              "incompatible binary geo range base \"%s\"", name->data);
+        ngx_unmap_file(fm);
         goto failed;
     }
 
-    ngx_crc32_init(crc32);
-
-    vv = (ngx_http_variable_value_t *) (base + sizeof(ngx_http_geo_header_t));
-
-    while (vv->data) {
-        len = ngx_align(sizeof(ngx_http_variable_value_t) + vv->len,
-                        sizeof(void *));
-        ngx_crc32_update(&crc32, (u_char *) vv, len);
-        vv->data += (size_t) base;
-        vv = (ngx_http_variable_value_t *) ((u_char *) vv + len);
+    if (ngx_crc32_long(base + sizeof(ngx_http_geo_header_t),
+                       size - sizeof(ngx_http_geo_header_t))
+        != header->crc32)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                  "CRC32 mismatch in binary geo range base \"%s\"", name->data);
+        ngx_unmap_file(fm);
+        goto failed;
     }
-    ngx_crc32_update(&crc32, (u_char *) vv, sizeof(ngx_http_variable_value_t));
-    vv++;
-
-    ranges = (ngx_http_geo_range_t **) vv;
 
-    for (i = 0; i < 0x10000; i++) {
-        ngx_crc32_update(&crc32, (u_char *) &ranges[i], sizeof(void *));
-        if (ranges[i]) {
-            ranges[i] = (ngx_http_geo_range_t *)
-                            ((u_char *) ranges[i] + (size_t) base);
-        }
-    }
+    cln->handler = ngx_http_geo_unmap_binary_base;
 
-    range = (ngx_http_geo_range_t *) &ranges[0x10000];
+    vv = (ngx_http_variable_value_t *) (base + sizeof(ngx_http_geo_header_t));
 
-    while ((u_char *) range < base + size) {
-        while (range->value) {
-            ngx_crc32_update(&crc32, (u_char *) range,
-                             sizeof(ngx_http_geo_range_t));
-            range->value = (ngx_http_variable_value_t *)
-                               ((u_char *) range->value + (size_t) base);
-            range++;
-        }
-        ngx_crc32_update(&crc32, (u_char *) range, sizeof(void *));
-        range = (ngx_http_geo_range_t *) ((u_char *) range + sizeof(void *));
+    while (vv->data) {
+        vv = (ngx_http_variable_value_t *) ((u_char *) vv
+                 + ngx_align(sizeof(ngx_http_variable_value_t) + vv->len,
+                             sizeof(void *)));
     }
 
-    ngx_crc32_final(crc32);
-
-    if (crc32 != header->crc32) {
-        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                  "CRC32 mismatch in binary geo range base \"%s\"", name->data);
-        goto failed;
-    }
+    vv++;
 
     ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
                        "using binary geo range base \"%s\"", name->data);
 
     ctx->include_name = *name;
     ctx->binary_include = 1;
-    ctx->high.low = ranges;
+    ctx->high.low = (ngx_http_geo_range_t **) vv;
+    ctx->high.base = base;
     rc = NGX_OK;
 
     goto done;
@@ -1565,7 +1575,7 @@ failed:
 
 done:
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
         ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
                       ngx_close_file_n " \"%s\" failed", name->data);
     }
@@ -1574,10 +1584,19 @@ done:
 }
 
 
+static void
+ngx_http_geo_unmap_binary_base(void *data)
+{
+    ngx_file_mapping_t  *fm = data;
+
+    ngx_unmap_file(fm);
+}
+
+
 static void
 ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
 {
-    u_char                              *p;
+    u_char                              *p, *name;
     uint32_t                             hash;
     ngx_str_t                            s;
     ngx_uint_t                           i;
@@ -1586,18 +1605,31 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
     ngx_http_geo_header_t               *header;
     ngx_http_geo_variable_value_node_t  *gvvn;
 
-    fm.name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    /*
+     * the base is created under a temporary name and then renamed,
+     * as the previous one may still be mapped by old worker processes
+     */
+
+    fm.name = ngx_pnalloc(ctx->temp_pool,
+                          ctx->include_name.len + 6 + NGX_INT64_LEN);
     if (fm.name == NULL) {
         return;
     }
 
-    ngx_sprintf(fm.name, "%V.bin%Z", &ctx->include_name);
+    ngx_sprintf(fm.name, "%V.bin.%P%Z", &ctx->include_name, ngx_pid);
 
     fm.size = ctx->data_size;
     fm.log = ctx->pool->log;
 
     ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
-                  "creating binary geo range base \"%s\"", fm.name);
+                  "creating binary geo range base \"%s\"", name);
 
     if (ngx_create_file_mapping(&fm) != NGX_OK) {
         return;
@@ -1649,6 +1681,17 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
                                    fm.size - sizeof(ngx_http_geo_header_t));
 
     ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      fm.name, name);
+
+        if (ngx_delete_file(fm.name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", fm.name);
+        }
+    }
 }
 
 
@@ -37,13 +37,48 @@ typedef struct {
 } ngx_http_limit_req_shctx_t;
 
 
+/*
+ * The lockfree zone is a fixed-size open addressing table, each slot holds
+ * a key fingerprint and the theoretical arrival time of the next request
+ * (GCRA), in nanoseconds since the zone epoch, both updated atomically.
+ */
+
+#define NGX_HTTP_LIMIT_REQ_PROBES     8
+#define NGX_HTTP_LIMIT_REQ_TAT_BIAS   ((uint64_t) 1 << 42)
+
+
+typedef struct {
+    ngx_atomic_t                 key;
+    ngx_atomic_t                 tat;
+} ngx_http_limit_req_slot_t;
+
+
+typedef struct {
+    ngx_msec_t                   epoch;
+    ngx_uint_t                   mask;
+    ngx_http_limit_req_slot_t   *slots;
+} ngx_http_limit_req_table_t;
+
+
 typedef struct {
     ngx_http_limit_req_shctx_t  *sh;
+    ngx_http_limit_req_table_t  *table;
     ngx_slab_pool_t             *shpool;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
+    /* emission interval, in nanoseconds */
+    uint64_t                     interval;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_slot_t   *slot;
+    ngx_uint_t                   lockfree;  /* unsigned  lockfree:1; */
+    ngx_uint_t                   sync;      /* unsigned  sync:1; */
+    /* the key of the current request, if it is to be sent to peers */
+    ngx_str_t                    sync_key;
+    uint32_t                     sync_hash;
+    /* per-worker requests not yet sent to peers */
+    ngx_rbtree_t                 deltas;
+    ngx_rbtree_node_t            deltas_sentinel;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -64,18 +99,101 @@ typedef struct {
 } ngx_http_limit_req_conf_t;
 
 
+/*
+ * Zones with the "sync" parameter are kept approximately consistent
+ * between nodes: each worker counts the requests it accounted per key
+ * and periodically sends the counts to all peers over UDP; the peers
+ * add them to their own state as if the requests were made locally.
+ *
+ * Datagrams are encrypted and authenticated with AES-256-GCM using
+ * the key from the "limit_req_sync_key" file:
+ *
+ *     "NLRS" version:1 nonce:12 ciphertext tag:16
+ *
+ * with the plaintext being:
+ *
+ *     time:8 name_len:1 name { key_len:2 count:2 key }...
+ */
+
+#define NGX_HTTP_LIMIT_REQ_SYNC_VERSION  2
+#define NGX_HTTP_LIMIT_REQ_SYNC_MTU      1400
+#define NGX_HTTP_LIMIT_REQ_SYNC_HEADER   17
+#define NGX_HTTP_LIMIT_REQ_SYNC_TAG      16
+#define NGX_HTTP_LIMIT_REQ_SYNC_PLAIN    (NGX_HTTP_LIMIT_REQ_SYNC_MTU         \
+                                          - NGX_HTTP_LIMIT_REQ_SYNC_HEADER    \
+                                          - NGX_HTTP_LIMIT_REQ_SYNC_TAG)
+#define NGX_HTTP_LIMIT_REQ_SYNC_DELTAS   8192
+#define NGX_HTTP_LIMIT_REQ_SYNC_COUNT    65535
+#define NGX_HTTP_LIMIT_REQ_SYNC_SKEW     30
+
+
+typedef struct {
+    ngx_addr_t                  *listen;
+    ngx_array_t                  peers;     /* ngx_addr_t */
+    ngx_array_t                  zones;     /* ngx_shm_zone_t * */
+    ngx_msec_t                   interval;
+    u_char                      *key;
+} ngx_http_limit_req_main_conf_t;
+
+
+typedef struct {
+    ngx_str_node_t               sn;
+    ngx_uint_t                   count;
+} ngx_http_limit_req_delta_t;
+
+
+typedef struct {
+    ngx_connection_t            *connection;
+    ngx_event_t                  event;
+    ngx_pool_t                  *pool;
+    ngx_uint_t                   ndeltas;
+    ngx_http_limit_req_main_conf_t  *conf;
+} ngx_http_limit_req_sync_t;
+
+
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
     ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_insert(
+    ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash, ngx_str_t *key);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
     ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_lookup_table(
+    ngx_http_limit_req_limit_t *limit, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
+static ngx_http_limit_req_slot_t *ngx_http_limit_req_table_slot(
+    ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash, ngx_str_t *key);
+static ngx_int_t ngx_http_limit_req_update_slot(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_slot_t *slot, ngx_uint_t burst, ngx_uint_t account,
+    ngx_uint_t *ep);
+static ngx_int_t ngx_http_limit_req_init_table(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_req_ctx_t *ctx);
+
+static void ngx_http_limit_req_sync_record(ngx_http_limit_req_limit_t *limits,
+    ngx_uint_t n);
+static void ngx_http_limit_req_sync_flush(ngx_http_limit_req_sync_t *sync);
+static void ngx_http_limit_req_sync_send(ngx_http_limit_req_sync_t *sync,
+    u_char *plain, size_t size);
+static ssize_t ngx_http_limit_req_sync_seal(u_char *key, u_char *plain,
+    size_t len, u_char *buf, ngx_log_t *log);
+static ssize_t ngx_http_limit_req_sync_open(u_char *key, u_char *buf,
+    size_t size, u_char *plain, ngx_log_t *log);
+static void ngx_http_limit_req_sync_timer_handler(ngx_event_t *ev);
+static void ngx_http_limit_req_sync_read_handler(ngx_event_t *rev);
+static void ngx_http_limit_req_sync_process(
+    ngx_http_limit_req_main_conf_t *lrmcf, u_char *p, size_t size,
+    ngx_log_t *log);
+static void ngx_http_limit_req_sync_apply(ngx_http_limit_req_ctx_t *ctx,
+    ngx_str_t *key, ngx_uint_t count);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static void *ngx_http_limit_req_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_req_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -83,8 +201,19 @@ static char *ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_limit_req_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_limit_req_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#if (NGX_OPENSSL)
+static char *ngx_http_limit_req_sync_key(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static void ngx_http_limit_req_sync_key_cleanup(void *data);
+#endif
 static ngx_int_t ngx_http_limit_req_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_limit_req_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req_init_process(ngx_cycle_t *cycle);
+static void ngx_http_limit_req_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
@@ -104,7 +233,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4|NGX_CONF_TAKE5,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -138,6 +267,38 @@ static ngx_command_t  ngx_http_limit_req_commands[] = {
       offsetof(ngx_http_limit_req_conf_t, dry_run),
       NULL },
 
+    { ngx_string("limit_req_sync_listen"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_req_sync_listen,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_req_sync_peer"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_req_sync_peer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_req_sync_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_limit_req_main_conf_t, interval),
+      NULL },
+
+#if (NGX_OPENSSL)
+
+    { ngx_string("limit_req_sync_key"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_req_sync_key,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -146,8 +307,8 @@ static ngx_http_module_t  ngx_http_limit_req_module_ctx = {
     ngx_http_limit_req_add_variables,      /* preconfiguration */
     ngx_http_limit_req_init,               /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_limit_req_create_main_conf,   /* create main configuration */
+    ngx_http_limit_req_init_main_conf,     /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -164,15 +325,18 @@ ngx_module_t  ngx_http_limit_req_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_limit_req_exit_process,       /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 
+static ngx_http_limit_req_sync_t  ngx_http_limit_req_sync;
+
+
 static ngx_http_variable_t  ngx_http_limit_req_vars[] = {
 
     { ngx_string("limit_req_status"), NULL,
@@ -224,6 +388,8 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         ctx = limit->shm_zone->data;
 
+        ctx->sync_key.len = 0;
+
         if (ngx_http_complex_value(r, &ctx->key, &key) != NGX_OK) {
             ngx_http_limit_req_unlock(limits, n);
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -243,17 +409,28 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->table) {
+            rc = ngx_http_limit_req_lookup_table(limit, hash, &key, &excess,
+                                                 (n == lrcf->limits.nelts - 1));
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        } else {
+            ngx_shmtx_lock(&ctx->shpool->mutex);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
                        n, rc, excess / 1000, excess % 1000);
 
+        if (ctx->sync && (rc == NGX_AGAIN || rc == NGX_OK)) {
+            ctx->sync_key = key;
+            ctx->sync_hash = hash;
+        }
+
         if (rc != NGX_AGAIN) {
             break;
         }
@@ -291,6 +468,11 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
         excess = 0;
     }
 
+    if (ngx_http_limit_req_sync.connection) {
+        ngx_http_limit_req_sync_record(limits,
+                                       ngx_min(n + 1, lrcf->limits.nelts));
+    }
+
     delay = ngx_http_limit_req_account(limits, n, &excess, &limit);
 
     if (!delay) {
@@ -405,7 +587,6 @@ static ngx_int_t
 ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
 {
-    size_t                      size;
     ngx_int_t                   rc, excess;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
@@ -485,6 +666,34 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     *ep = 0;
 
+    lr = ngx_http_limit_req_insert(ctx, hash, key);
+    if (lr == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (account) {
+        lr->last = now;
+        lr->count = 0;
+        return NGX_OK;
+    }
+
+    lr->last = 0;
+    lr->count = 1;
+
+    ctx->node = lr;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_insert(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash,
+    ngx_str_t *key)
+{
+    size_t                      size;
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req_node_t  *lr;
+
     size = offsetof(ngx_rbtree_node_t, color)
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
@@ -500,7 +709,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", ctx->shpool->log_ctx);
-            return NGX_ERROR;
+            return NULL;
         }
     }
 
@@ -517,18 +726,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
 
-    if (account) {
-        lr->last = now;
-        lr->count = 0;
-        return NGX_OK;
-    }
-
-    lr->last = 0;
-    lr->count = 1;
-
-    ctx->node = lr;
-
-    return NGX_AGAIN;
+    return lr;
 }
 
 
@@ -537,6 +735,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit)
 {
     ngx_int_t                   excess;
+    ngx_uint_t                  value;
     ngx_msec_t                  now, delay, max_delay;
     ngx_msec_int_t              ms;
     ngx_http_limit_req_ctx_t   *ctx;
@@ -554,40 +753,56 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
     while (n--) {
         ctx = limits[n].shm_zone->data;
-        lr = ctx->node;
 
-        if (lr == NULL) {
-            continue;
-        }
+        if (ctx->table) {
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+            if (ctx->slot == NULL) {
+                continue;
+            }
 
-        now = ngx_current_msec;
-        ms = (ngx_msec_int_t) (now - lr->last);
+            (void) ngx_http_limit_req_update_slot(ctx, ctx->slot,
+                                                  NGX_MAX_INT_T_VALUE, 1,
+                                                  &value);
+            ctx->slot = NULL;
 
-        if (ms < -60000) {
-            ms = 1;
+            excess = value;
 
-        } else if (ms < 0) {
-            ms = 0;
-        }
+        } else {
+            lr = ctx->node;
 
-        excess = lr->excess - ctx->rate * ms / 1000 + 1000;
+            if (lr == NULL) {
+                continue;
+            }
 
-        if (excess < 0) {
-            excess = 0;
-        }
+            ngx_shmtx_lock(&ctx->shpool->mutex);
 
-        if (ms) {
-            lr->last = now;
-        }
+            now = ngx_current_msec;
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < -60000) {
+                ms = 1;
 
-        lr->excess = excess;
-        lr->count--;
+            } else if (ms < 0) {
+                ms = 0;
+            }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            excess = lr->excess - ctx->rate * ms / 1000 + 1000;
 
-        ctx->node = NULL;
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            if (ms) {
+                lr->last = now;
+            }
+
+            lr->excess = excess;
+            lr->count--;
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            ctx->node = NULL;
+        }
 
         if ((ngx_uint_t) excess <= limits[n].delay) {
             continue;
@@ -614,6 +829,8 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
     while (n--) {
         ctx = limits[n].shm_zone->data;
 
+        ctx->slot = NULL;
+
         if (ctx->node == NULL) {
             continue;
         }
@@ -695,6 +912,199 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 }
 
 
+static ngx_int_t
+ngx_http_limit_req_lookup_table(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+{
+    ngx_int_t                   rc;
+    ngx_http_limit_req_ctx_t   *ctx;
+    ngx_http_limit_req_slot_t  *slot;
+
+    ctx = limit->shm_zone->data;
+
+    slot = ngx_http_limit_req_table_slot(ctx, hash, key);
+
+    if (slot == NULL) {
+
+        /* the slots are too contended, the request is not accounted */
+
+        *ep = 0;
+
+        return account ? NGX_OK : NGX_AGAIN;
+    }
+
+    rc = ngx_http_limit_req_update_slot(ctx, slot, limit->burst, account, ep);
+
+    if (rc == NGX_BUSY || account) {
+        return rc;
+    }
+
+    ctx->slot = slot;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_http_limit_req_slot_t *
+ngx_http_limit_req_table_slot(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t hash,
+    ngx_str_t *key)
+{
+    ngx_uint_t                  i, n;
+    ngx_atomic_uint_t           fp, k, vk, tat, min;
+    ngx_http_limit_req_slot_t  *slots, *slot;
+
+    fp = ngx_murmur_hash2(key->data, key->len);
+#if (NGX_PTR_SIZE == 8)
+    fp = (fp << 32) | hash;
+#endif
+
+    if (fp == 0) {
+        fp = 1;
+    }
+
+    /* the probe sequence stays within adjacent cache lines */
+
+    slots = &ctx->table->slots[hash & ctx->table->mask
+                               & ~(NGX_HTTP_LIMIT_REQ_PROBES - 1)];
+
+    for (n = 0; n < 3; n++) {
+
+        slot = NULL;
+        vk = 0;
+        min = 0;
+
+        for (i = 0; i < NGX_HTTP_LIMIT_REQ_PROBES; i++) {
+
+            k = slots[i].key;
+
+            if (k == fp) {
+                return &slots[i];
+            }
+
+            /* the least recently used slot is the one with the oldest tat */
+
+            tat = slots[i].tat;
+
+            if (slot == NULL || tat < min) {
+                slot = &slots[i];
+                vk = k;
+                min = tat;
+            }
+        }
+
+        if (ngx_atomic_cmp_set(&slot->key, vk, fp)) {
+            tat = slot->tat;
+            (void) ngx_atomic_cmp_set(&slot->tat, tat, 0);
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_update_slot(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_slot_t *slot, ngx_uint_t burst, ngx_uint_t account,
+    ngx_uint_t *ep)
+{
+    uint64_t    now, tat, next, d;
+    ngx_uint_t  excess;
+
+    now = (uint64_t) (ngx_current_msec - ctx->table->epoch) * 1000000
+          + NGX_HTTP_LIMIT_REQ_TAT_BIAS;
+
+    for ( ;; ) {
+        tat = slot->tat;
+
+        next = tat + ctx->interval;
+
+        if (next < now) {
+            next = now;
+        }
+
+        d = next - now;
+
+        excess = (d / ctx->interval) * 1000
+                 + (d % ctx->interval) * 1000 / ctx->interval;
+
+        *ep = excess;
+
+        if (excess > burst) {
+            return NGX_BUSY;
+        }
+
+        if (!account) {
+            return NGX_OK;
+        }
+
+        if (ngx_atomic_cmp_set(&slot->tat, tat, next)) {
+            return NGX_OK;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_init_table(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_req_ctx_t *ctx)
+{
+    size_t                       len;
+    ngx_uint_t                   n;
+    ngx_http_limit_req_table_t  *table;
+
+    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    table = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_table_t));
+    if (table == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = NGX_HTTP_LIMIT_REQ_PROBES;
+
+    while (n * 2 * sizeof(ngx_http_limit_req_slot_t) <= shm_zone->shm.size) {
+        n *= 2;
+    }
+
+    for ( ;; ) {
+        table->slots = ngx_slab_calloc(ctx->shpool,
+                                       n * sizeof(ngx_http_limit_req_slot_t));
+        if (table->slots) {
+            break;
+        }
+
+        if (n == NGX_HTTP_LIMIT_REQ_PROBES) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "could not allocate table%s", ctx->shpool->log_ctx);
+            return NGX_ERROR;
+        }
+
+        n /= 2;
+    }
+
+    table->mask = n - 1;
+    table->epoch = ngx_current_msec;
+
+    ctx->table = table;
+    ctx->shpool->data = table;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, shm_zone->shm.log, 0,
+                   "limit_req table: %ui slots%s", n, ctx->shpool->log_ctx);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -719,7 +1129,18 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->lockfree != octx->lockfree) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" is %s\"lockfree\" "
+                          "while previously it was %s\"lockfree\"",
+                          &shm_zone->shm.name,
+                          ctx->lockfree ? "" : "not ",
+                          octx->lockfree ? "" : "not ");
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
+        ctx->table = octx->table;
         ctx->shpool = octx->shpool;
 
         return NGX_OK;
@@ -728,11 +1149,21 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+
+        if (ctx->lockfree) {
+            ctx->table = ctx->shpool->data;
+
+        } else {
+            ctx->sh = ctx->shpool->data;
+        }
 
         return NGX_OK;
     }
 
+    if (ctx->lockfree) {
+        return ngx_http_limit_req_init_table(shm_zone, ctx);
+    }
+
     ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
     if (ctx->sh == NULL) {
         return NGX_ERROR;
@@ -781,40 +1212,104 @@ ngx_http_limit_req_status_variable(ngx_http_request_t *r,
 
 
 static void *
-ngx_http_limit_req_create_conf(ngx_conf_t *cf)
+ngx_http_limit_req_create_main_conf(ngx_conf_t *cf)
 {
-    ngx_http_limit_req_conf_t  *conf;
+    ngx_http_limit_req_main_conf_t  *lrmcf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_conf_t));
-    if (conf == NULL) {
+    lrmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_main_conf_t));
+    if (lrmcf == NULL) {
         return NULL;
     }
 
     /*
      * set by ngx_pcalloc():
      *
-     *     conf->limits.elts = NULL;
+     *     lrmcf->listen = NULL;
+     *     lrmcf->key = NULL;
      */
 
-    conf->limit_log_level = NGX_CONF_UNSET_UINT;
-    conf->status_code = NGX_CONF_UNSET_UINT;
-    conf->dry_run = NGX_CONF_UNSET;
+    if (ngx_array_init(&lrmcf->peers, cf->pool, 2, sizeof(ngx_addr_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
 
-    return conf;
+    if (ngx_array_init(&lrmcf->zones, cf->pool, 2, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    lrmcf->interval = NGX_CONF_UNSET_MSEC;
+
+    return lrmcf;
 }
 
 
 static char *
-ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+ngx_http_limit_req_init_main_conf(ngx_conf_t *cf, void *conf)
 {
-    ngx_http_limit_req_conf_t *prev = parent;
-    ngx_http_limit_req_conf_t *conf = child;
+    ngx_http_limit_req_main_conf_t *lrmcf = conf;
 
-    if (conf->limits.elts == NULL) {
-        conf->limits = prev->limits;
+    ngx_conf_init_msec_value(lrmcf->interval, 100);
+
+    if (lrmcf->zones.nelts == 0) {
+        return NGX_CONF_OK;
     }
 
-    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
+    if (lrmcf->listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"sync\" limit_req zones require "
+                           "\"limit_req_sync_listen\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (lrmcf->key == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"sync\" limit_req zones require "
+                           "\"limit_req_sync_key\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_limit_req_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->limits.elts = NULL;
+     */
+
+    conf->limit_log_level = NGX_CONF_UNSET_UINT;
+    conf->status_code = NGX_CONF_UNSET_UINT;
+    conf->dry_run = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_limit_req_conf_t *prev = parent;
+    ngx_http_limit_req_conf_t *conf = child;
+
+    if (conf->limits.elts == NULL) {
+        conf->limits = prev->limits;
+    }
+
+    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
                               NGX_LOG_ERR);
 
     conf->delay_log_level = (conf->limit_log_level == NGX_LOG_INFO) ?
@@ -838,8 +1333,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                         *value, name, s;
     ngx_int_t                          rate, scale;
     ngx_uint_t                         i;
-    ngx_shm_zone_t                    *shm_zone;
+    ngx_shm_zone_t                    *shm_zone, **zone;
     ngx_http_limit_req_ctx_t          *ctx;
+    ngx_http_limit_req_main_conf_t    *lrmcf;
     ngx_http_compile_complex_value_t   ccv;
 
     value = cf->args->elts;
@@ -924,6 +1420,29 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "lockfree") == 0) {
+#if (NGX_HAVE_ATOMIC_OPS && NGX_PTR_SIZE == 8)
+            ctx->lockfree = 1;
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"lockfree\" zones are not supported "
+                               "on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+#if (NGX_OPENSSL)
+            ctx->sync = 1;
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"sync\" zones require OpenSSL");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -936,7 +1455,15 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ctx->sync && name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the name of \"sync\" zone \"%V\" is too long",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
     ctx->rate = rate * 1000 / scale;
+    ctx->interval = (uint64_t) 1000000 * 1000000 / ctx->rate;
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -956,6 +1483,18 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
+    if (ctx->sync) {
+        lrmcf = ngx_http_conf_get_module_main_conf(cf,
+                                                   ngx_http_limit_req_module);
+
+        zone = ngx_array_push(&lrmcf->zones);
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *zone = shm_zone;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -1064,6 +1603,199 @@ ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_limit_req_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lrmcf = conf;
+
+    ngx_str_t  *value;
+    ngx_url_t   u;
+
+    if (lrmcf->listen) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.listen = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"%V\" directive",
+                           &u.url, &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    lrmcf->listen = &u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lrmcf = conf;
+
+    ngx_str_t   *value;
+    ngx_url_t    u;
+    ngx_uint_t   i;
+    ngx_addr_t  *addr;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"%V\" directive",
+                           &u.url, &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        addr = ngx_array_push(&lrmcf->peers);
+        if (addr == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *addr = u.addrs[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_OPENSSL)
+
+static char *
+ngx_http_limit_req_sync_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lrmcf = conf;
+
+    ssize_t              n;
+    ngx_str_t           *value;
+    ngx_file_t           file;
+    ngx_file_info_t      fi;
+    ngx_pool_cleanup_t  *cln;
+
+    if (lrmcf->key) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_conf_full_name(cf->cycle, &value[1], 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = value[1];
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &file.name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &file.name);
+        goto failed;
+    }
+
+    if (ngx_file_size(&fi) != 32) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must be 32 bytes", &file.name);
+        goto failed;
+    }
+
+    lrmcf->key = ngx_pnalloc(cf->pool, 32);
+    if (lrmcf->key == NULL) {
+        goto failed;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        goto failed;
+    }
+
+    cln->handler = ngx_http_limit_req_sync_key_cleanup;
+    cln->data = lrmcf->key;
+
+    n = ngx_read_file(&file, lrmcf->key, 32, 0);
+
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_read_file_n " \"%V\" failed", &file.name);
+        goto failed;
+    }
+
+    if (n != 32) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
+                           ngx_read_file_n " \"%V\" returned only "
+                           "%z bytes instead of 32", &file.name, n);
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_limit_req_sync_key_cleanup(void *data)
+{
+    u_char  *key = data;
+
+    ngx_explicit_memzero(key, 32);
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_limit_req_add_variables(ngx_conf_t *cf)
 {
@@ -1100,3 +1832,774 @@ ngx_http_limit_req_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static void
+ngx_http_limit_req_sync_record(ngx_http_limit_req_limit_t *limits,
+    ngx_uint_t n)
+{
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_sync_t   *sync;
+    ngx_http_limit_req_delta_t  *delta;
+
+    sync = &ngx_http_limit_req_sync;
+
+    while (n--) {
+        ctx = limits[n].shm_zone->data;
+
+        if (ctx->sync_key.len == 0) {
+            continue;
+        }
+
+        delta = (ngx_http_limit_req_delta_t *)
+                    ngx_str_rbtree_lookup(&ctx->deltas, &ctx->sync_key,
+                                          ctx->sync_hash);
+
+        if (delta) {
+            delta->count++;
+            ctx->sync_key.len = 0;
+            continue;
+        }
+
+        if (sync->pool == NULL) {
+            sync->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                         sync->connection->log);
+            if (sync->pool == NULL) {
+                return;
+            }
+        }
+
+        delta = ngx_palloc(sync->pool, sizeof(ngx_http_limit_req_delta_t)
+                                       + ctx->sync_key.len);
+        if (delta == NULL) {
+            return;
+        }
+
+        delta->sn.str.len = ctx->sync_key.len;
+        delta->sn.str.data = (u_char *) delta
+                             + sizeof(ngx_http_limit_req_delta_t);
+        ngx_memcpy(delta->sn.str.data, ctx->sync_key.data, ctx->sync_key.len);
+
+        delta->sn.node.key = ctx->sync_hash;
+        delta->count = 1;
+
+        ngx_rbtree_insert(&ctx->deltas, &delta->sn.node);
+
+        ctx->sync_key.len = 0;
+
+        sync->ndeltas++;
+    }
+
+    if (sync->ndeltas >= NGX_HTTP_LIMIT_REQ_SYNC_DELTAS) {
+        ngx_http_limit_req_sync_flush(sync);
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_flush(ngx_http_limit_req_sync_t *sync)
+{
+    u_char                      *p, *start, *last;
+    size_t                       len;
+    ngx_uint_t                   i, count;
+    ngx_shm_zone_t             **zones;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_delta_t  *delta;
+    u_char                       buf[NGX_HTTP_LIMIT_REQ_SYNC_PLAIN];
+
+    if (sync->ndeltas == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sync->connection->log, 0,
+                   "limit_req sync flush: %ui keys", sync->ndeltas);
+
+    last = buf + NGX_HTTP_LIMIT_REQ_SYNC_PLAIN;
+
+    zones = sync->conf->zones.elts;
+
+    for (i = 0; i < sync->conf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->deltas.root == ctx->deltas.sentinel) {
+            continue;
+        }
+
+        /* the time is set when the datagram is sent */
+
+        p = buf + 8;
+        *p++ = (u_char) zones[i]->shm.name.len;
+        p = ngx_cpymem(p, zones[i]->shm.name.data, zones[i]->shm.name.len);
+
+        start = p;
+
+        for (node = ngx_rbtree_min(ctx->deltas.root, ctx->deltas.sentinel);
+             node;
+             node = ngx_rbtree_next(&ctx->deltas, node))
+        {
+            delta = (ngx_http_limit_req_delta_t *) node;
+
+            len = 4 + delta->sn.str.len;
+
+            if (len > (size_t) (last - start)) {
+                continue;
+            }
+
+            if (len > (size_t) (last - p)) {
+                ngx_http_limit_req_sync_send(sync, buf, p - buf);
+                p = start;
+            }
+
+            count = ngx_min(delta->count, NGX_HTTP_LIMIT_REQ_SYNC_COUNT);
+
+            *p++ = (u_char) (delta->sn.str.len >> 8);
+            *p++ = (u_char) delta->sn.str.len;
+            *p++ = (u_char) (count >> 8);
+            *p++ = (u_char) count;
+            p = ngx_cpymem(p, delta->sn.str.data, delta->sn.str.len);
+        }
+
+        if (p != start) {
+            ngx_http_limit_req_sync_send(sync, buf, p - buf);
+        }
+
+        ngx_rbtree_init(&ctx->deltas, &ctx->deltas_sentinel,
+                        ngx_str_rbtree_insert_value);
+    }
+
+    ngx_destroy_pool(sync->pool);
+    sync->pool = NULL;
+
+    sync->ndeltas = 0;
+}
+
+
+static void
+ngx_http_limit_req_sync_send(ngx_http_limit_req_sync_t *sync, u_char *plain,
+    size_t size)
+{
+    ssize_t            n, len;
+    uint64_t           now;
+    ngx_err_t          err;
+    ngx_uint_t         i;
+    ngx_addr_t        *peers;
+    ngx_connection_t  *c;
+    u_char             buf[NGX_HTTP_LIMIT_REQ_SYNC_MTU];
+
+    c = sync->connection;
+
+    now = (uint64_t) ngx_time();
+
+    for (i = 0; i < 8; i++) {
+        plain[i] = (u_char) (now >> (56 - i * 8));
+    }
+
+    len = ngx_http_limit_req_sync_seal(sync->conf->key, plain, size, buf,
+                                       c->log);
+    if (len == NGX_ERROR) {
+        return;
+    }
+
+    peers = sync->conf->peers.elts;
+
+    for (i = 0; i < sync->conf->peers.nelts; i++) {
+
+        n = sendto(c->fd, buf, len, 0, peers[i].sockaddr, peers[i].socklen);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "limit_req sync sendto: %z of %uz to %V",
+                       n, len, &peers[i].name);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ERR, c->log, err,
+                              "sendto() to %V failed", &peers[i].name);
+            }
+        }
+    }
+}
+
+
+static ssize_t
+ngx_http_limit_req_sync_seal(u_char *key, u_char *plain, size_t len,
+    u_char *buf, ngx_log_t *log)
+{
+#if (NGX_OPENSSL)
+
+    int              n;
+    u_char          *p;
+    EVP_CIPHER_CTX  *ctx;
+
+    p = ngx_cpymem(buf, "NLRS", 4);
+    *p++ = NGX_HTTP_LIMIT_REQ_SYNC_VERSION;
+
+    if (RAND_bytes(p, 12) != 1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+        return NGX_ERROR;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "EVP_CIPHER_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, p) != 1
+        || EVP_EncryptUpdate(ctx, NULL, &n, buf,
+                             NGX_HTTP_LIMIT_REQ_SYNC_HEADER)
+           != 1
+        || EVP_EncryptUpdate(ctx, buf + NGX_HTTP_LIMIT_REQ_SYNC_HEADER, &n,
+                             plain, (int) len)
+           != 1
+        || EVP_EncryptFinal_ex(ctx, buf + NGX_HTTP_LIMIT_REQ_SYNC_HEADER + n,
+                               &n)
+           != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG,
+                               NGX_HTTP_LIMIT_REQ_SYNC_TAG,
+                               buf + NGX_HTTP_LIMIT_REQ_SYNC_HEADER + len)
+           != 1)
+    {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "AES-GCM encryption failed");
+        EVP_CIPHER_CTX_free(ctx);
+        return NGX_ERROR;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return NGX_HTTP_LIMIT_REQ_SYNC_HEADER + len + NGX_HTTP_LIMIT_REQ_SYNC_TAG;
+
+#else
+
+    return NGX_ERROR;
+
+#endif
+}
+
+
+static ssize_t
+ngx_http_limit_req_sync_open(u_char *key, u_char *buf, size_t size,
+    u_char *plain, ngx_log_t *log)
+{
+#if (NGX_OPENSSL)
+
+    int              n, m;
+    size_t           len;
+    EVP_CIPHER_CTX  *ctx;
+
+    if (size < NGX_HTTP_LIMIT_REQ_SYNC_HEADER + NGX_HTTP_LIMIT_REQ_SYNC_TAG
+        || size > NGX_HTTP_LIMIT_REQ_SYNC_MTU
+        || ngx_memcmp(buf, "NLRS", 4) != 0
+        || buf[4] != NGX_HTTP_LIMIT_REQ_SYNC_VERSION)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0, "invalid limit_req sync datagram");
+        return NGX_ERROR;
+    }
+
+    len = size - NGX_HTTP_LIMIT_REQ_SYNC_HEADER - NGX_HTTP_LIMIT_REQ_SYNC_TAG;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "EVP_CIPHER_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, buf + 5) != 1
+        || EVP_DecryptUpdate(ctx, NULL, &n, buf,
+                             NGX_HTTP_LIMIT_REQ_SYNC_HEADER)
+           != 1
+        || EVP_DecryptUpdate(ctx, plain, &n,
+                             buf + NGX_HTTP_LIMIT_REQ_SYNC_HEADER, (int) len)
+           != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+                               NGX_HTTP_LIMIT_REQ_SYNC_TAG,
+                               buf + NGX_HTTP_LIMIT_REQ_SYNC_HEADER + len)
+           != 1
+        || EVP_DecryptFinal_ex(ctx, plain + n, &m) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        ERR_clear_error();
+
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "limit_req sync datagram authentication failed");
+        return NGX_ERROR;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return len;
+
+#else
+
+    return NGX_ERROR;
+
+#endif
+}
+
+
+static void
+ngx_http_limit_req_sync_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_limit_req_sync_t  *sync;
+
+    sync = ev->data;
+
+    if (sync->connection == NULL) {
+        return;
+    }
+
+    ngx_http_limit_req_sync_flush(sync);
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, sync->conf->interval);
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_read_handler(ngx_event_t *rev)
+{
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_uint_t                  i;
+    socklen_t                   socklen;
+    ngx_addr_t                 *peers;
+    ngx_sockaddr_t              sa;
+    ngx_connection_t           *c;
+    ngx_http_limit_req_sync_t  *sync;
+    u_char                      buf[NGX_HTTP_LIMIT_REQ_SYNC_MTU];
+
+    c = rev->data;
+    sync = &ngx_http_limit_req_sync;
+
+    if (c->close) {
+        ngx_http_limit_req_sync_flush(sync);
+
+        ngx_close_connection(c);
+        sync->connection = NULL;
+
+        return;
+    }
+
+    peers = sync->conf->peers.elts;
+
+    for ( ;; ) {
+        socklen = sizeof(ngx_sockaddr_t);
+
+        n = recvfrom(c->fd, buf, NGX_HTTP_LIMIT_REQ_SYNC_MTU, 0,
+                     &sa.sockaddr, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, err, "recvfrom() failed");
+            }
+
+            break;
+        }
+
+        for (i = 0; i < sync->conf->peers.nelts; i++) {
+            if (ngx_cmp_sockaddr(&sa.sockaddr, socklen, peers[i].sockaddr,
+                                 peers[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i == sync->conf->peers.nelts) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "limit_req sync datagram from unknown peer ignored");
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "limit_req sync recvfrom: %z from %V",
+                       n, &peers[i].name);
+
+        ngx_http_limit_req_sync_process(sync->conf, buf, n, c->log);
+    }
+
+    rev->ready = 0;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "limit_req sync read event failed");
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_process(ngx_http_limit_req_main_conf_t *lrmcf,
+    u_char *buf, size_t size, ngx_log_t *log)
+{
+    u_char                     *p, *last;
+    time_t                      stamp;
+    ssize_t                     len;
+    ngx_str_t                   name, key;
+    ngx_uint_t                  i, count;
+    ngx_shm_zone_t            **zones;
+    ngx_http_limit_req_ctx_t   *ctx;
+    u_char                      plain[NGX_HTTP_LIMIT_REQ_SYNC_PLAIN];
+
+    len = ngx_http_limit_req_sync_open(lrmcf->key, buf, size, plain, log);
+    if (len == NGX_ERROR) {
+        return;
+    }
+
+    p = plain;
+    last = plain + len;
+
+    if (len < 9) {
+        goto invalid;
+    }
+
+    stamp = 0;
+
+    for (i = 0; i < 8; i++) {
+        stamp = (stamp << 8) | *p++;
+    }
+
+    if (stamp < ngx_time() - NGX_HTTP_LIMIT_REQ_SYNC_SKEW
+        || stamp > ngx_time() + NGX_HTTP_LIMIT_REQ_SYNC_SKEW)
+    {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "stale limit_req sync datagram ignored");
+        return;
+    }
+
+    name.len = *p++;
+    name.data = p;
+
+    if (name.len > (size_t) (last - name.data)) {
+        goto invalid;
+    }
+
+    p = name.data + name.len;
+
+    zones = lrmcf->zones.elts;
+
+    for (i = 0; i < lrmcf->zones.nelts; i++) {
+        if (zones[i]->shm.name.len == name.len
+            && ngx_strncmp(zones[i]->shm.name.data, name.data, name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == lrmcf->zones.nelts) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "limit_req sync datagram for unknown zone \"%V\" "
+                      "ignored", &name);
+        return;
+    }
+
+    ctx = zones[i]->data;
+
+    while (p < last) {
+
+        if (last - p < 4) {
+            goto invalid;
+        }
+
+        key.len = (p[0] << 8) | p[1];
+        count = (p[2] << 8) | p[3];
+        key.data = p + 4;
+
+        if (key.len == 0 || key.len > (size_t) (last - key.data)) {
+            goto invalid;
+        }
+
+        p = key.data + key.len;
+
+        if (count == 0) {
+            continue;
+        }
+
+        ngx_http_limit_req_sync_apply(ctx, &key, count);
+    }
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, log, 0, "invalid limit_req sync datagram");
+}
+
+
+static void
+ngx_http_limit_req_sync_apply(ngx_http_limit_req_ctx_t *ctx, ngx_str_t *key,
+    ngx_uint_t count)
+{
+    uint32_t                    hash;
+    uint64_t                    tnow, tat, next;
+    ngx_int_t                   rc, excess;
+    ngx_msec_t                  now;
+    ngx_msec_int_t              ms;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_limit_req_node_t  *lr;
+    ngx_http_limit_req_slot_t  *slot;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    /*
+     * the requests are accounted as if they were made one after another
+     * just now: the first one is free for an unknown key, and each of
+     * the others adds to the excess
+     */
+
+    if (ctx->table) {
+        slot = ngx_http_limit_req_table_slot(ctx, hash, key);
+        if (slot == NULL) {
+            return;
+        }
+
+        tnow = (uint64_t) (ngx_current_msec - ctx->table->epoch) * 1000000
+               + NGX_HTTP_LIMIT_REQ_TAT_BIAS + (count - 1) * ctx->interval;
+
+        do {
+            tat = slot->tat;
+            next = ngx_max(tat + count * ctx->interval, tnow);
+
+        } while (!ngx_atomic_cmp_set(&slot->tat, tat, next));
+
+        return;
+    }
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
+
+        if (rc == 0) {
+            ngx_queue_remove(&lr->queue);
+            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < -60000) {
+                ms = 1;
+
+            } else if (ms < 0) {
+                ms = 0;
+            }
+
+            excess = lr->excess - ctx->rate * ms / 1000 + count * 1000;
+
+            if (excess < (ngx_int_t) (count - 1) * 1000) {
+                excess = (count - 1) * 1000;
+            }
+
+            lr->excess = excess;
+
+            if (ms) {
+                lr->last = now;
+            }
+
+            goto done;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    lr = ngx_http_limit_req_insert(ctx, hash, key);
+
+    if (lr) {
+        lr->excess = (count - 1) * 1000;
+        lr->last = now;
+        lr->count = 0;
+    }
+
+done:
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_init_process(ngx_cycle_t *cycle)
+{
+    int                              reuse;
+    ngx_uint_t                       i;
+    ngx_socket_t                     s;
+    ngx_addr_t                      *addr, *peers;
+    ngx_event_t                     *rev;
+    ngx_shm_zone_t                 **zones;
+    ngx_connection_t                *c;
+    ngx_http_limit_req_ctx_t        *ctx;
+    ngx_http_limit_req_sync_t       *sync;
+    ngx_http_limit_req_main_conf_t  *lrmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    lrmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_limit_req_module);
+
+    if (lrmcf == NULL || lrmcf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    addr = lrmcf->listen;
+
+    s = ngx_socket(addr->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " for limit_req sync failed");
+        return NGX_OK;
+    }
+
+    reuse = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEADDR) %V failed", &addr->name);
+        goto failed;
+    }
+
+#if (NGX_HAVE_REUSEPORT)
+
+    /* every worker binds to the address and receives a share of updates */
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *) &reuse, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEPORT) %V failed", &addr->name);
+        goto failed;
+    }
+
+#endif
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " %V failed", &addr->name);
+        goto failed;
+    }
+
+    if (bind(s, addr->sockaddr, addr->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "bind() to %V for limit_req sync failed", &addr->name);
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->type = SOCK_DGRAM;
+    c->idle = 1;
+
+    rev = c->read;
+    rev->handler = ngx_http_limit_req_sync_read_handler;
+    rev->log = cycle->log;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_OK;
+    }
+
+    /* datagrams sent to our own address would be counted twice */
+
+    peers = lrmcf->peers.elts;
+
+    for (i = 0; i < lrmcf->peers.nelts; /* void */) {
+
+        if (ngx_cmp_sockaddr(peers[i].sockaddr, peers[i].socklen,
+                             addr->sockaddr, addr->socklen, 1)
+            == NGX_OK)
+        {
+            peers[i] = peers[--lrmcf->peers.nelts];
+            continue;
+        }
+
+        i++;
+    }
+
+    zones = lrmcf->zones.elts;
+
+    for (i = 0; i < lrmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        ngx_rbtree_init(&ctx->deltas, &ctx->deltas_sentinel,
+                        ngx_str_rbtree_insert_value);
+    }
+
+    sync = &ngx_http_limit_req_sync;
+
+    sync->connection = c;
+    sync->conf = lrmcf;
+
+    sync->event.handler = ngx_http_limit_req_sync_timer_handler;
+    sync->event.data = sync;
+    sync->event.log = cycle->log;
+    sync->event.cancelable = 1;
+
+    ngx_add_timer(&sync->event, lrmcf->interval);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_limit_req_sync_t  *sync;
+
+    sync = &ngx_http_limit_req_sync;
+
+    if (sync->connection) {
+        ngx_close_connection(sync->connection);
+        sync->connection = NULL;
+    }
+
+    if (sync->pool) {
+        ngx_destroy_pool(sync->pool);
+        sync->pool = NULL;
+    }
+}
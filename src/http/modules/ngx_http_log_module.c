@@ -35,6 +35,7 @@ typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+    ngx_uint_t                  binary;     /* unsigned  binary:1; */
 } ngx_http_log_fmt_t;
 
 
@@ -52,9 +53,34 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *thread_task;
+    /* the second half of the buffer, written to the file by a thread */
+    u_char                     *spare;
+    ngx_uint_t                  lost;
+#endif
 } ngx_http_log_buf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_fd_t                    fd;
+    u_char                     *buf;
+    size_t                      len;
+    ngx_int_t                   gzip;
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_uint_t                  busy;
+    ngx_thread_mutex_t          mutex;
+    ngx_thread_cond_t           cond;
+} ngx_http_log_thread_ctx_t;
+
+#endif
+
+
 typedef struct {
     ngx_array_t                *lengths;
     ngx_array_t                *values;
@@ -93,12 +119,21 @@ typedef struct {
 #define NGX_HTTP_LOG_ESCAPE_DEFAULT  0
 #define NGX_HTTP_LOG_ESCAPE_JSON     1
 #define NGX_HTTP_LOG_ESCAPE_NONE     2
+#define NGX_HTTP_LOG_ESCAPE_BINARY   3
+
+
+/*
+ * A record of the binary format is a 4-byte record length followed
+ * by the values of the variables, each prefixed with a 2-byte length;
+ * all numbers are in network byte order.  No escaping is done.
+ */
 
 
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
     ngx_http_log_script_t *script, u_char **name, u_char *buf, size_t len);
+static void ngx_http_log_record_length(u_char *record, u_char *last);
 
 #if (NGX_ZLIB)
 static ssize_t ngx_http_log_gzip(ngx_fd_t fd, u_char *buf, size_t len,
@@ -111,6 +146,16 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_log_thread_flush(ngx_open_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_log_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_thread_event_handler(ngx_event_t *ev);
+static void ngx_http_log_thread_wait(ngx_http_log_thread_ctx_t *ctx,
+    ngx_log_t *log);
+static void ngx_http_log_thread_cleanup(void *data);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -145,6 +190,10 @@ static size_t ngx_http_log_unescaped_variable_getlen(ngx_http_request_t *r,
     uintptr_t data);
 static u_char *ngx_http_log_unescaped_variable(ngx_http_request_t *r,
     u_char *buf, ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
 
 
 static void *ngx_http_log_create_main_conf(ngx_conf_t *cf);
@@ -253,7 +302,7 @@ static ngx_http_log_var_t  ngx_http_log_vars[] = {
 static ngx_int_t
 ngx_http_log_handler(ngx_http_request_t *r)
 {
-    u_char                   *line, *p;
+    u_char                   *line, *p, *record;
     size_t                    len, size;
     ssize_t                   n;
     ngx_str_t                 val;
@@ -319,7 +368,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
             goto alloc_line;
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (log[l].format->binary) {
+            len += 4;
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
 
         buffer = log[l].file ? log[l].file->data : NULL;
 
@@ -327,10 +381,35 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
-                ngx_http_log_write(r, &log[l], buffer->start,
-                                   buffer->pos - buffer->start);
+#if (NGX_THREADS)
+                if (buffer->thread_pool) {
+
+                    if (len > (size_t) (buffer->last - buffer->start)) {
+
+                        /*
+                         * the record is written directly below, so
+                         * the buffered records have to be written first
+                         */
+
+                        ngx_http_log_flush(log[l].file, r->connection->log);
+
+                    } else if (ngx_http_log_thread_flush(log[l].file,
+                                                         r->connection->log)
+                               != NGX_OK)
+                    {
+                        /* the writer is busy, do not block on it */
+                        buffer->lost++;
+                        continue;
+                    }
+
+                } else
+#endif
+                {
+                    ngx_http_log_write(r, &log[l], buffer->start,
+                                       buffer->pos - buffer->start);
 
-                buffer->pos = buffer->start;
+                    buffer->pos = buffer->start;
+                }
             }
 
             if (len <= (size_t) (buffer->last - buffer->pos)) {
@@ -341,18 +420,31 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
+                record = p;
+
+                if (log[l].format->binary) {
+                    p += 4;
+                }
+
                 for (i = 0; i < log[l].format->ops->nelts; i++) {
                     p = op[i].run(r, p, &op[i]);
                 }
 
-                ngx_linefeed(p);
+                if (log[l].format->binary) {
+                    ngx_http_log_record_length(record, p);
+
+                } else {
+                    ngx_linefeed(p);
+                }
 
                 buffer->pos = p;
 
                 continue;
             }
 
-            if (buffer->event && buffer->event->timer_set) {
+            if (buffer->event && buffer->event->timer_set
+                && buffer->pos == buffer->start)
+            {
                 ngx_del_timer(buffer->event);
             }
         }
@@ -368,6 +460,9 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
         if (log[l].syslog_peer) {
             p = ngx_syslog_add_header(log[l].syslog_peer, line);
+
+        } else if (log[l].format->binary) {
+            p += 4;
         }
 
         for (i = 0; i < log[l].format->ops->nelts; i++) {
@@ -393,7 +488,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_linefeed(p);
+        if (log[l].format->binary) {
+            ngx_http_log_record_length(line, p);
+
+        } else {
+            ngx_linefeed(p);
+        }
 
         ngx_http_log_write(r, &log[l], line, p - line);
     }
@@ -581,6 +681,20 @@ ngx_http_log_script_write(ngx_http_request_t *r, ngx_http_log_script_t *script,
 }
 
 
+static void
+ngx_http_log_record_length(u_char *record, u_char *last)
+{
+    uint32_t  len;
+
+    len = (uint32_t) (last - record - 4);
+
+    record[0] = (u_char) (len >> 24);
+    record[1] = (u_char) (len >> 16);
+    record[2] = (u_char) (len >> 8);
+    record[3] = (u_char) len;
+}
+
+
 #if (NGX_ZLIB)
 
 static ssize_t
@@ -718,12 +832,27 @@ ngx_http_log_gzip_free(void *opaque, void *address)
 static void
 ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 {
-    size_t               len;
-    ssize_t              n;
-    ngx_http_log_buf_t  *buffer;
+    size_t                      len;
+    ssize_t                     n;
+    ngx_http_log_buf_t         *buffer;
+#if (NGX_THREADS)
+    ngx_http_log_thread_ctx_t  *ctx;
+#endif
 
     buffer = file->data;
 
+#if (NGX_THREADS)
+
+    if (buffer->thread_task) {
+        ctx = buffer->thread_task->ctx;
+
+        /* the file may be reopened or closed as soon as we return */
+
+        ngx_http_log_thread_wait(ctx, log);
+    }
+
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -762,13 +891,193 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "http log buffer flush handler");
 
+#if (NGX_THREADS)
+
+    file = ev->data;
+    buffer = file->data;
+
+    if (buffer->thread_pool) {
+
+        if (ngx_http_log_thread_flush(file, ev->log) != NGX_OK) {
+            /* the previous buffer is still being written */
+            ngx_add_timer(ev, buffer->flush);
+        }
+
+        return;
+    }
+
+#endif
+
     ngx_http_log_flush(ev->data, ev->log);
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_log_thread_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    u_char                     *p;
+    size_t                      size;
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+    task = buffer->thread_task;
+
+    if (task->event.active) {
+        return NGX_BUSY;
+    }
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    if (buffer->pos == buffer->start) {
+        return NGX_OK;
+    }
+
+    ctx = task->ctx;
+
+    ctx->fd = file->fd;
+    ctx->buf = buffer->start;
+    ctx->len = buffer->pos - buffer->start;
+    ctx->gzip = buffer->gzip;
+    ctx->busy = 1;
+
+    if (ngx_thread_task_post(buffer->thread_pool, task) != NGX_OK) {
+        ctx->busy = 0;
+        ngx_http_log_flush(file, log);
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log thread flush: %uz to \"%s\"",
+                   ctx->len, file->name.data);
+
+    /* continue with the other half while the thread writes this one */
+
+    size = buffer->last - buffer->start;
+
+    p = buffer->spare;
+    buffer->spare = buffer->start;
+
+    buffer->start = p;
+    buffer->pos = p;
+    buffer->last = p + size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_log_thread_ctx_t *ctx = data;
+
+    ssize_t  n;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "http log thread handler");
+
+#if (NGX_ZLIB)
+    if (ctx->gzip) {
+        n = ngx_http_log_gzip(ctx->fd, ctx->buf, ctx->len, ctx->gzip, log);
+    } else {
+        n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+    }
+#else
+    n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+#endif
+
+    ctx->err = (n == -1) ? ngx_errno : 0;
+
+    if (ngx_thread_mutex_lock(&ctx->mutex, log) != NGX_OK) {
+        return;
+    }
+
+    ctx->n = n;
+    ctx->busy = 0;
+
+    (void) ngx_thread_cond_signal(&ctx->cond, log);
+
+    (void) ngx_thread_mutex_unlock(&ctx->mutex, log);
+}
+
+
+static void
+ngx_http_log_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_open_file_t            *file;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    file = ev->data;
+    buffer = file->data;
+    ctx = buffer->thread_task->ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log thread done: %z", ctx->n);
+
+    if (ctx->n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ctx->err,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      file->name.data);
+
+    } else if ((size_t) ctx->n != ctx->len) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, ctx->n, ctx->len);
+    }
+
+    if (buffer->lost) {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "%ui records were lost in \"%s\" "
+                      "while the buffer was being written",
+                      buffer->lost, file->name.data);
+
+        buffer->lost = 0;
+    }
+}
+
+
+static void
+ngx_http_log_thread_wait(ngx_http_log_thread_ctx_t *ctx, ngx_log_t *log)
+{
+    if (ngx_thread_mutex_lock(&ctx->mutex, log) != NGX_OK) {
+        return;
+    }
+
+    while (ctx->busy) {
+        if (ngx_thread_cond_wait(&ctx->cond, &ctx->mutex, log) != NGX_OK) {
+            break;
+        }
+    }
+
+    (void) ngx_thread_mutex_unlock(&ctx->mutex, log);
+}
+
+
+static void
+ngx_http_log_thread_cleanup(void *data)
+{
+    ngx_http_log_thread_ctx_t *ctx = data;
+
+    (void) ngx_thread_cond_destroy(&ctx->cond, ngx_cycle->log);
+    (void) ngx_thread_mutex_destroy(&ctx->mutex, ngx_cycle->log);
+}
+
+#endif
+
+
 static u_char *
 ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
@@ -936,6 +1245,11 @@ ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
         op->run = ngx_http_log_unescaped_variable;
         break;
 
+    case NGX_HTTP_LOG_ESCAPE_BINARY:
+        op->getlen = ngx_http_log_binary_variable_getlen;
+        op->run = ngx_http_log_binary_variable;
+        break;
+
     default: /* NGX_HTTP_LOG_ESCAPE_DEFAULT */
         op->getlen = ngx_http_log_variable_getlen;
         op->run = ngx_http_log_variable;
@@ -1122,6 +1436,47 @@ ngx_http_log_unescaped_variable(ngx_http_request_t *r, u_char *buf,
 }
 
 
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 2;
+    }
+
+    value->escape = 0;
+
+    return 2 + ngx_min(value->len, 65535);
+}
+
+
+static u_char *
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    size_t                      len;
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, op->data);
+
+    if (value == NULL || value->not_found) {
+        *buf++ = 0;
+        *buf++ = 0;
+        return buf;
+    }
+
+    len = ngx_min(value->len, 65535);
+
+    *buf++ = (u_char) (len >> 8);
+    *buf++ = (u_char) len;
+
+    return ngx_cpymem(buf, value->data, len);
+}
+
+
 static void *
 ngx_http_log_create_main_conf(ngx_conf_t *cf)
 {
@@ -1251,6 +1606,12 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_main_conf_t          *lmcf;
     ngx_http_script_compile_t          sc;
     ngx_http_compile_complex_value_t   ccv;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                 *tp;
+    ngx_thread_task_t                 *task;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_log_thread_ctx_t         *ctx;
+#endif
 
     value = cf->args->elts;
 
@@ -1361,9 +1722,19 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->binary && log->syslog_peer) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" cannot be used "
+                           "with syslog", &name);
+        return NGX_CONF_ERROR;
+    }
+
     size = 0;
     flush = 0;
     gzip = 0;
+#if (NGX_THREADS)
+    tp = NULL;
+#endif
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1430,6 +1801,37 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "threads", 7) == 0
+            && (value[i].len == 7 || value[i].data[7] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 7) {
+                tp = ngx_thread_pool_add(cf, NULL);
+
+            } else {
+                s.len = value[i].len - 8;
+                s.data = value[i].data + 8;
+
+                tp = ngx_thread_pool_add(cf, &s);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1493,6 +1895,16 @@ process_formats:
                 return NGX_CONF_ERROR;
             }
 
+#if (NGX_THREADS)
+            if (buffer->thread_pool != tp) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "access_log \"%V\" already defined "
+                                   "with conflicting parameters",
+                                   &value[1]);
+                return NGX_CONF_ERROR;
+            }
+#endif
+
             return NGX_CONF_OK;
         }
 
@@ -1525,6 +1937,50 @@ process_formats:
 
         buffer->gzip = gzip;
 
+#if (NGX_THREADS)
+        if (tp) {
+            buffer->spare = ngx_pnalloc(cf->pool, size);
+            if (buffer->spare == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            task = ngx_thread_task_alloc(cf->pool,
+                                         sizeof(ngx_http_log_thread_ctx_t));
+            if (task == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ctx = task->ctx;
+
+            if (ngx_thread_mutex_create(&ctx->mutex, cf->log) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_thread_cond_create(&ctx->cond, cf->log) != NGX_OK) {
+                (void) ngx_thread_mutex_destroy(&ctx->mutex, cf->log);
+                return NGX_CONF_ERROR;
+            }
+
+            cln = ngx_pool_cleanup_add(cf->pool, 0);
+            if (cln == NULL) {
+                (void) ngx_thread_cond_destroy(&ctx->cond, cf->log);
+                (void) ngx_thread_mutex_destroy(&ctx->mutex, cf->log);
+                return NGX_CONF_ERROR;
+            }
+
+            cln->handler = ngx_http_log_thread_cleanup;
+            cln->data = ctx;
+
+            task->handler = ngx_http_log_thread_handler;
+            task->event.handler = ngx_http_log_thread_event_handler;
+            task->event.data = log->file;
+            task->event.log = &cf->cycle->new_log;
+
+            buffer->thread_pool = tp;
+            buffer->thread_task = task;
+        }
+#endif
+
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
     }
@@ -1573,6 +2029,8 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    fmt->binary = (ngx_strcmp(value[2].data, "escape=binary") == 0);
+
     return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
 }
 
@@ -1601,6 +2059,9 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
         } else if (ngx_strcmp(data, "none") == 0) {
             escape = NGX_HTTP_LOG_ESCAPE_NONE;
 
+        } else if (ngx_strcmp(data, "binary") == 0) {
+            escape = NGX_HTTP_LOG_ESCAPE_BINARY;
+
         } else if (ngx_strcmp(data, "default") != 0) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                "unknown log format escaping \"%s\"", data);
@@ -1676,6 +2137,12 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
 
                 for (v = ngx_http_log_vars; v->name.len; v++) {
 
+                    /* the binary format uses variables as they are */
+
+                    if (escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+                        break;
+                    }
+
                     if (v->name.len == var.len
                         && ngx_strncmp(v->name.data, var.data, var.len) == 0)
                     {
@@ -1717,6 +2184,13 @@ ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
 
             len = &value[s].data[i] - data;
 
+            if (len && escape == NGX_HTTP_LOG_ESCAPE_BINARY) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "text \"%*s\" is not allowed "
+                                   "in binary log format", len, data);
+                return NGX_CONF_ERROR;
+            }
+
             if (len) {
 
                 op->len = len;
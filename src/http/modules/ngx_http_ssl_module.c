@@ -8,6 +8,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 #if (NGX_QUIC_OPENSSL_COMPAT)
 #include <ngx_event_quic_openssl_compat.h>
@@ -51,6 +54,8 @@ static char *ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_ssl_ocsp_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_ssl_handshake_offload(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 static char *ngx_http_ssl_conf_command_check(ngx_conf_t *cf, void *post,
     void *data);
@@ -290,6 +295,20 @@ static ngx_command_t  ngx_http_ssl_commands[] = {
       offsetof(ngx_http_ssl_srv_conf_t, early_data),
       NULL },
 
+    { ngx_string("ssl_ktls"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, ktls),
+      NULL },
+
+    { ngx_string("ssl_handshake_offload"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_ssl_handshake_offload,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ssl_conf_command"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_keyval_slot,
@@ -362,10 +381,28 @@ static ngx_http_variable_t  ngx_http_ssl_vars[] = {
     { ngx_string("ssl_session_reused"), NULL, ngx_http_ssl_variable,
       (uintptr_t) ngx_ssl_get_session_reused, NGX_HTTP_VAR_CHANGEABLE, 0 },
 
+    { ngx_string("ssl_session_cache_hits"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_hits,
+      NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_misses"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_misses,
+      NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_evictions"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_evictions,
+      NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("ssl_early_data"), NULL, ngx_http_ssl_variable,
       (uintptr_t) ngx_ssl_get_early_data,
       NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("ssl_ktls_send"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls_send, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_ktls_recv"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls_recv, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
     { ngx_string("ssl_server_name"), NULL, ngx_http_ssl_variable,
       (uintptr_t) ngx_ssl_get_server_name, NGX_HTTP_VAR_CHANGEABLE, 0 },
 
@@ -444,11 +481,18 @@ ngx_http_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn, const unsigned char **out,
     c = ngx_ssl_get_connection(ssl_conn);
 #endif
 
+    /*
+     * with TLSv1.2, the callback may be called in a thread,
+     * see ngx_ssl_handshake_offload(), and does not log there
+     */
+
 #if (NGX_DEBUG)
-    for (i = 0; i < inlen; i += in[i] + 1) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "SSL ALPN supported by client: %*s",
-                       (size_t) in[i], &in[i + 1]);
+    if (!ngx_ssl_handshake_offloaded(c)) {
+        for (i = 0; i < inlen; i += in[i] + 1) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "SSL ALPN supported by client: %*s",
+                           (size_t) in[i], &in[i + 1]);
+        }
     }
 #endif
 
@@ -499,8 +543,12 @@ ngx_http_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn, const unsigned char **out,
         return SSL_TLSEXT_ERR_ALERT_FATAL;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "SSL ALPN selected: %*s", (size_t) *outlen, *out);
+#if (NGX_DEBUG)
+    if (!ngx_ssl_handshake_offloaded(c)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "SSL ALPN selected: %*s", (size_t) *outlen, *out);
+    }
+#endif
 
     return SSL_TLSEXT_ERR_OK;
 }
@@ -620,6 +668,7 @@ ngx_http_ssl_create_srv_conf(ngx_conf_t *cf)
     sscf->enable = NGX_CONF_UNSET;
     sscf->prefer_server_ciphers = NGX_CONF_UNSET;
     sscf->early_data = NGX_CONF_UNSET;
+    sscf->ktls = NGX_CONF_UNSET;
     sscf->reject_handshake = NGX_CONF_UNSET;
     sscf->buffer_size = NGX_CONF_UNSET_SIZE;
     sscf->verify = NGX_CONF_UNSET_UINT;
@@ -636,6 +685,9 @@ ngx_http_ssl_create_srv_conf(ngx_conf_t *cf)
     sscf->ocsp_cache_zone = NGX_CONF_UNSET_PTR;
     sscf->stapling = NGX_CONF_UNSET;
     sscf->stapling_verify = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    sscf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return sscf;
 }
@@ -667,8 +719,13 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
                          prev->prefer_server_ciphers, 0);
 
     ngx_conf_merge_value(conf->early_data, prev->early_data, 0);
+    ngx_conf_merge_value(conf->ktls, prev->ktls, 0);
     ngx_conf_merge_value(conf->reject_handshake, prev->reject_handshake, 0);
 
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
     ngx_conf_merge_bitmask_value(conf->protocols, prev->protocols,
                          (NGX_CONF_BITMASK_SET
                           |NGX_SSL_TLSv1|NGX_SSL_TLSv1_1
@@ -934,6 +991,35 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_ssl_ktls(cf, &conf->ssl, conf->ktls) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    if (conf->thread_pool) {
+
+#ifdef SSL_R_CERT_CB_ERROR
+
+        conf->ssl.thread_pool = conf->thread_pool;
+
+        /* with variables, the certificate callback suspends the handshake */
+
+        if (conf->certificate_values == NULL) {
+            SSL_CTX_set_cert_cb(conf->ssl.ctx, ngx_ssl_handshake_offload,
+                                &conf->ssl);
+        }
+
+#else
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_handshake_offload\" is not supported "
+                      "on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+#endif
+
     if (ngx_ssl_conf_commands(cf, &conf->ssl, conf->conf_commands) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -1081,10 +1167,12 @@ ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t       len;
     ngx_str_t   *value, name, size;
     ngx_int_t    n;
-    ngx_uint_t   i, j;
+    ngx_uint_t   i, j, sync;
 
     value = cf->args->elts;
 
+    sync = 0;
+
     for (i = 1; i < cf->args->nelts; i++) {
 
         if (ngx_strcmp(value[i].data, "off") == 0) {
@@ -1097,6 +1185,11 @@ ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "builtin") == 0) {
             sscf->builtin_session_cache = NGX_SSL_DFLT_BUILTIN_SCACHE;
             continue;
@@ -1170,6 +1263,18 @@ ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         goto invalid;
     }
 
+    if (sync) {
+        if (sscf->shm_zone == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"sync\" requires a shared session cache");
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_ssl_session_cache_sync(cf, sscf->shm_zone) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     if (sscf->shm_zone && sscf->builtin_session_cache == NGX_CONF_UNSET) {
         sscf->builtin_session_cache = NGX_SSL_NO_BUILTIN_SCACHE;
     }
@@ -1264,6 +1369,63 @@ invalid:
 }
 
 
+static char *
+ngx_http_ssl_handshake_offload(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_ssl_srv_conf_t *sscf = conf;
+
+    ngx_str_t   name;
+#endif
+    ngx_str_t  *value;
+
+#if (NGX_THREADS)
+    if (sscf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+#endif
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+#if (NGX_THREADS)
+        sscf->thread_pool = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+        if (value[1].len >= 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            sscf->thread_pool = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            sscf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (sscf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl_handshake_offload threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    return "invalid value";
+}
+
+
 static char *
 ngx_http_ssl_conf_command_check(ngx_conf_t *cf, void *post, void *data)
 {
@@ -21,6 +21,7 @@ typedef struct {
 
     ngx_flag_t                      prefer_server_ciphers;
     ngx_flag_t                      early_data;
+    ngx_flag_t                      ktls;
     ngx_flag_t                      reject_handshake;
 
     ngx_uint_t                      protocols;
@@ -60,6 +61,10 @@ typedef struct {
     ngx_str_t                       ocsp_responder;
     ngx_shm_zone_t                 *ocsp_cache_zone;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t              *thread_pool;
+#endif
+
     ngx_flag_t                      stapling;
     ngx_flag_t                      stapling_verify;
     ngx_str_t                       stapling_file;
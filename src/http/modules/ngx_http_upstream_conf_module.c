@@ -0,0 +1,605 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_CONF_LINE_LEN                                        \
+    (sizeof("server  weight= max_conns= max_fails= fail_timeout=s conns= "     \
+            "fails= backup down drain; # id= host=\n") - 1                     \
+     + 7 * NGX_INT_T_LEN + NGX_SOCKADDR_STRLEN)
+
+
+typedef struct {
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peers_t   *primary;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_buf_t                      *out;
+    ngx_uint_t                      backup;
+} ngx_http_upstream_conf_ctx_t;
+
+
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_conf_remove(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_conf_update(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_conf_list(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_int_t ngx_http_upstream_conf_arg(ngx_http_request_t *r,
+    char *name, ngx_str_t *value);
+static void ngx_http_upstream_conf_print(ngx_buf_t *b,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t backup);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_uint_t status, ngx_buf_t *b);
+static ngx_int_t ngx_http_upstream_conf_error(ngx_http_request_t *r,
+    ngx_uint_t status, char *text);
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_conf_commands[] = {
+
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_conf_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_conf_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_conf_module_ctx,    /* module context */
+    ngx_http_upstream_conf_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_str_t                       name, value;
+    ngx_uint_t                      i;
+    ngx_http_upstream_rr_peers_t   *view;
+    ngx_http_upstream_conf_ctx_t    ctx;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "upstream", &name) != NGX_OK
+        || name.len == 0)
+    {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "upstream is not specified");
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+    uscf = NULL;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone
+            && uscfp[i]->host.len == name.len
+            && ngx_strncasecmp(uscfp[i]->host.data, name.data, name.len) == 0)
+        {
+            uscf = uscfp[i];
+            break;
+        }
+    }
+
+    if (uscf == NULL) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_NOT_FOUND,
+                                            "upstream not found");
+    }
+
+    view = uscf->peer.data;
+
+    ngx_memzero(&ctx, sizeof(ngx_http_upstream_conf_ctx_t));
+
+    ctx.primary = view->shared;
+    ctx.peers = ctx.primary;
+
+    if (ngx_http_upstream_conf_arg(r, "backup", &value) == NGX_OK) {
+        ctx.peers = ctx.primary->next;
+        ctx.backup = 1;
+
+        if (ctx.peers == NULL) {
+            return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                                "no backup servers");
+        }
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "add", &value) == NGX_OK) {
+        return ngx_http_upstream_conf_add(r, &ctx);
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "remove", &value) == NGX_OK) {
+        return ngx_http_upstream_conf_remove(r, &ctx);
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "id", &value) == NGX_OK) {
+        return ngx_http_upstream_conf_update(r, &ctx);
+    }
+
+    return ngx_http_upstream_conf_list(r, &ctx);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx)
+{
+    ngx_url_t                     u;
+    ngx_http_upstream_rr_peer_t  *peer, tmp;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    if (ngx_http_upstream_conf_arg(r, "server", &u.url) != NGX_OK
+        || u.url.len == 0)
+    {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "server is not specified");
+    }
+
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(r->pool, &u) != NGX_OK) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            u.err ? u.err : "invalid server");
+    }
+
+    if (u.naddrs == 0) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "server is not an address");
+    }
+
+    ngx_memzero(&tmp, sizeof(ngx_http_upstream_rr_peer_t));
+
+    tmp.server = u.url;
+    tmp.weight = 1;
+    tmp.max_fails = 1;
+    tmp.fail_timeout = 10;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "invalid parameter");
+    }
+
+    ngx_http_upstream_rr_peers_wlock(ctx->primary);
+
+    peer = ngx_http_upstream_zone_add_peer(ctx->peers, &tmp,
+                                           u.addrs[0].sockaddr,
+                                           u.addrs[0].socklen);
+
+    if (peer == NULL) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_INSUFFICIENT_STORAGE,
+                                            "no memory for the server");
+    }
+
+    ngx_http_upstream_zone_update_peers(ctx->primary, ctx->peers);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "upstream \"%V\": server \"%V\" added",
+                  ctx->primary->name, &peer->name);
+
+    ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+    ctx->peer = peer;
+
+    return ngx_http_upstream_conf_list(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_remove(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx)
+{
+    ngx_int_t                     id;
+    ngx_str_t                     value;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (ngx_http_upstream_conf_arg(r, "id", &value) != NGX_OK) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "id is not specified");
+    }
+
+    id = ngx_atoi(value.data, value.len);
+
+    if (id == NGX_ERROR) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "invalid id");
+    }
+
+    ngx_http_upstream_rr_peers_wlock(ctx->primary);
+
+    for (peer = ctx->peers->peer; peer; peer = peer->next) {
+        if (peer->slot == (ngx_uint_t) id) {
+            break;
+        }
+    }
+
+    if (peer == NULL) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_NOT_FOUND,
+                                            "server not found");
+    }
+
+    if (ctx->peers->number == 1) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "cannot remove the last server");
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "upstream \"%V\": server \"%V\" removed",
+                  ctx->primary->name, &peer->name);
+
+    ngx_http_upstream_zone_remove_peer(ctx->peers, peer);
+    ngx_http_upstream_zone_update_peers(ctx->primary, ctx->peers);
+
+    ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+    return ngx_http_upstream_conf_list(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_update(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx)
+{
+    ngx_int_t                     id;
+    ngx_str_t                     value;
+    ngx_http_upstream_rr_peer_t  *peer, tmp;
+
+    (void) ngx_http_upstream_conf_arg(r, "id", &value);
+
+    id = ngx_atoi(value.data, value.len);
+
+    if (id == NGX_ERROR) {
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "invalid id");
+    }
+
+    ngx_http_upstream_rr_peers_wlock(ctx->primary);
+
+    for (peer = ctx->peers->peer; peer; peer = peer->next) {
+        if (peer->slot == (ngx_uint_t) id) {
+            break;
+        }
+    }
+
+    if (peer == NULL) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_NOT_FOUND,
+                                            "server not found");
+    }
+
+    tmp = *peer;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+        return ngx_http_upstream_conf_error(r, NGX_HTTP_BAD_REQUEST,
+                                            "invalid parameter");
+    }
+
+    if (tmp.weight != peer->weight
+        || tmp.max_conns != peer->max_conns
+        || tmp.max_fails != peer->max_fails
+        || tmp.fail_timeout != peer->fail_timeout
+        || tmp.down != peer->down
+        || tmp.drain != peer->drain)
+    {
+        peer->weight = tmp.weight;
+        peer->effective_weight = tmp.weight;
+        peer->max_conns = tmp.max_conns;
+        peer->max_fails = tmp.max_fails;
+        peer->fail_timeout = tmp.fail_timeout;
+        peer->down = tmp.down;
+        peer->drain = tmp.drain;
+
+        ngx_http_upstream_zone_update_peers(ctx->primary, ctx->peers);
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upstream \"%V\": server \"%V\" updated",
+                      ctx->primary->name, &peer->name);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+    ctx->peer = peer;
+
+    return ngx_http_upstream_conf_list(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_list(ngx_http_request_t *r,
+    ngx_http_upstream_conf_ctx_t *ctx)
+{
+    size_t                         len;
+    ngx_buf_t                     *b;
+    ngx_uint_t                     backup;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_http_upstream_rr_peers_rlock(ctx->primary);
+
+    len = 0;
+
+    for (peers = ctx->primary; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            len += NGX_HTTP_UPSTREAM_CONF_LINE_LEN + peer->server.len;
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        ngx_http_upstream_rr_peers_unlock(ctx->primary);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->peer) {
+        ngx_http_upstream_conf_print(b, ctx->peers, ctx->peer, ctx->backup);
+
+    } else {
+        backup = 0;
+
+        for (peers = ctx->primary; peers; peers = peers->next) {
+            for (peer = peers->peer; peer; peer = peer->next) {
+                ngx_http_upstream_conf_print(b, peers, peer, backup);
+            }
+
+            backup = 1;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(ctx->primary);
+
+    return ngx_http_upstream_conf_send(r, NGX_HTTP_OK, b);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    time_t     fail_timeout;
+    ngx_int_t  n;
+    ngx_str_t  value;
+
+    if (ngx_http_upstream_conf_arg(r, "weight", &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR || n == 0) {
+            return NGX_ERROR;
+        }
+
+        peer->weight = n;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "max_conns", &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->max_conns = n;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "max_fails", &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->max_fails = n;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "fail_timeout", &value) == NGX_OK) {
+        fail_timeout = ngx_parse_time(&value, 1);
+
+        if (fail_timeout == (time_t) NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->fail_timeout = fail_timeout;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "down", &value) == NGX_OK) {
+        peer->down = 1;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "drain", &value) == NGX_OK) {
+        peer->drain = 1;
+    }
+
+    if (ngx_http_upstream_conf_arg(r, "up", &value) == NGX_OK) {
+        peer->down = 0;
+        peer->drain = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_arg(ngx_http_request_t *r, char *name,
+    ngx_str_t *value)
+{
+    u_char  *dst, *src;
+
+    if (ngx_http_arg(r, (u_char *) name, ngx_strlen(name), value) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    dst = ngx_pnalloc(r->pool, value->len);
+    if (dst == NULL) {
+        return NGX_ERROR;
+    }
+
+    src = value->data;
+    value->data = dst;
+
+    ngx_unescape_uri(&dst, &src, value->len, 0);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_conf_print(ngx_buf_t *b, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t backup)
+{
+    b->last = ngx_sprintf(b->last,
+                          "server %V weight=%i max_conns=%ui max_fails=%ui "
+                          "fail_timeout=%Ts conns=%ui fails=%ui",
+                          &peer->name, peer->weight, peer->max_conns,
+                          peer->max_fails, peer->fail_timeout,
+                          ngx_http_upstream_round_robin_peer_conns(peers, peer),
+                          peer->fails);
+
+    if (backup) {
+        b->last = ngx_cpymem(b->last, " backup", sizeof(" backup") - 1);
+    }
+
+    if (peer->down) {
+        b->last = ngx_cpymem(b->last, " down", sizeof(" down") - 1);
+    }
+
+    if (peer->drain) {
+        b->last = ngx_cpymem(b->last, " drain", sizeof(" drain") - 1);
+    }
+
+    b->last = ngx_sprintf(b->last, "; # id=%ui", peer->slot);
+
+    if (peer->host) {
+        b->last = ngx_sprintf(b->last, " host=%V", &peer->server);
+    }
+
+    *b->last++ = LF;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r, ngx_uint_t status,
+    ngx_buf_t *b)
+{
+    ngx_int_t    rc;
+    ngx_chain_t  out;
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    if (b->last == b->pos) {
+        b->temporary = 0;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_error(ngx_http_request_t *r, ngx_uint_t status,
+    char *text)
+{
+    size_t      len;
+    ngx_buf_t  *b;
+
+    len = ngx_strlen(text);
+
+    b = ngx_create_temp_buf(r->pool, len + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, text, len);
+    *b->last++ = LF;
+
+    return ngx_http_upstream_conf_send(r, status, b);
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
@@ -25,6 +25,9 @@ typedef struct {
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                          version;
+#endif
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -32,6 +35,7 @@ typedef struct {
     /* the round robin data must be first */
     ngx_http_upstream_rr_peer_data_t    rrp;
     ngx_http_upstream_hash_srv_conf_t  *conf;
+    ngx_http_upstream_chash_points_t   *points;
     ngx_str_t                           key;
     ngx_uint_t                          tries;
     ngx_uint_t                          rehash;
@@ -49,6 +53,8 @@ static ngx_int_t ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc,
 
 static ngx_int_t ngx_http_upstream_init_chash(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_chash(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
 static int ngx_libc_cdecl
     ngx_http_upstream_chash_cmp_points(const void *one, const void *two);
 static ngx_uint_t ngx_http_upstream_find_chash_point(
@@ -178,7 +184,11 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    /* no servers may be known yet with "resolve" */
+
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || hp->rrp.peers->total_weight == 0)
+    {
         ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -284,6 +294,26 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
 static ngx_int_t
 ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_chash_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_chash(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_chash(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
 {
     u_char                             *host, *port, c;
     size_t                              host_len, port_len, size;
@@ -299,19 +329,16 @@ ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
         u_char                          byte[4];
     } prev_hash;
 
-    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    us->peer.init = ngx_http_upstream_init_chash_peer;
-
     peers = us->peer.data;
     npoints = peers->total_weight * 160;
 
-    size = sizeof(ngx_http_upstream_chash_points_t)
-           + sizeof(ngx_http_upstream_chash_point_t) * (npoints - 1);
+    size = sizeof(ngx_http_upstream_chash_points_t);
 
-    points = ngx_palloc(cf->pool, size);
+    if (npoints > 1) {
+        size += sizeof(ngx_http_upstream_chash_point_t) * (npoints - 1);
+    }
+
+    points = ngx_palloc(pool, size);
     if (points == NULL) {
         return NGX_ERROR;
     }
@@ -393,17 +420,23 @@ ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
               sizeof(ngx_http_upstream_chash_point_t),
               ngx_http_upstream_chash_cmp_points);
 
-    for (i = 0, j = 1; j < points->number; j++) {
-        if (points->point[i].hash != points->point[j].hash) {
-            points->point[++i] = points->point[j];
+    if (points->number) {
+        for (i = 0, j = 1; j < points->number; j++) {
+            if (points->point[i].hash != points->point[j].hash) {
+                points->point[++i] = points->point[j];
+            }
         }
-    }
 
-    points->number = i + 1;
+        points->number = i + 1;
+    }
 
     hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
     hcf->points = points;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    hcf->version = peers->version;
+#endif
+
     return NGX_OK;
 }
 
@@ -481,7 +514,23 @@ ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 
     ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    hp->hash = ngx_http_upstream_find_chash_point(hcf->points, hash);
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (hp->rrp.peers->shared
+        && (hcf->points == NULL || hcf->version != hp->rrp.peers->version))
+    {
+        /* the points refer to the peers of the view, and live in its pool */
+
+        if (ngx_http_upstream_update_chash(hp->rrp.peers->pool, us)
+            != NGX_OK)
+        {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    hp->points = hcf->points;
+    hp->hash = ngx_http_upstream_find_chash_point(hp->points, hash);
 
     ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
 
@@ -502,14 +551,15 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_rr_peer_t        *peer, *best;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
-    ngx_http_upstream_hash_srv_conf_t  *hcf;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get consistent hash peer, try: %ui", pc->tries);
 
     ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || hp->points->number == 0)
+    {
         ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -518,9 +568,8 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     pc->connection = NULL;
 
     now = ngx_time();
-    hcf = hp->conf;
 
-    points = hcf->points;
+    points = hp->points;
     point = &points->point[0];
 
     for ( ;; ) {
@@ -163,7 +163,11 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(iphp->rrp.peers);
 
-    if (iphp->tries > 20 || iphp->rrp.peers->single) {
+    /* no servers may be known yet with "resolve" */
+
+    if (iphp->tries > 20 || iphp->rrp.peers->single
+        || iphp->rrp.peers->total_weight == 0)
+    {
         ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
         return iphp->get_rr_peer(pc, &iphp->rrp);
     }
@@ -18,6 +18,9 @@ typedef struct {
 typedef struct {
     ngx_uint_t                            two;
     ngx_http_upstream_random_range_t     *ranges;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                            version;
+#endif
 } ngx_http_upstream_random_srv_conf_t;
 
 
@@ -26,6 +29,7 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_upstream_random_range_t     *ranges;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
@@ -131,7 +135,7 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
 
     size = peers->number * sizeof(ngx_http_upstream_random_range_t);
 
-    ranges = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    ranges = ngx_palloc(pool, size);
     if (ranges == NULL) {
         return NGX_ERROR;
     }
@@ -146,6 +150,10 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
 
     rcf->ranges = ranges;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    rcf->version = peers->version;
+#endif
+
     return NGX_OK;
 }
 
@@ -186,14 +194,22 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
-        if (ngx_http_upstream_update_random(NULL, us) != NGX_OK) {
+    if (rp->rrp.peers->shared
+        && (rcf->ranges == NULL || rcf->version != rp->rrp.peers->version))
+    {
+        /* the ranges refer to the peers of the view, and live in its pool */
+
+        if (ngx_http_upstream_update_random(rp->rrp.peers->pool, us)
+            != NGX_OK)
+        {
             ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
         }
     }
 #endif
 
+    rp->ranges = rcf->ranges;
+
     ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
 
     return NGX_OK;
@@ -220,7 +236,7 @@ ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0) {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -234,7 +250,7 @@ ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
         i = ngx_http_upstream_peek_random_peer(peers, rp);
 
-        peer = rp->conf->ranges[i].peer;
+        peer = rp->ranges[i].peer;
 
         n = i / (8 * sizeof(uintptr_t));
         m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
@@ -314,7 +330,7 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single || peers->total_weight == 0) {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -334,7 +350,7 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
         i = ngx_http_upstream_peek_random_peer(peers, rp);
 
-        peer = rp->conf->ranges[i].peer;
+        peer = rp->ranges[i].peer;
 
         if (peer == prev) {
             goto next;
@@ -417,7 +433,7 @@ ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
     while (j - i > 1) {
         k = (i + j) / 2;
 
-        if (x < rp->conf->ranges[k].range) {
+        if (x < rp->ranges[k].range) {
             j = k;
 
         } else {
@@ -18,6 +18,28 @@ static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
     ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
+static ngx_int_t ngx_http_upstream_zone_copy_resolve(
+    ngx_http_upstream_rr_peers_t *peers);
+static void ngx_http_upstream_zone_free_peer(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_int_t ngx_http_upstream_zone_grow_shards(
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t slots);
+static ngx_int_t ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static void ngx_http_upstream_zone_refresh_view(ngx_event_t *event);
+static ngx_int_t ngx_http_upstream_zone_init_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *event);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_zone_resolve_update(ngx_resolver_ctx_t *ctx);
+
+
+typedef struct {
+    ngx_event_t                     event;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_rr_peers_t   *primary;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+} ngx_http_upstream_zone_resolve_t;
 
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
@@ -55,7 +77,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_worker,    /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -188,6 +210,7 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_http_upstream_srv_conf_t *uscf)
 {
     ngx_str_t                     *name;
+    ngx_uint_t                     n;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
 
@@ -214,17 +237,23 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     peers->name = name;
 
     peers->shpool = shpool;
+    peers->slots = peers->number;
 
-    for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
+    for (peerp = &peers->peer, n = 0; *peerp; peerp = &peer->next, n++) {
         /* pool is unlocked */
         peer = ngx_http_upstream_zone_copy_peer(peers, *peerp);
         if (peer == NULL) {
             return NULL;
         }
 
+        peer->slot = n;
         *peerp = peer;
     }
 
+    if (ngx_http_upstream_zone_copy_resolve(peers) != NGX_OK) {
+        return NULL;
+    }
+
     if (peers->next == NULL) {
         goto done;
     }
@@ -239,17 +268,23 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     backup->name = name;
 
     backup->shpool = shpool;
+    backup->slots = backup->number;
 
-    for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
+    for (peerp = &backup->peer, n = 0; *peerp; peerp = &peer->next, n++) {
         /* pool is unlocked */
         peer = ngx_http_upstream_zone_copy_peer(backup, *peerp);
         if (peer == NULL) {
             return NULL;
         }
 
+        peer->slot = n;
         *peerp = peer;
     }
 
+    if (ngx_http_upstream_zone_copy_resolve(backup) != NGX_OK) {
+        return NULL;
+    }
+
     peers->next = backup;
 
 done:
@@ -292,8 +327,10 @@ ngx_http_upstream_zone_copy_peer(ngx_http_upstream_rr_peers_t *peers,
     }
 
     if (src) {
-        ngx_memcpy(dst->sockaddr, src->sockaddr, src->socklen);
-        ngx_memcpy(dst->name.data, src->name.data, src->name.len);
+        if (src->sockaddr) {
+            ngx_memcpy(dst->sockaddr, src->sockaddr, src->socklen);
+            ngx_memcpy(dst->name.data, src->name.data, src->name.len);
+        }
 
         dst->server.data = ngx_slab_alloc_locked(pool, src->server.len);
         if (dst->server.data == NULL) {
@@ -323,3 +360,623 @@ failed:
 
     return NULL;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_zone_copy_resolve(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_slab_pool_t              *pool;
+    ngx_http_upstream_host_t     *host, *src;
+    ngx_http_upstream_rr_peer_t  *peer, **peerp;
+
+    pool = peers->shpool;
+
+    for (peerp = &peers->resolve; *peerp; peerp = &peer->next) {
+        /* pool is unlocked */
+        peer = ngx_http_upstream_zone_copy_peer(peers, *peerp);
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        src = peer->host;
+
+        host = ngx_slab_calloc_locked(pool, sizeof(ngx_http_upstream_host_t));
+        if (host == NULL) {
+            return NGX_ERROR;
+        }
+
+        host->name.data = ngx_slab_alloc_locked(pool, src->name.len);
+        if (host->name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(host->name.data, src->name.data, src->name.len);
+        host->name.len = src->name.len;
+
+        if (src->service.len) {
+            host->service.data = ngx_slab_alloc_locked(pool, src->service.len);
+            if (host->service.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(host->service.data, src->service.data,
+                       src->service.len);
+            host->service.len = src->service.len;
+        }
+
+        host->port = src->port;
+
+        peer->host = host;
+        *peerp = peer;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_zone_add_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *src, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    u_char                       *used;
+    ngx_uint_t                    slot;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_upstream_rr_peer_t  *peer, **peerp;
+
+    /* the peers are write locked */
+
+    used = ngx_calloc(peers->slots / 8 + 1, ngx_cycle->log);
+    if (used == NULL) {
+        return NULL;
+    }
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        used[peer->slot / 8] |= 1 << (peer->slot % 8);
+    }
+
+    for (peer = peers->retired; peer; peer = peer->next) {
+        used[peer->slot / 8] |= 1 << (peer->slot % 8);
+    }
+
+    for (slot = 0; slot < peers->slots; slot++) {
+        if (!(used[slot / 8] & (1 << (slot % 8)))) {
+            break;
+        }
+    }
+
+    ngx_free(used);
+
+    shpool = peers->shpool;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (slot == peers->slots
+        && ngx_http_upstream_zone_grow_shards(peers, slot + 1) != NGX_OK)
+    {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
+    }
+
+    peer = ngx_http_upstream_zone_copy_peer(peers, NULL);
+    if (peer == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
+    }
+
+    peer->server.data = ngx_slab_alloc_locked(shpool, src->server.len);
+    if (peer->server.data == NULL) {
+        ngx_http_upstream_zone_free_peer(shpool, peer);
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_memcpy(peer->sockaddr, sockaddr, socklen);
+    peer->socklen = socklen;
+
+    peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->socklen,
+                                   peer->name.data, NGX_SOCKADDR_STRLEN, 1);
+
+    peer->server.len = ngx_cpymem(peer->server.data, src->server.data,
+                                  src->server.len)
+                       - peer->server.data;
+
+    peer->weight = src->weight;
+    peer->effective_weight = src->weight;
+    peer->max_conns = src->max_conns;
+    peer->max_fails = src->max_fails;
+    peer->fail_timeout = src->fail_timeout;
+    peer->down = src->down;
+    peer->drain = src->drain;
+    peer->host = src->host;
+    peer->slot = slot;
+
+    if (slot == peers->slots) {
+        peers->slots++;
+    }
+
+    for (peerp = &peers->peer; *peerp; peerp = &(*peerp)->next) {
+        /* void */
+    }
+
+    *peerp = peer;
+
+    return peer;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_grow_shards(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t slots)
+{
+    ngx_uint_t                     n, last;
+    ngx_http_upstream_rr_shard_t  *shard, *tail, *more;
+
+    /*
+     * the shpool is locked; counters of the new slots are appended
+     * to the shards of all workers, as a shard never moves
+     */
+
+    for (shard = peers->shards; shard; shard = shard->next) {
+
+        for (tail = shard; tail->more; tail = tail->more) {
+            /* void */
+        }
+
+        last = tail->base + tail->nslots;
+
+        if (slots <= last) {
+            continue;
+        }
+
+        n = ngx_max(slots - last, tail->nslots);
+
+        more = ngx_slab_calloc_locked(peers->shpool,
+                                      offsetof(ngx_http_upstream_rr_shard_t,
+                                               conns)
+                                      + n * sizeof(ngx_uint_t));
+        if (more == NULL) {
+            return NGX_ERROR;
+        }
+
+        more->worker = shard->worker;
+        more->base = last;
+        more->nslots = n;
+
+        ngx_memory_barrier();
+
+        tail->more = more;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_upstream_zone_remove_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_http_upstream_rr_peer_t  **peerp;
+
+    /* the peers are write locked */
+
+    for (peerp = &peers->peer; *peerp; peerp = &(*peerp)->next) {
+        if (*peerp == peer) {
+            *peerp = peer->next;
+            break;
+        }
+    }
+
+    /* the peer is freed once no worker view refers to it */
+
+    peer->next = peers->retired;
+    peers->retired = peer;
+}
+
+
+void
+ngx_http_upstream_zone_update_peers(ngx_http_upstream_rr_peers_t *primary,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                    n, w, t;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /* the peers are write locked */
+
+    n = 0;
+    w = 0;
+    t = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        n++;
+        w += peer->weight;
+
+        if (!peer->down && !peer->drain) {
+            t++;
+        }
+    }
+
+    peers->number = n;
+    peers->weighted = (w != n);
+    peers->total_weight = w;
+    peers->tries = t;
+
+    primary->single = (primary->number == 1 && primary->next == NULL);
+
+    primary->version++;
+
+    ngx_http_upstream_zone_reap_peers(peers);
+}
+
+
+void
+ngx_http_upstream_zone_reap_peers(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_http_upstream_rr_peer_t  *peer, **peerp;
+
+    /* the peers are write locked */
+
+    ngx_shmtx_lock(&peers->shpool->mutex);
+
+    for (peerp = &peers->retired; *peerp; /* void */ ) {
+        peer = *peerp;
+
+        if (peer->refs) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        *peerp = peer->next;
+
+        ngx_http_upstream_zone_free_peer(peers->shpool, peer);
+    }
+
+    ngx_shmtx_unlock(&peers->shpool->mutex);
+}
+
+
+static void
+ngx_http_upstream_zone_free_peer(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    if (peer->server.data) {
+        ngx_slab_free_locked(shpool, peer->server.data);
+    }
+
+    if (peer->name.data) {
+        ngx_slab_free_locked(shpool, peer->name.data);
+    }
+
+    if (peer->sockaddr) {
+        ngx_slab_free_locked(shpool, peer->sockaddr);
+    }
+
+#if (NGX_HTTP_SSL)
+    if (peer->ssl_session) {
+        ngx_slab_free_locked(shpool, peer->ssl_session);
+    }
+#endif
+
+    ngx_slab_free_locked(shpool, peer);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_event_t                    *event;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        peers = ngx_http_upstream_create_round_robin_view(uscf->peer.data,
+                                                          NULL, cycle->log);
+        if (peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        uscf->peer.data = peers;
+
+        /*
+         * an idle worker would keep its view, and the removed peers
+         * referenced by it, until the next request to the upstream
+         */
+
+        event = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+        if (event == NULL) {
+            return NGX_ERROR;
+        }
+
+        event->handler = ngx_http_upstream_zone_refresh_view;
+        event->data = uscf;
+        event->log = cycle->log;
+        event->cancelable = 1;
+
+        ngx_add_timer(event, 1000);
+
+        if (ngx_http_upstream_zone_init_resolve(cycle, uscf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_refresh_view(ngx_event_t *event)
+{
+    ngx_http_upstream_rr_peers_t  *peers, *view;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = event->data;
+    peers = uscf->peer.data;
+
+    if (peers->version != peers->shared->version) {
+        view = ngx_http_upstream_create_round_robin_view(peers->shared, peers,
+                                                         event->log);
+        if (view) {
+            uscf->peer.data = view;
+            ngx_http_upstream_release_round_robin_view(peers);
+        }
+    }
+
+    ngx_add_timer(event, 1000);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peers_t      *primary, *peers;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    /* names are resolved by a single worker, others see the updated peers */
+
+    if (ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    primary = ((ngx_http_upstream_rr_peers_t *) uscf->peer.data)->shared;
+
+    for (peers = primary; peers; peers = peers->next) {
+
+        for (peer = peers->resolve; peer; peer = peer->next) {
+
+            rs = ngx_pcalloc(cycle->pool,
+                             sizeof(ngx_http_upstream_zone_resolve_t));
+            if (rs == NULL) {
+                return NGX_ERROR;
+            }
+
+            rs->uscf = uscf;
+            rs->primary = primary;
+            rs->peers = peers;
+            rs->peer = peer;
+
+            rs->event.handler = ngx_http_upstream_zone_resolve_timer;
+            rs->event.data = rs;
+            rs->event.log = cycle->log;
+            rs->event.cancelable = 1;
+
+            ngx_add_timer(&rs->event, 1);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *event)
+{
+    ngx_resolver_ctx_t                *ctx;
+    ngx_http_upstream_host_t          *host;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    rs = event->data;
+    host = rs->peer->host;
+
+    ctx = ngx_resolve_start(rs->uscf->resolver, NULL);
+    if (ctx == NULL) {
+        goto retry;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "no resolver defined to resolve %V", &host->name);
+        return;
+    }
+
+    ctx->name = host->name;
+    ctx->service = host->service;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = rs;
+    ctx->timeout = rs->uscf->resolver_timeout;
+    ctx->cancelable = 1;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+retry:
+
+    ngx_add_timer(event, 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                             now;
+    ngx_msec_t                         timer;
+    ngx_event_t                       *event;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    rs = ctx->data;
+    event = &rs->event;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s)",
+                      &rs->uscf->host, &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        /* on errors other than NXDOMAIN the current peers are kept */
+
+        if (ctx->state != NGX_RESOLVE_NXDOMAIN) {
+            goto done;
+        }
+
+        ctx->naddrs = 0;
+    }
+
+    ngx_http_upstream_zone_resolve_update(ctx);
+
+done:
+
+    /* the next lookup is made when the answer expires */
+
+    now = ngx_time();
+    timer = (ctx->valid > now) ? (ngx_msec_t) (ctx->valid - now) * 1000 : 1000;
+
+    ngx_resolve_name_done(ctx);
+
+    ngx_add_timer(event, timer);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_update(ngx_resolver_ctx_t *ctx)
+{
+    ngx_uint_t                         i, changed, priority;
+    ngx_resolver_addr_t               *addr;
+    ngx_http_upstream_host_t          *host;
+    ngx_http_upstream_rr_peer_t       *peer, *next;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    rs = ctx->data;
+    peers = rs->peers;
+    host = rs->peer->host;
+
+    /* SRV records with the lowest priority value only */
+
+    priority = (ngx_uint_t) -1;
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        addr = &ctx->addrs[i];
+
+        if (host->service.len == 0) {
+            ngx_inet_set_port(addr->sockaddr, host->port);
+        }
+
+        priority = ngx_min(priority, addr->priority);
+    }
+
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_wlock(rs->primary);
+
+    for (peer = peers->peer; peer; peer = next) {
+        next = peer->next;
+
+        if (peer->host != host) {
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            addr = &ctx->addrs[i];
+
+            if (addr->priority == priority
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    addr->sockaddr, addr->socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < ctx->naddrs) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream \"%V\": server %V of \"%V\" removed",
+                      &rs->uscf->host, &peer->name, &host->name);
+
+        ngx_http_upstream_zone_remove_peer(peers, peer);
+        changed = 1;
+    }
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        addr = &ctx->addrs[i];
+
+        if (addr->priority != priority) {
+            continue;
+        }
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (peer->host == host
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    addr->sockaddr, addr->socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (peer) {
+            continue;
+        }
+
+        peer = ngx_http_upstream_zone_add_peer(peers, rs->peer,
+                                               addr->sockaddr, addr->socklen);
+        if (peer == NULL) {
+            continue;
+        }
+
+        if (host->service.len && addr->weight) {
+            peer->weight = addr->weight;
+            peer->effective_weight = addr->weight;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream \"%V\": server %V of \"%V\" added",
+                      &rs->uscf->host, &peer->name, &host->name);
+
+        changed = 1;
+    }
+
+    if (changed) {
+        ngx_http_upstream_zone_update_peers(rs->primary, peers);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(rs->primary);
+}
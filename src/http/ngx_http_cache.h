@@ -27,7 +27,7 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       6
 
 
 typedef struct {
@@ -59,6 +59,10 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+
+    u_char                          *fill;
+    ngx_pid_t                        fill_pid;
+    ngx_uint_t                       waiters;
 } ngx_http_file_cache_node_t;
 
 
@@ -107,8 +111,27 @@ struct ngx_http_cache_s {
 
     ngx_event_t                      wait_event;
 
+    off_t                            fill_offset;
+    ngx_buf_t                       *fill_buf;
+    ngx_pid_t                        fill_pid;
+    ngx_queue_t                      queue;
+
+    off_t                            sparse_start;
+    off_t                            sparse_size;
+    off_t                            sparse_length;
+    size_t                           sparse_body_start;
+    ngx_str_t                        sparse_etag;
+
     unsigned                         lock:1;
     unsigned                         waiting:1;
+    unsigned                         queued:1;
+
+    unsigned                         filling:1;
+    unsigned                         streaming:1;
+    unsigned                         fill_failed:1;
+
+    unsigned                         sparse:1;
+    unsigned                         sparse_merge:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
@@ -141,6 +164,8 @@ typedef struct {
     u_char                           vary_len;
     u_char                           vary[NGX_HTTP_CACHE_VARY_LEN];
     u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
+    off_t                            sparse_size;
+    off_t                            sparse_length;
 } ngx_http_file_cache_header_t;
 
 
@@ -192,6 +217,7 @@ ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
@@ -16,8 +16,30 @@ static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_attach(ngx_http_request_t *r,
+    ngx_http_cache_t *c, u_char *name);
+static void ngx_http_file_cache_stream(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_stream_wait(ngx_http_cache_t *c);
+static ngx_uint_t ngx_http_file_cache_fill_alive(ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_done(ngx_http_request_t *r,
+    ngx_int_t rc);
+static void ngx_http_file_cache_wait(ngx_http_cache_t *c);
+static void ngx_http_file_cache_unwait(ngx_http_cache_t *c);
+static void ngx_http_file_cache_wakeup(ngx_uint_t waiters, ngx_log_t *log);
+#if !(NGX_WIN32)
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_sparse_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_http_file_cache_header_t *h);
+static ngx_int_t ngx_http_file_cache_sparse_update(ngx_http_request_t *r,
+    ngx_temp_file_t *tf, ngx_ext_rename_file_t *ext, ngx_file_info_t *fi);
+static ngx_int_t ngx_http_file_cache_sparse_copy(ngx_file_t *src, off_t from,
+    ngx_file_t *dst, off_t to, off_t size);
+static ngx_int_t ngx_http_file_cache_sparse_mark(ngx_http_cache_t *c,
+    ngx_file_t *file, off_t offset, ngx_uint_t create);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -79,6 +101,18 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+#if !(NGX_WIN32)
+
+#define ngx_http_file_cache_waiter(slot)                                      \
+    ((ngx_uint_t) 1 << ((slot) % (8 * sizeof(ngx_uint_t))))
+
+
+static ngx_queue_t  ngx_http_file_cache_waiting;
+static ngx_event_t  ngx_http_file_cache_wakeup_event;
+
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -404,6 +438,9 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    u_char                    *name;
+    size_t                     len;
+    ngx_int_t                  rc;
     ngx_msec_t                 now, timer;
     ngx_http_file_cache_t     *cache;
 
@@ -414,6 +451,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    name = NULL;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -424,6 +462,33 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+        if (c->node->fill) {
+            /* the previous fill has lost its lock */
+            ngx_slab_free_locked(cache->shpool, c->node->fill);
+            c->node->fill = NULL;
+        }
+
+    } else if (c->node->fill && !c->fill_failed) {
+
+        /*
+         * the response is being written to a temporary file,
+         * so it can be sent from there while the file grows
+         */
+
+        if (!c->node->exists && c->lock_timeout) {
+            len = ngx_strlen(c->node->fill) + 1;
+
+            name = ngx_pnalloc(r->pool, len);
+            if (name) {
+                ngx_memcpy(name, c->node->fill, len);
+                c->fill_pid = c->node->fill_pid;
+            }
+        }
+
+        if (name == NULL) {
+            c->fill_failed = 1;
+        }
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
@@ -440,8 +505,6 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
-    c->waiting = 1;
-
     if (c->wait_time == 0) {
         c->wait_time = now + c->lock_timeout;
 
@@ -450,12 +513,19 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
-    timer = c->wait_time - now;
+    if (name) {
+        rc = ngx_http_file_cache_attach(r, c, name);
 
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
 
+    c->waiting = 1;
     r->main->blocked++;
 
+    ngx_post_event(&c->wait_event, &ngx_posted_events);
+
     return NGX_AGAIN;
 }
 
@@ -484,7 +554,7 @@ static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
     ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
+    ngx_msec_t              now, timer, lock;
     ngx_http_file_cache_t  *cache;
 
     now = ngx_current_msec;
@@ -503,27 +573,480 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    timer = c->node->lock_time - now;
+    lock = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) lock > 0
+        && (c->node->fill == NULL || c->fill_failed))
+    {
         wait = 1;
+
+        if (lock < timer) {
+            timer = lock;
+        }
+
+        ngx_http_file_cache_wait(c);
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+
+#if (NGX_WIN32)
+        /* lock owners in other processes cannot wake us up */
+
+        if (timer > 500) {
+            timer = 500;
+        }
+#endif
+
+        ngx_add_timer(&c->wait_event, timer);
         return;
     }
 
 wakeup:
 
+    ngx_http_file_cache_unwait(c);
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_attach(ngx_http_request_t *r, ngx_http_cache_t *c,
+    u_char *name)
+{
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_int_t                 rc;
+    ngx_file_info_t           fi;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", name);
+        }
+
+        c->fill_failed = 1;
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = name;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache attach: \"%s\" %O",
+                   name, ngx_file_size(&fi));
+
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+    c->uniq = ngx_file_uniq(&fi);
+    c->length = ngx_file_size(&fi);
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->streaming = 1;
+
+    rc = ngx_http_file_cache_read(r, c);
+
+    if (rc == NGX_DECLINED) {
+        c->file.fd = NGX_INVALID_FILE;
+        c->streaming = 0;
+        c->fill_failed = 1;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_stream(ngx_http_request_t *r)
+{
+    off_t                        size;
+    ngx_int_t                    rc, fill;
+    ngx_buf_t                   *b;
+    ngx_chain_t                  out;
+    ngx_event_t                 *wev;
+    ngx_file_info_t              fi;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_file_cache_node_t  *fcn;
+
+    c = r->cache;
+    wev = r->connection->write;
+
+    clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        r->connection->timedout = 1;
+
+        ngx_http_file_cache_stream_done(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed || r->aio) {
+        goto blocked;
+    }
+
+    if (r->buffered || r->postponed
+        || (r == r->main && r->connection->buffered))
+    {
+        rc = ngx_http_output_filter(r, NULL);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_file_cache_stream_done(r, NGX_ERROR);
+            return;
+        }
+
+        if (r->buffered || r->postponed
+            || (r == r->main && r->connection->buffered))
+        {
+            goto blocked;
+        }
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    /*
+     * the fill is complete once the file is renamed into the cache,
+     * and has failed once the lock is released without that
+     */
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn->exists && fcn->uniq == c->uniq) {
+        fill = NGX_OK;
+
+    } else if (fcn->fill == NULL && !fcn->updating) {
+        fill = NGX_ERROR;
+
+    } else {
+        fill = NGX_AGAIN;
+        ngx_http_file_cache_wait(c);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (fill == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not completed",
+                      c->file.name.data);
+
+        ngx_http_file_cache_stream_done(r, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+
+        ngx_http_file_cache_stream_done(r, NGX_ERROR);
+        return;
+    }
+
+#if !(NGX_WIN32)
+
+    /* the temporary file is removed if the update fails */
+
+    if (fill == NGX_AGAIN && fi.st_nlink == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not completed",
+                      c->file.name.data);
+
+        ngx_http_file_cache_stream_done(r, NGX_ERROR);
+        return;
+    }
+
+#endif
+
+    size = ngx_file_size(&fi);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: %i %O-%O", fill, c->length, size);
+
+    if (fill == NGX_AGAIN && size == c->length) {
+        ngx_http_file_cache_stream_wait(c);
+        return;
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    b = c->fill_buf;
+
+    b->file_pos = c->length;
+    b->file_last = size;
+    b->in_file = (size > c->length) ? 1 : 0;
+
+    if (fill == NGX_OK) {
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+        b->flush = 0;
+
+    } else {
+        b->flush = 1;
+    }
+
+    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+
+    c->length = size;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_output_filter(r, &out);
+
+    if (fill == NGX_OK || rc == NGX_ERROR) {
+        ngx_http_file_cache_stream_done(r, rc);
+        return;
+    }
+
+    if (r->buffered || r->postponed
+        || (r == r->main && r->connection->buffered))
+    {
+        goto blocked;
+    }
+
+    ngx_http_file_cache_stream_wait(c);
+
+    return;
+
+blocked:
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        ngx_http_file_cache_stream_done(r, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_http_file_cache_stream_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream handler: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    /*
+     * the update may take as long as the upstream server allows,
+     * so a response is only truncated if the process writing it
+     * has exited
+     */
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        if (!ngx_http_file_cache_fill_alive(r->cache)) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "cache file \"%s\" is not updated",
+                          r->cache->file.name.data);
+
+            ngx_http_file_cache_stream_done(r, NGX_ERROR);
+
+            ngx_http_run_posted_requests(c);
+            return;
+        }
+    }
+
+    ngx_http_file_cache_stream(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_file_cache_stream_wait(ngx_http_cache_t *c)
+{
+    ngx_msec_t  timer;
+
+    timer = c->lock_timeout;
+
+#if (NGX_WIN32)
+    /* lock owners in other processes cannot wake us up */
+
+    if (timer > 500) {
+        timer = 500;
+    }
+#endif
+
+    ngx_add_timer(&c->wait_event, timer);
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_fill_alive(ngx_http_cache_t *c)
+{
+#if !(NGX_WIN32)
+
+    if (kill(c->fill_pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+        return 0;
+    }
+
+#endif
+
+    return 1;
+}
+
+
+static void
+ngx_http_file_cache_stream_done(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_http_file_cache_unwait(r->cache);
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static void
+ngx_http_file_cache_wait(ngx_http_cache_t *c)
+{
+#if !(NGX_WIN32)
+
+    /* called with the cache mutex locked */
+
+    c->node->waiters |= ngx_http_file_cache_waiter(ngx_process_slot);
+
+    if (c->queued) {
+        return;
+    }
+
+    if (ngx_wakeup_event == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiting);
+
+        ngx_http_file_cache_wakeup_event.handler =
+                                        ngx_http_file_cache_wakeup_handler;
+        ngx_http_file_cache_wakeup_event.log = ngx_cycle->log;
+
+        ngx_wakeup_event = &ngx_http_file_cache_wakeup_event;
+    }
+
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->queue);
+    c->queued = 1;
+
+#endif
+}
+
+
+static void
+ngx_http_file_cache_unwait(ngx_http_cache_t *c)
+{
+#if !(NGX_WIN32)
+
+    if (c->queued) {
+        ngx_queue_remove(&c->queue);
+        c->queued = 0;
+    }
+
+#endif
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_wakeup(ngx_uint_t waiters, ngx_log_t *log)
+{
+#if !(NGX_WIN32)
+    ngx_int_t  s;
+
+    if (waiters == 0) {
+        return;
+    }
+
+    if (waiters & ngx_http_file_cache_waiter(ngx_process_slot)) {
+        (void) ngx_wakeup_process(ngx_process_slot, log);
+    }
+
+    for (s = 0; s < ngx_last_process; s++) {
+        if (s != ngx_process_slot
+            && (waiters & ngx_http_file_cache_waiter(s)))
+        {
+            (void) ngx_wakeup_process(s, log);
+        }
+    }
+#endif
+}
+
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "http file cache wakeup");
+
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiting);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiting);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, queue);
+
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -601,6 +1124,14 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         }
     }
 
+    if (h->sparse_size) {
+        rc = ngx_http_file_cache_sparse_read(r, c, h);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
     c->buf->last += n;
 
     c->valid_sec = h->valid_sec;
@@ -617,6 +1148,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
+    if (c->streaming) {
+        return NGX_OK;
+    }
+
     if (cache->sh->cold) {
 
         ngx_shmtx_lock(&cache->shpool->mutex);
@@ -652,16 +1187,81 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
+
+        return rc;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sparse_read(ngx_http_request_t *r, ngx_http_cache_t *c,
+    ngx_http_file_cache_header_t *h)
+{
+    off_t    offset;
+    u_char   mark;
+    ssize_t  n;
+
+    /*
+     * a sparse cache file keeps byte ranges of a response at their
+     * offsets in the body, followed by a map with a byte per range,
+     * which is set once the range is in the file
+     */
+
+    if (c->sparse_size != h->sparse_size
+        || c->sparse_start >= h->sparse_length)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache sparse mismatch: %O %O",
+                       c->sparse_start, c->sparse_size);
+        return NGX_DECLINED;
+    }
+
+    offset = h->body_start + h->sparse_length
+             + c->sparse_start / c->sparse_size;
+
+    n = ngx_read_file(&c->file, &mark, 1, offset);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse: %O-%O/%O",
+                   c->sparse_start, c->sparse_start + c->sparse_size - 1,
+                   h->sparse_length);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
+    c->sparse_length = h->sparse_length;
 
-        return rc;
+    if (n == 1 && mark) {
+        c->sparse = 1;
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    if (h->valid_sec < ngx_time()) {
+        return NGX_DECLINED;
+    }
+
+    /* the range is missing, it will be added to the file once received */
+
+    c->sparse_etag.data = ngx_pnalloc(r->pool, h->etag_len);
+    if (c->sparse_etag.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->sparse_etag.data, h->etag, h->etag_len);
+    c->sparse_etag.len = h->etag_len;
+
+    c->sparse_body_start = h->body_start;
+    c->sparse_merge = 1;
+
+    return NGX_DECLINED;
 }
 
 
@@ -1268,6 +1868,11 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     h->header_start = (u_short) c->header_start;
     h->body_start = (u_short) c->body_start;
 
+    if (c->sparse) {
+        h->sparse_size = c->sparse_size;
+        h->sparse_length = c->sparse_length;
+    }
+
     if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
         h->etag_len = (u_char) c->etag.len;
         ngx_memcpy(h->etag, c->etag.data, c->etag.len);
@@ -1308,6 +1913,7 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_uint_t              waiters;
     ngx_http_file_cache_t  *cache;
 
     if (!c->secondary) {
@@ -1334,10 +1940,16 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     c->node->count--;
     c->node->updating = 0;
+
+    waiters = c->node->waiters;
+    c->node->waiters = 0;
+
     c->node = NULL;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_wakeup(waiters, r->connection->log);
+
     c->file.name.len = 0;
     c->update_variant = 1;
 
@@ -1355,11 +1967,76 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+#if !(NGX_WIN32)
+    u_char                 *p;
+    ngx_uint_t              waiters;
+    ngx_http_cache_t       *c;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    /*
+     * once the response header is in the temporary file, its name
+     * is published in the cache node, so requests waiting for the
+     * cache lock can send the response while it is being written
+     */
+
+    if (!c->lock
+        || !c->updating
+        || c->vary.len
+        || c->sparse_size
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start
+        || tf->offset == c->fill_offset)
+    {
+        return;
+    }
+
+    c->fill_offset = tf->offset;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->lock_time != c->lock_time) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    if (!c->filling) {
+        c->filling = 1;
+
+        p = ngx_slab_alloc_locked(cache->shpool, tf->file.name.len + 1);
+
+        if (p) {
+            ngx_memcpy(p, tf->file.name.data, tf->file.name.len + 1);
+            c->node->fill = p;
+            c->node->fill_pid = ngx_pid;
+        }
+    }
+
+    waiters = c->node->waiters;
+    c->node->waiters = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: %O w:%ui", tf->offset, waiters);
+
+    ngx_http_file_cache_wakeup(waiters, r->connection->log);
+#endif
+}
+
+
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
     off_t                   fs_size;
     ngx_int_t               rc;
+    ngx_uint_t              waiters;
     ngx_file_uniq_t         uniq;
     ngx_file_info_t         fi;
     ngx_http_cache_t        *c;
@@ -1383,10 +2060,6 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     uniq = 0;
     fs_size = 0;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
-
     ext.access = NGX_FILE_OWNER_ACCESS;
     ext.path_access = NGX_FILE_OWNER_ACCESS;
     ext.time = -1;
@@ -1394,45 +2067,341 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ext.delete_file = 1;
     ext.log = r->connection->log;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    if (c->sparse) {
+        rc = ngx_http_file_cache_sparse_update(r, tf, &ext, &fi);
 
-    if (rc == NGX_OK) {
+    } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache rename: \"%s\" to \"%s\"",
+                       tf->file.name.data, c->file.name.data);
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+        if (rc == NGX_OK && ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
                           ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
 
             rc = NGX_ERROR;
-
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
         }
     }
 
+    if (rc == NGX_OK) {
+        uniq = ngx_file_uniq(&fi);
+        fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+    }
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+    if (rc != NGX_DECLINED) {
+        c->node->error = 0;
+        c->node->uniq = uniq;
+        c->node->body_start = c->body_start;
+
+        cache->sh->size += fs_size - c->node->fs_size;
+        c->node->fs_size = fs_size;
+    }
 
     if (rc == NGX_OK) {
         c->node->exists = 1;
     }
 
+    if (c->node->fill && c->node->lock_time == c->lock_time) {
+        ngx_slab_free_locked(cache->shpool, c->node->fill);
+        c->node->fill = NULL;
+    }
+
     c->node->updating = 0;
 
+    waiters = c->node->waiters;
+    c->node->waiters = 0;
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(waiters, r->connection->log);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sparse_update(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    ngx_ext_rename_file_t *ext, ngx_file_info_t *fi)
+{
+    off_t              size;
+    size_t             body_start;
+    ngx_err_t          err;
+    ngx_int_t          rc;
+    ngx_file_t         file, *dst;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    size = ngx_min(c->sparse_size, c->sparse_length - c->sparse_start);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse update: %O-%O/%O m:%d",
+                   c->sparse_start, c->sparse_start + size - 1,
+                   c->sparse_length, c->sparse_merge);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.fd = NGX_INVALID_FILE;
+    file.log = r->connection->log;
+
+    if (tf->offset - (off_t) c->body_start != size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sparse cache range size %O does not match %O",
+                      tf->offset - (off_t) c->body_start, size);
+        rc = NGX_DECLINED;
+        goto failed;
+    }
+
+    if (c->sparse_merge) {
+
+        /* the range is copied to the existing cache file */
+
+        body_start = c->sparse_body_start;
+
+        file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN,
+                                0);
+
+        if (file.fd == NGX_INVALID_FILE) {
+            err = ngx_errno;
+
+            /* cache file may have been deleted */
+
+            if (err != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                              ngx_open_file_n " \"%s\" failed",
+                              file.name.data);
+            }
+
+            rc = NGX_DECLINED;
+            goto failed;
+        }
+
+        if (ngx_fd_info(file.fd, fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", file.name.data);
+            rc = NGX_ERROR;
+            goto failed;
+        }
+
+        /* make sure cache file wasn't replaced */
+
+        if (c->uniq != ngx_file_uniq(fi)) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" changed",
+                           file.name.data);
+            rc = NGX_DECLINED;
+            goto failed;
+        }
+
+        dst = &file;
+
+    } else if (c->sparse_start == 0) {
+
+        /* the first range is already in place in the temporary file */
+
+        body_start = c->body_start;
+        dst = &tf->file;
+
+    } else {
+
+        /* the header and the range are copied to a new temporary file */
+
+        body_start = c->body_start;
+
+        ngx_str_null(&file.name);
+
+        if (ngx_create_temp_file(&file, tf->path, r->pool, 1, 0,
+                                 NGX_FILE_OWNER_ACCESS)
+            != NGX_OK)
+        {
+            rc = NGX_ERROR;
+            goto failed;
+        }
+
+        if (ngx_http_file_cache_sparse_copy(&tf->file, 0, &file, 0,
+                                            body_start)
+            != NGX_OK)
+        {
+            rc = NGX_ERROR;
+            goto failed;
+        }
+
+        dst = &file;
+    }
+
+    if (dst != &tf->file
+        && ngx_http_file_cache_sparse_copy(&tf->file, c->body_start, dst,
+                                           body_start + c->sparse_start, size)
+           != NGX_OK)
+    {
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (ngx_http_file_cache_sparse_mark(c, dst, body_start,
+                                        c->sparse_merge ? 0 : 1)
+        != NGX_OK)
+    {
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (ngx_fd_info(dst->fd, fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", dst->name.data);
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (c->sparse_merge) {
+        c->body_start = body_start;
+        rc = NGX_OK;
+        goto done;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   dst->name.data, c->file.name.data);
+
+    rc = ngx_ext_rename_file(&dst->name, &c->file.name, ext);
+
+    if (dst == &tf->file) {
+        return rc;
+    }
+
+    goto done;
+
+failed:
+
+    if (!c->sparse_merge && file.fd != NGX_INVALID_FILE) {
+        if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", file.name.data);
+        }
+    }
+
+done:
+
+    if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tf->file.name.data);
+    }
+
+    if (c->sparse_merge && file.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", file.name.data);
+        }
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sparse_copy(ngx_file_t *src, off_t from, ngx_file_t *dst,
+    off_t to, off_t size)
+{
+    u_char     *buf;
+    size_t      len;
+    ssize_t     n;
+    ngx_int_t   rc;
+
+    len = (size_t) ngx_min(size, 65536);
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    buf = ngx_alloc(len, src->log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    while (size > 0) {
+
+        if ((off_t) len > size) {
+            len = (size_t) size;
+        }
+
+        n = ngx_read_file(src, buf, len, from);
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        if ((size_t) n != len) {
+            ngx_log_error(NGX_LOG_CRIT, src->log, 0,
+                          ngx_read_file_n " read only %z of %uz from \"%s\"",
+                          n, len, src->name.data);
+            goto failed;
+        }
+
+        if (ngx_write_file(dst, buf, len, to) == NGX_ERROR) {
+            goto failed;
+        }
+
+        from += len;
+        to += len;
+        size -= len;
+    }
+
+    rc = NGX_OK;
+
+failed:
+
+    ngx_free(buf);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sparse_mark(ngx_http_cache_t *c, ngx_file_t *file,
+    off_t offset, ngx_uint_t create)
+{
+    u_char      mark;
+    ngx_uint_t  n, last;
+
+    /* the map of ranges follows the body */
+
+    offset += c->sparse_length;
+
+    n = (ngx_uint_t) (c->sparse_start / c->sparse_size);
+    last = (ngx_uint_t) ((c->sparse_length - 1) / c->sparse_size);
+
+    if (create && n != last) {
+
+        /* the file is extended to its final size */
+
+        mark = 0;
+
+        if (ngx_write_file(file, &mark, 1, offset + last) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    mark = 1;
+
+    if (ngx_write_file(file, &mark, 1, offset + n) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
 void
 ngx_http_file_cache_update_header(ngx_http_request_t *r)
 {
+    off_t                          sparse_size, sparse_length;
     ssize_t                        n;
     ngx_err_t                      err;
     ngx_file_t                     file;
@@ -1519,8 +2488,14 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
      * notably h.valid_sec and h.date
      */
 
+    sparse_size = h.sparse_size;
+    sparse_length = h.sparse_length;
+
     ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
 
+    h.sparse_size = sparse_size;
+    h.sparse_length = sparse_length;
+
     h.version = NGX_HTTP_CACHE_VERSION;
     h.valid_sec = c->valid_sec;
     h.updating_sec = c->updating_sec;
@@ -1587,16 +2562,47 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    if (c->streaming) {
+        r->allow_ranges = 0;
+    }
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (c->streaming) {
+
+        /* the response is sent as the cache file is written */
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->fill_buf = b;
+        c->length = c->body_start;
+
+        c->wait_event.handler = ngx_http_file_cache_stream_handler;
+
+        r->write_event_handler = ngx_http_file_cache_stream;
+
+        ngx_http_file_cache_stream(r);
+
+        return NGX_DONE;
+    }
+
+    if (c->sparse) {
+        b->file_pos = c->body_start + c->sparse_start;
+        b->file_last = c->body_start + ngx_min(c->sparse_start + c->sparse_size,
+                                               c->sparse_length);
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1 : 0;
+    b->in_file = (b->file_last - b->file_pos) ? 1 : 0;
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
     b->sync = (b->last_buf || b->in_file) ? 0 : 1;
@@ -1615,6 +2621,7 @@ ngx_http_cache_send(ngx_http_request_t *r)
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
+    ngx_uint_t                   waiters;
     ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
 
@@ -1632,8 +2639,18 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     fcn = c->node;
     fcn->count--;
 
+    waiters = 0;
+
     if (c->updating && fcn->lock_time == c->lock_time) {
         fcn->updating = 0;
+
+        if (fcn->fill) {
+            ngx_slab_free_locked(cache->shpool, fcn->fill);
+            fcn->fill = NULL;
+        }
+
+        waiters = fcn->waiters;
+        fcn->waiters = 0;
     }
 
     if (c->error) {
@@ -1654,6 +2671,8 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_wakeup(waiters, c->file.log);
+
     c->updated = 1;
     c->updating = 0;
 
@@ -1671,9 +2690,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
     }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
+    ngx_http_file_cache_unwait(c);
 }
 
 
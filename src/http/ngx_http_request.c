@@ -1001,6 +1001,13 @@ ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
         return 0;
     }
 
+#if (NGX_THREADS)
+    if (c->ssl->thread_pool) {
+        /* called again in a thread, see ngx_ssl_handshake_offload() */
+        return 1;
+    }
+#endif
+
     r = ngx_http_alloc_request(c);
     if (r == NULL) {
         return 0;
@@ -1041,6 +1048,13 @@ ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
     ngx_http_free_request(r, 0);
     c->log->action = "SSL handshaking";
     c->destroyed = 0;
+
+#if (NGX_THREADS)
+    if (sscf->ssl.thread_pool) {
+        return ngx_ssl_handshake_offload(ssl_conn, &sscf->ssl);
+    }
+#endif
+
     return 1;
 
 failed:
@@ -19,6 +19,14 @@ static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_sparse_range(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_sparse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_sparse_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_parse_content_range(ngx_str_t *value,
+    off_t *start, off_t *end, off_t *length);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
@@ -39,6 +47,22 @@ static void ngx_http_upstream_connect(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_timer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_connect(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_read(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_adopt(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t state);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t do_write);
 static ngx_int_t ngx_http_upstream_send_request_body(ngx_http_request_t *r,
@@ -437,6 +461,17 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
 };
 
 
+/*
+ * the hedge budget is accounted per worker over a sliding window
+ * of the last NGX_HTTP_UPSTREAM_HEDGE_WINDOW hedgeable requests
+ */
+
+#define NGX_HTTP_UPSTREAM_HEDGE_WINDOW  1000
+
+static ngx_uint_t  ngx_http_upstream_hedge_requests;
+static ngx_uint_t  ngx_http_upstream_hedge_sent;
+
+
 static ngx_http_upstream_next_t  ngx_http_upstream_next_errors[] = {
     { 500, NGX_HTTP_UPSTREAM_FT_HTTP_500 },
     { 502, NGX_HTTP_UPSTREAM_FT_HTTP_502 },
@@ -816,6 +851,10 @@ found:
         u->peer.tries = u->conf->next_upstream_tries;
     }
 
+    if (u->conf->hedge_after) {
+        ngx_http_upstream_hedge_init(r, u);
+    }
+
     ngx_http_upstream_connect(r, u);
 }
 
@@ -878,6 +917,12 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->min_uses = u->conf->cache_min_uses;
         c->file_cache = cache;
 
+        if (u->conf->cache_sparse
+            && ngx_http_upstream_cache_sparse_range(r, u) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
         switch (ngx_http_test_predicates(r, u->conf->cache_bypass)) {
 
         case NGX_ERROR:
@@ -1085,12 +1130,24 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     rc = u->process_header(r);
 
+    if (rc == NGX_OK && c->sparse
+        && u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT)
+    {
+        rc = NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
     if (rc == NGX_OK) {
 
         if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
             return NGX_DONE;
         }
 
+        if (c->sparse
+            && ngx_http_upstream_cache_sparse_headers(r, u) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1138,6 +1195,235 @@ ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_sparse_range(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    off_t              start, end;
+    u_char            *p, *last;
+    ngx_str_t          val;
+    ngx_http_cache_t  *c;
+
+    if (ngx_http_complex_value(r, u->conf->cache_sparse, &val) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (val.len < 7
+        || ngx_strncasecmp(val.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return NGX_OK;
+    }
+
+    p = val.data + 6;
+    last = val.data + val.len;
+
+    p = ngx_strlchr(p, last, '-');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    start = ngx_atoof(val.data + 6, p - val.data - 6);
+    end = ngx_atoof(p + 1, last - p - 1);
+
+    if (start == NGX_ERROR || end == NGX_ERROR || end < start
+        || start % (end - start + 1))
+    {
+        goto invalid;
+    }
+
+    c = r->cache;
+
+    c->sparse_start = start;
+    c->sparse_size = end - start + 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache sparse: %O-%O", start, end);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "invalid sparse cache range \"%V\"", &val);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_cache_sparse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t              start, end, length;
+    ngx_str_t          name;
+    ngx_uint_t         i;
+    ngx_list_part_t   *part;
+    ngx_table_elt_t   *h, *cr;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    c->sparse = 0;
+
+    if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT) {
+
+        /*
+         * a full response is cached as usual, while a response
+         * to the range request cannot be cached under a key without it
+         */
+
+        if (u->headers_in.status_n == NGX_HTTP_RANGE_NOT_SATISFIABLE) {
+            u->cacheable = 0;
+        }
+
+        c->sparse_merge = 0;
+
+        return;
+    }
+
+    ngx_str_set(&name, "Content-Range");
+
+    cr = NULL;
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == name.len
+            && ngx_strncasecmp(h[i].key.data, name.data, name.len) == 0)
+        {
+            cr = &h[i];
+            break;
+        }
+    }
+
+    if (cr == NULL
+        || ngx_http_upstream_parse_content_range(&cr->value, &start, &end,
+                                                 &length)
+           != NGX_OK
+        || start != c->sparse_start
+        || end != ngx_min(start + c->sparse_size, length))
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "upstream sent unexpected range, "
+                      "the response is not cached");
+
+        u->cacheable = 0;
+        return;
+    }
+
+    if (c->sparse_merge
+        && (length != c->sparse_length
+            || u->headers_in.etag == NULL
+            || u->headers_in.etag->value.len != c->sparse_etag.len
+            || ngx_strncmp(u->headers_in.etag->value.data,
+                           c->sparse_etag.data, c->sparse_etag.len)
+               != 0))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream cache sparse changed");
+
+        c->sparse_merge = 0;
+    }
+
+    c->sparse = 1;
+    c->sparse_length = length;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_sparse_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    off_t              end;
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+    h = r->headers_out.content_range;
+
+    /*
+     * the header stored in a sparse cache file is one of the range
+     * received first, so Content-Range and Content-Length are rewritten
+     */
+
+    if (h == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has no range", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    end = ngx_min(c->sparse_start + c->sparse_size, c->sparse_length);
+
+    h->value.data = ngx_pnalloc(r->pool,
+                                sizeof("bytes -/") + 3 * NGX_OFF_T_LEN);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.len = ngx_sprintf(h->value.data, "bytes %O-%O/%O%Z",
+                               c->sparse_start, end - 1, c->sparse_length)
+                   - h->value.data - 1;
+
+    r->headers_out.content_length_n = end - c->sparse_start;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_parse_content_range(ngx_str_t *value, off_t *start,
+    off_t *end, off_t *length)
+{
+    u_char  *p, *dash, *slash, *last;
+
+    /* "bytes start-end/length" */
+
+    if (value->len < 6
+        || ngx_strncasecmp(value->data, (u_char *) "bytes ", 6) != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    p = value->data + 6;
+    last = value->data + value->len;
+
+    dash = ngx_strlchr(p, last, '-');
+    if (dash == NULL) {
+        return NGX_ERROR;
+    }
+
+    slash = ngx_strlchr(dash, last, '/');
+    if (slash == NULL) {
+        return NGX_ERROR;
+    }
+
+    *start = ngx_atoof(p, dash - p);
+    *end = ngx_atoof(dash + 1, slash - dash - 1);
+    *length = ngx_atoof(slash + 1, last - slash - 1);
+
+    if (*start == NGX_ERROR || *end == NGX_ERROR || *length == NGX_ERROR
+        || *start > *end || *end >= *length)
+    {
+        return NGX_ERROR;
+    }
+
+    (*end)++;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -1882,196 +2168,739 @@ ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
     p = name.data;
     last = name.data + name.len;
 
-    if (*p == '[') {
-        p = ngx_strlchr(p, last, ']');
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
+
+        if (p == NULL) {
+            p = name.data;
+        }
+    }
+
+    p = ngx_strlchr(p, last, ':');
+
+    if (p != NULL) {
+        name.len = p - name.data;
+    }
+
+    if (!u->conf->ssl_server_name) {
+        goto done;
+    }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (name.len == 0 || *name.data == '[') {
+        goto done;
+    }
+
+    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
+        goto done;
+    }
+
+    /*
+     * SSL_set_tlsext_host_name() needs a null-terminated string,
+     * hence we explicitly null-terminate name here
+     */
+
+    p = ngx_pnalloc(r->pool, name.len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(p, name.data, name.len + 1);
+
+    name.data = p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream SSL server name: \"%s\"", name.data);
+
+    if (SSL_set_tlsext_host_name(c->ssl->connection,
+                                 (char *) name.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
+        return NGX_ERROR;
+    }
+
+#endif
+
+done:
+
+    u->ssl_name = name;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_ssl_certificate(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
+{
+    ngx_str_t  cert, key;
+
+    if (ngx_http_complex_value(r, u->conf->ssl_certificate, &cert)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream ssl cert: \"%s\"", cert.data);
+
+    if (*cert.data == '\0') {
+        return NGX_OK;
+    }
+
+    if (ngx_http_complex_value(r, u->conf->ssl_certificate_key, &key)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream ssl key: \"%s\"", key.data);
+
+    if (ngx_ssl_connection_certificate(c, r->pool, &cert, &key,
+                                       u->conf->ssl_passwords)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t         file_pos;
+    ngx_chain_t  *cl;
+
+    if (u->reinit_request(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->keepalive = 0;
+    u->upgrade = 0;
+    u->error = 0;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* reinit the request chain */
+
+    file_pos = 0;
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+
+        /* there is at most one file */
+
+        if (cl->buf->in_file) {
+            cl->buf->file_pos = file_pos;
+            file_pos = cl->buf->file_last;
+        }
+    }
+
+    /* reinit the subrequest's ngx_output_chain() context */
+
+    if (r->request_body && r->request_body->temp_file
+        && r != r->main && u->output.buf)
+    {
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
+            return NGX_ERROR;
+        }
+
+        u->output.free->buf = u->output.buf;
+        u->output.free->next = NULL;
+
+        u->output.buf->pos = u->output.buf->start;
+        u->output.buf->last = u->output.buf->start;
+    }
+
+    u->output.buf = NULL;
+    u->output.in = NULL;
+    u->output.busy = NULL;
+
+    /* reinit u->buffer */
+
+    u->buffer.pos = u->buffer.start;
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        u->buffer.pos += r->cache->header_start;
+    }
+
+#endif
+
+    u->buffer.last = u->buffer.pos;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_hedge_t  *hedge;
+
+    /* only idempotent requests without body are hedged */
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || (r->request_body && r->request_body->bufs)
+        || r->request_body_no_buffering
+#if (NGX_HTTP_SSL)
+        || u->ssl
+#endif
+       )
+    {
+        return;
+    }
+
+    if (++ngx_http_upstream_hedge_requests > NGX_HTTP_UPSTREAM_HEDGE_WINDOW) {
+        ngx_http_upstream_hedge_requests /= 2;
+        ngx_http_upstream_hedge_sent /= 2;
+    }
+
+    hedge = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedge_t));
+    if (hedge == NULL) {
+        return;
+    }
+
+    hedge->timer.handler = ngx_http_upstream_hedge_timer_handler;
+    hedge->timer.data = r;
+    hedge->timer.log = r->connection->log;
+
+    ngx_add_timer(&hedge->timer, u->conf->hedge_after);
+
+    u->hedge = hedge;
+}
+
+
+static void
+ngx_http_upstream_hedge_timer_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge timer: \"%V?%V\"", &r->uri, &r->args);
+
+    ngx_http_upstream_hedge_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t                      size;
+    ngx_int_t                   rc;
+    ngx_chain_t                *cl;
+    ngx_connection_t           *c;
+    ngx_peer_connection_t       peer;
+    ngx_http_upstream_hedge_t  *hedge;
+
+    hedge = u->hedge;
+
+    if (u->peer.connection == NULL) {
+        ngx_http_upstream_hedge_close(r, u, 0);
+        return;
+    }
+
+    if (ngx_http_upstream_hedge_sent * 100
+        >= ngx_http_upstream_hedge_requests * u->conf->hedge_budget)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream hedge budget exhausted");
+
+        ngx_http_upstream_hedge_close(r, u, 0);
+        return;
+    }
+
+    /* the request is copied as u->request_bufs are consumed by sending */
+
+    size = 0;
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+
+        if (cl->buf->in_file) {
+            ngx_http_upstream_hedge_close(r, u, 0);
+            return;
+        }
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        size += cl->buf->last - cl->buf->start;
+    }
+
+    hedge->request = ngx_create_temp_buf(r->pool, size);
+    if (hedge->request == NULL) {
+        ngx_http_upstream_hedge_close(r, u, 0);
+        return;
+    }
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        hedge->request->last = ngx_cpymem(hedge->request->last,
+                                          cl->buf->start,
+                                          cl->buf->last - cl->buf->start);
+    }
+
+    /*
+     * the hedged request uses its own balancer data,
+     * so both requests can be accounted independently
+     */
+
+    peer = u->peer;
+    u->peer.data = NULL;
+
+    rc = u->upstream->peer.init(r, u->upstream);
+
+    hedge->peer = u->peer;
+    u->peer = peer;
+
+    if (rc != NGX_OK) {
+        ngx_memzero(&hedge->peer, sizeof(ngx_peer_connection_t));
+        ngx_http_upstream_hedge_close(r, u, 0);
+        return;
+    }
+
+    hedge->peer.sockaddr = NULL;
+    hedge->peer.connection = NULL;
+    hedge->peer.cached = 0;
+    hedge->peer.tries = 2;
+
+    hedge->start_time = ngx_current_msec;
+    hedge->connect_time = (ngx_msec_t) -1;
+
+    /* the balancer is wrapped to exclude the peer of the original request */
+
+    hedge->data = hedge->peer.data;
+    hedge->get = hedge->peer.get;
+
+    hedge->peer.data = u;
+    hedge->peer.get = ngx_http_upstream_hedge_get_peer;
+
+    rc = ngx_event_connect_peer(&hedge->peer);
+
+    hedge->peer.data = hedge->data;
+    hedge->peer.get = hedge->get;
+    hedge->peer.tries = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge connect: %i", rc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hedge_close(r, u,
+                                      rc == NGX_DECLINED ? NGX_PEER_FAILED : 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    ngx_http_upstream_hedge_sent++;
+
+    c = hedge->peer.connection;
+
+    c->requests++;
+
+    c->data = r;
+
+    c->write->handler = ngx_http_upstream_hedge_handler;
+    c->read->handler = ngx_http_upstream_hedge_handler;
+
+    if (c->pool == NULL) {
+
+        c->pool = ngx_create_pool(128, r->connection->log);
+        if (c->pool == NULL) {
+            ngx_http_upstream_hedge_close(r, u, 0);
+            return;
+        }
+    }
+
+    c->log = r->connection->log;
+    c->pool->log = c->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->connect_timeout);
+        return;
+    }
+
+    ngx_http_upstream_hedge_send(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_t *u = data;
+
+    ngx_int_t                   rc;
+    ngx_uint_t                  i;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *hedge;
+
+    hedge = u->hedge;
+
+    /*
+     * with hash balancing or a single server the same peer is usually
+     * selected again; the hedge is only sent if another one is found
+     */
+
+    for (i = 0; i < 2; i++) {
+
+        rc = hedge->get(pc, hedge->data);
+
+        if (rc != NGX_OK && rc != NGX_DONE) {
+            return rc;
+        }
+
+        if (ngx_cmp_sockaddr(pc->sockaddr, pc->socklen,
+                             u->peer.sockaddr, u->peer.socklen, 1)
+            != NGX_OK)
+        {
+            return rc;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "http upstream hedge skips original peer \"%V\"",
+                       pc->name);
+
+        hedge->peer.free(pc, hedge->data, 0);
+        pc->sockaddr = NULL;
+
+        c = pc->connection;
+
+        if (c) {
+            if (c->pool) {
+                ngx_destroy_pool(c->pool);
+            }
+
+            ngx_close_connection(c);
+            pc->connection = NULL;
+        }
+    }
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    c = ev->data;
+    r = c->data;
+
+    u = r->upstream;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge request: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (ev->write) {
+        ngx_http_upstream_hedge_send(r, u);
+
+    } else {
+        ngx_http_upstream_hedge_read(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ssize_t                     n;
+    ngx_buf_t                  *b;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *hedge;
+
+    hedge = u->hedge;
+    c = hedge->peer.connection;
+    b = hedge->request;
+
+    if (hedge->sent) {
+        return;
+    }
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while sending hedged request");
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
+    }
+
+    if (hedge->connect_time == (ngx_msec_t) -1) {
+
+        if (ngx_http_upstream_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+            return;
+        }
+
+        hedge->connect_time = ngx_current_msec - hedge->start_time;
+    }
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
+
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_http_upstream_hedge_close(r, u, 0);
+            }
 
-        if (p == NULL) {
-            p = name.data;
+            return;
         }
+
+        b->pos += n;
     }
 
-    p = ngx_strlchr(p, last, ':');
+    hedge->sent = 1;
 
-    if (p != NULL) {
-        name.len = p - name.data;
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
     }
 
-    if (!u->conf->ssl_server_name) {
-        goto done;
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_hedge_read(r, u);
+        return;
     }
 
-#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hedge_close(r, u, 0);
+    }
+}
 
-    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
 
-    if (name.len == 0 || *name.data == '[') {
-        goto done;
+static void
+ngx_http_upstream_hedge_read(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    int                         n;
+    char                        buf[1];
+    ngx_err_t                   err;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *hedge;
+
+    hedge = u->hedge;
+    c = hedge->peer.connection;
+
+    if (c->read->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while reading hedged response");
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
     }
 
-    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
-        goto done;
+    if (!hedge->sent) {
+        return;
     }
 
-    /*
-     * SSL_set_tlsext_host_name() needs a null-terminated string,
-     * hence we explicitly null-terminate name here
-     */
+    n = recv(c->fd, buf, 1, MSG_PEEK);
 
-    p = ngx_pnalloc(r->pool, name.len + 1);
-    if (p == NULL) {
-        return NGX_ERROR;
-    }
+    err = ngx_socket_errno;
 
-    (void) ngx_cpystrn(p, name.data, name.len + 1);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, err,
+                   "http upstream hedge recv(): %d", n);
 
-    name.data = p;
+    if (n == -1 && err == NGX_EAGAIN) {
+        c->read->ready = 0;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "upstream SSL server name: \"%s\"", name.data);
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            ngx_http_upstream_hedge_close(r, u, 0);
+        }
 
-    if (SSL_set_tlsext_host_name(c->ssl->connection,
-                                 (char *) name.data)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
-        return NGX_ERROR;
+        return;
     }
 
-#endif
+    if (n == 0) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream prematurely closed hedged connection");
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
+    }
 
-done:
+    if (n == -1) {
+        ngx_connection_error(c, err, "recv() failed on hedged connection");
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
+    }
 
-    u->ssl_name = name;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedged request won");
 
-    return NGX_OK;
+    ngx_http_upstream_hedge_adopt(r, u);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_ssl_certificate(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_connection_t *c)
+static void
+ngx_http_upstream_hedge_adopt(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_str_t  cert, key;
+    ngx_msec_t                  start_time;
+    ngx_uint_t                  tries;
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *hedge;
 
-    if (ngx_http_complex_value(r, u->conf->ssl_certificate, &cert)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
+    hedge = u->hedge;
+    u->hedge = NULL;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream ssl cert: \"%s\"", cert.data);
+    /* cancel the original request, if it is still in progress */
 
-    if (*cert.data == '\0') {
-        return NGX_OK;
+    if (u->peer.connection) {
+        u->state->bytes_sent = u->peer.connection->sent;
     }
 
-    if (ngx_http_complex_value(r, u->conf->ssl_certificate_key, &key)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, 0);
+        u->peer.sockaddr = NULL;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream ssl key: \"%s\"", key.data);
-
-    if (ngx_ssl_connection_certificate(c, r->pool, &cert, &key,
-                                       u->conf->ssl_passwords)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (u->state->response_time == (ngx_msec_t) -1) {
+        u->state->response_time = ngx_current_msec - u->start_time;
     }
 
-    return NGX_OK;
-}
-
-#endif
-
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close http upstream connection: %d",
+                       u->peer.connection->fd);
 
-static ngx_int_t
-ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    off_t         file_pos;
-    ngx_chain_t  *cl;
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
 
-    if (u->reinit_request(r) != NGX_OK) {
-        return NGX_ERROR;
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
     }
 
-    u->keepalive = 0;
-    u->upgrade = 0;
-    u->error = 0;
+    tries = u->peer.tries;
+    start_time = u->peer.start_time;
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
-    u->headers_in.content_length_n = -1;
-    u->headers_in.last_modified_time = -1;
+    u->peer = hedge->peer;
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
+    u->peer.tries = ngx_max(tries, 1);
+    u->peer.start_time = start_time;
 
-    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
     }
 
-    /* reinit the request chain */
+    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
 
-    file_pos = 0;
+    u->start_time = hedge->start_time;
 
-    for (cl = u->request_bufs; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
+    u->state->response_time = (ngx_msec_t) -1;
+    u->state->connect_time = hedge->connect_time;
+    u->state->header_time = (ngx_msec_t) -1;
+    u->state->peer = u->peer.name;
 
-        /* there is at most one file */
+    c = u->peer.connection;
 
-        if (cl->buf->in_file) {
-            cl->buf->file_pos = file_pos;
-            file_pos = cl->buf->file_last;
-        }
-    }
+    c->write->handler = ngx_http_upstream_handler;
+    c->read->handler = ngx_http_upstream_handler;
 
-    /* reinit the subrequest's ngx_output_chain() context */
+    u->writer.out = NULL;
+    u->writer.last = &u->writer.out;
+    u->writer.connection = c;
 
-    if (r->request_body && r->request_body->temp_file
-        && r != r->main && u->output.buf)
-    {
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            return NGX_ERROR;
-        }
+    u->request_sent = 1;
+    u->request_body_sent = 1;
+    u->request_body_blocked = 0;
 
-        u->output.free->buf = u->output.buf;
-        u->output.free->next = NULL;
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
 
-        u->output.buf->pos = u->output.buf->start;
-        u->output.buf->last = u->output.buf->start;
-    }
+    ngx_http_upstream_process_header(r, u);
+}
 
-    u->output.buf = NULL;
-    u->output.in = NULL;
-    u->output.busy = NULL;
 
-    /* reinit u->buffer */
+static void
+ngx_http_upstream_hedge_close(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_hedge_t  *hedge;
 
-    u->buffer.pos = u->buffer.start;
+    hedge = u->hedge;
+    u->hedge = NULL;
 
-#if (NGX_HTTP_CACHE)
+    if (hedge->timer.timer_set) {
+        ngx_del_timer(&hedge->timer);
+    }
 
-    if (r->cache) {
-        u->buffer.pos += r->cache->header_start;
+    if (hedge->peer.sockaddr) {
+        hedge->peer.free(&hedge->peer, hedge->peer.data, state);
+        hedge->peer.sockaddr = NULL;
     }
 
-#endif
+    if (hedge->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close hedged upstream connection: %d",
+                       hedge->peer.connection->fd);
 
-    u->buffer.last = u->buffer.pos;
+        if (hedge->peer.connection->pool) {
+            ngx_destroy_pool(hedge->peer.connection->pool);
+        }
 
-    return NGX_OK;
+        ngx_close_connection(hedge->peer.connection);
+        hedge->peer.connection = NULL;
+    }
 }
 
 
@@ -2465,6 +3294,10 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n;
 
+        if (u->hedge) {
+            ngx_http_upstream_hedge_close(r, u, 0);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -3165,6 +3998,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         break;
     }
 
+    if (u->cacheable && r->cache->sparse_size) {
+        ngx_http_upstream_cache_sparse(r, u);
+    }
+
     if (u->cacheable) {
         time_t  now, valid;
 
@@ -4190,6 +5027,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else {
+                ngx_http_file_cache_fill(r, p->temp_file);
             }
         }
 
@@ -4399,6 +5239,16 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     u->state->status = status;
 
+    if (u->hedge && u->hedge->peer.connection) {
+
+        if (u->hedge->sent) {
+            ngx_http_upstream_hedge_adopt(r, u);
+            return;
+        }
+
+        ngx_http_upstream_hedge_close(r, u, 0);
+    }
+
     timeout = u->conf->next_upstream_timeout;
 
     if (u->request_sent
@@ -4502,6 +5352,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->hedge) {
+        ngx_http_upstream_hedge_close(r, u, 0);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -6040,6 +6894,9 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
     ngx_http_module_t             *module;
     ngx_http_conf_ctx_t           *ctx, *http_ctx;
     ngx_http_upstream_srv_conf_t  *uscf;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_core_loc_conf_t      *clcf;
+#endif
 
     ngx_memzero(&u, sizeof(ngx_url_t));
 
@@ -6140,6 +6997,17 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /* the resolver used for "server ... resolve", inherited if not set */
+
+    clcf = ctx->loc_conf[ngx_http_core_module.ctx_index];
+
+    uscf->resolver = clcf->resolver;
+    uscf->resolver_timeout = clcf->resolver_timeout;
+
+#endif
+
     return rv;
 }
 
@@ -6155,6 +7023,10 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_int_t                    weight, max_conns, max_fails;
     ngx_uint_t                   i;
     ngx_http_upstream_server_t  *us;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_str_t                    service;
+    ngx_uint_t                   resolve;
+#endif
 
     us = ngx_array_push(uscf->servers);
     if (us == NULL) {
@@ -6170,6 +7042,11 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_fails = 1;
     fail_timeout = 10;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_str_null(&service);
+    resolve = 0;
+#endif
+
     for (i = 2; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "weight=", 7) == 0) {
@@ -6257,6 +7134,27 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            service.len = value[i].len - 8;
+            service.data = &value[i].data[8];
+
+            if (service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+#endif
+
         goto invalid;
     }
 
@@ -6265,6 +7163,19 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u.url = value[1];
     u.default_port = 80;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (service.len && !resolve) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "service upstream \"%V\" requires "
+                           "\"resolve\" parameter", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    u.no_resolve = resolve;
+
+#endif
+
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -6274,6 +7185,26 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /* names are resolved at run time, addresses are used as is */
+
+    if (resolve && u.naddrs == 0) {
+
+        if (service.len && !u.no_port) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" may not have port",
+                               &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        us->host = u.host;
+        us->service = service;
+        us->port = u.port;
+    }
+
+#endif
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -6765,11 +7696,25 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
     ngx_http_upstream_init_pt       init;
     ngx_http_upstream_header_t     *header;
     ngx_http_upstream_srv_conf_t  **uscfp;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_core_loc_conf_t       *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+#endif
 
     uscfp = umcf->upstreams.elts;
 
     for (i = 0; i < umcf->upstreams.nelts; i++) {
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (uscfp[i]->resolver == NULL) {
+            uscfp[i]->resolver = clcf->resolver;
+        }
+
+        ngx_conf_merge_msec_value(uscfp[i]->resolver_timeout,
+                                  clcf->resolver_timeout, 30000);
+#endif
+
         init = uscfp[i]->peer.init_upstream ? uscfp[i]->peer.init_upstream:
                                             ngx_http_upstream_init_round_robin;
 
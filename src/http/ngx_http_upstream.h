@@ -102,6 +102,12 @@ typedef struct {
     ngx_msec_t                       slow_start;
     ngx_uint_t                       down;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_str_t                        host;
+    ngx_str_t                        service;
+    in_port_t                        port;
+#endif
+
     unsigned                         backup:1;
 
     NGX_COMPAT_BEGIN(6)
@@ -133,6 +139,8 @@ struct ngx_http_upstream_srv_conf_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
 #endif
 };
 
@@ -153,6 +161,7 @@ typedef struct {
     ngx_msec_t                       send_timeout;
     ngx_msec_t                       read_timeout;
     ngx_msec_t                       next_upstream_timeout;
+    ngx_msec_t                       hedge_after;
 
     size_t                           send_lowat;
     size_t                           buffer_size;
@@ -172,6 +181,7 @@ typedef struct {
     ngx_uint_t                       next_upstream;
     ngx_uint_t                       store_access;
     ngx_uint_t                       next_upstream_tries;
+    ngx_uint_t                       hedge_budget;
     ngx_flag_t                       buffering;
     ngx_flag_t                       request_buffering;
     ngx_flag_t                       pass_request_headers;
@@ -200,6 +210,7 @@ typedef struct {
     ngx_uint_t                       cache_methods;
 
     off_t                            cache_max_range_offset;
+    ngx_http_complex_value_t        *cache_sparse;
 
     ngx_flag_t                       cache_lock;
     ngx_msec_t                       cache_lock_timeout;
@@ -314,6 +325,22 @@ typedef struct {
 } ngx_http_upstream_resolved_t;
 
 
+typedef struct {
+    ngx_peer_connection_t            peer;
+    ngx_event_t                      timer;
+
+    void                            *data;
+    ngx_event_get_peer_pt            get;
+
+    ngx_buf_t                       *request;
+
+    ngx_msec_t                       start_time;
+    ngx_msec_t                       connect_time;
+
+    unsigned                         sent:1;
+} ngx_http_upstream_hedge_t;
+
+
 typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
@@ -340,6 +367,7 @@ struct ngx_http_upstream_s {
     ngx_http_upstream_headers_in_t   headers_in;
 
     ngx_http_upstream_resolved_t    *resolved;
+    ngx_http_upstream_hedge_t       *hedge;
 
     ngx_buf_t                        from_client;
 
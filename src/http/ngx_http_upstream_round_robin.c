@@ -17,6 +17,21 @@
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+static ngx_int_t ngx_http_upstream_init_resolve_peers(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t backup);
+static ngx_http_upstream_rr_peers_t *ngx_http_upstream_view_peers(
+    ngx_pool_t *pool, ngx_http_upstream_rr_peers_t *shared,
+    ngx_http_upstream_rr_peers_t *prev);
+static ngx_uint_t *ngx_http_upstream_round_robin_shard_conns(
+    ngx_http_upstream_rr_shard_t *shard, ngx_uint_t slot);
+static void ngx_http_upstream_sync_round_robin_peers(
+    ngx_http_upstream_rr_peers_t *peers);
+static void ngx_http_upstream_merge_round_robin_peers(
+    ngx_http_upstream_rr_peers_t *peers);
+#endif
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t ngx_http_upstream_empty_set_session(ngx_peer_connection_t *pc,
@@ -32,7 +47,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n, w, t;
+    ngx_uint_t                     i, j, n, r, w, t;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
@@ -43,6 +58,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         server = us->servers->elts;
 
         n = 0;
+        r = 0;
         w = 0;
         t = 0;
 
@@ -51,6 +67,13 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 continue;
             }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            if (server[i].host.len) {
+                r++;
+                continue;
+            }
+#endif
+
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
 
@@ -59,7 +82,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             }
         }
 
-        if (n == 0) {
+        if (n + r == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no servers in upstream \"%V\" in %s:%ui",
                           &us->host, us->file_name, us->line);
@@ -83,6 +106,14 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         peers->tries = t;
         peers->name = &us->host;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (r && ngx_http_upstream_init_resolve_peers(cf, us, peers, 0)
+                 != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+#endif
+
         n = 0;
         peerp = &peers->peer;
 
@@ -115,6 +146,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         /* backup servers */
 
         n = 0;
+        r = 0;
         w = 0;
         t = 0;
 
@@ -123,6 +155,13 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 continue;
             }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            if (server[i].host.len) {
+                r++;
+                continue;
+            }
+#endif
+
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
 
@@ -131,7 +170,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             }
         }
 
-        if (n == 0) {
+        if (n + r == 0) {
             return NGX_OK;
         }
 
@@ -153,6 +192,14 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         backup->tries = t;
         backup->name = &us->host;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (r && ngx_http_upstream_init_resolve_peers(cf, us, backup, 1)
+                 != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+#endif
+
         n = 0;
         peerp = &backup->peer;
 
@@ -253,12 +300,90 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 }
 
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+static ngx_int_t
+ngx_http_upstream_init_resolve_peers(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t backup)
+{
+    ngx_uint_t                     i;
+    ngx_http_upstream_host_t      *host;
+    ngx_http_upstream_server_t    *server;
+    ngx_http_upstream_rr_peer_t   *peer, **peerp;
+
+    if (us->shm_zone == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "resolving names at run time requires "
+                      "upstream \"%V\" in %s:%ui to be in shared memory",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    if (us->resolver == NULL || us->resolver->connections.nelts == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no resolver defined to resolve names at run time "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    /*
+     * such servers are kept as templates, peers are added by
+     * the zone module once the names are resolved
+     */
+
+    server = us->servers->elts;
+    peerp = &peers->resolve;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        if (server[i].host.len == 0 || server[i].backup != backup) {
+            continue;
+        }
+
+        peer = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_rr_peer_t));
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        host = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_host_t));
+        if (host == NULL) {
+            return NGX_ERROR;
+        }
+
+        host->name = server[i].host;
+        host->service = server[i].service;
+        host->port = server[i].port;
+
+        peer->weight = server[i].weight;
+        peer->effective_weight = server[i].weight;
+        peer->max_conns = server[i].max_conns;
+        peer->max_fails = server[i].max_fails;
+        peer->fail_timeout = server[i].fail_timeout;
+        peer->down = server[i].down;
+        peer->server = server[i].name;
+        peer->host = host;
+
+        *peerp = peer;
+        peerp = &peer->next;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_uint_t                         n;
     ngx_http_upstream_rr_peer_data_t  *rrp;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_upstream_rr_peers_t      *peers, *view;
+#endif
 
     rrp = r->upstream->peer.data;
 
@@ -271,6 +396,43 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
         r->upstream->peer.data = rrp;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    peers = us->peer.data;
+
+    if (peers->shared) {
+
+        if (peers->version != peers->shared->version) {
+            view = ngx_http_upstream_create_round_robin_view(peers->shared,
+                                                peers, r->connection->log);
+            if (view == NULL) {
+                return NGX_ERROR;
+            }
+
+            us->peer.data = view;
+
+            ngx_http_upstream_release_round_robin_view(peers);
+
+            peers = view;
+        }
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_upstream_release_round_robin_view;
+        cln->data = peers;
+
+        peers->refs++;
+
+        ngx_http_upstream_sync_round_robin_peers(peers);
+
+        if (peers->next) {
+            ngx_http_upstream_sync_round_robin_peers(peers->next);
+        }
+    }
+#endif
+
     rrp->peers = us->peer.data;
     rrp->current = NULL;
     rrp->config = 0;
@@ -602,8 +764,11 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    time_t                       now;
+    time_t                        now;
     ngx_http_upstream_rr_peer_t  *peer;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_rr_peer_t  *shared;
+#endif
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
@@ -622,6 +787,12 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
         ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (rrp->peers->shared) {
+            ngx_http_upstream_sync_round_robin_peers(rrp->peers);
+        }
+#endif
+
         pc->tries = 0;
         return;
     }
@@ -633,6 +804,20 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         peer->accessed = now;
         peer->checked = now;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (rrp->peers->shared) {
+
+            /* failures are rare, so they are written through at once */
+
+            shared = peer->shared;
+
+            peer->fails = ngx_atomic_fetch_add(
+                                     (ngx_atomic_t *) &shared->fails, 1) + 1;
+            shared->accessed = now;
+            shared->checked = now;
+        }
+#endif
+
         if (peer->max_fails) {
             peer->effective_weight -= peer->weight / peer->max_fails;
 
@@ -656,6 +841,12 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
         if (peer->accessed < peer->checked) {
             peer->fails = 0;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            if (rrp->peers->shared) {
+                peer->shared->fails = 0;
+            }
+#endif
         }
     }
 
@@ -664,12 +855,334 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
     ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (rrp->peers->shared) {
+        ngx_http_upstream_sync_round_robin_peers(rrp->peers);
+    }
+#endif
+
     if (pc->tries) {
         pc->tries--;
     }
 }
 
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_create_round_robin_view(
+    ngx_http_upstream_rr_peers_t *shared, ngx_http_upstream_rr_peers_t *prev,
+    ngx_log_t *log)
+{
+    ngx_pool_t                    *pool;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers, *backup;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(shared);
+
+    peers = ngx_http_upstream_view_peers(pool, shared, prev);
+    if (peers == NULL) {
+        goto failed;
+    }
+
+    if (shared->next) {
+        backup = ngx_http_upstream_view_peers(pool, shared->next,
+                                              prev ? prev->next : NULL);
+        if (backup == NULL) {
+            goto failed;
+        }
+
+        peers->next = backup;
+    }
+
+    /* the shared peers cannot be freed while the view uses them */
+
+    for (backup = peers; backup; backup = backup->next) {
+        for (peer = backup->peer; peer; peer = peer->next) {
+            (void) ngx_atomic_fetch_add(&peer->shared->refs, 1);
+        }
+    }
+
+    peers->version = shared->version;
+
+    ngx_http_upstream_rr_peers_unlock(shared);
+
+    peers->refs = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "upstream \"%V\" view version %uA",
+                   peers->name, peers->version);
+
+    return peers;
+
+failed:
+
+    ngx_http_upstream_rr_peers_unlock(shared);
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_view_peers(ngx_pool_t *pool,
+    ngx_http_upstream_rr_peers_t *shared, ngx_http_upstream_rr_peers_t *prev)
+{
+    size_t                          size;
+    ngx_uint_t                      n;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_upstream_rr_peer_t    *peer, *src, *old, **peerp;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_shard_t   *shard, *more;
+
+    peers = ngx_palloc(pool, sizeof(ngx_http_upstream_rr_peers_t));
+    if (peers == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(peers, shared, sizeof(ngx_http_upstream_rr_peers_t));
+
+    peers->shpool = NULL;
+    peers->retired = NULL;
+    peers->shared = shared;
+    peers->synced = 0;
+    peers->refs = 0;
+    peers->pool = pool;
+    peers->next = NULL;
+
+    peer = ngx_palloc(pool,
+                      sizeof(ngx_http_upstream_rr_peer_t) * peers->number);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    peerp = &peers->peer;
+
+    for (src = shared->peer, n = 0; src; src = src->next, n++) {
+        ngx_memcpy(&peer[n], src, sizeof(ngx_http_upstream_rr_peer_t));
+
+        peer[n].shared = src;
+        peer[n].conns = 0;
+        peer[n].synced_conns = 0;
+
+        if (src->drain) {
+            peer[n].down = 1;
+        }
+
+        /* keep the balancing state of the peers already known */
+
+        for (old = prev ? prev->peer : NULL; old; old = old->next) {
+            if (old->shared == src) {
+                peer[n].current_weight = old->current_weight;
+                peer[n].effective_weight = ngx_min(old->effective_weight,
+                                                   src->weight);
+                break;
+            }
+        }
+
+        *peerp = &peer[n];
+        peerp = &peer[n].next;
+    }
+
+    if (prev) {
+        peers->shards = prev->shards;
+        return peers;
+    }
+
+    /*
+     * each worker counts connections in a shard of its own; the shard
+     * of a respawned worker is reused, as the connections it counted
+     * are gone along with the process
+     */
+
+    shpool = shared->shpool;
+
+    n = ngx_max(shared->slots, 1);
+
+    size = offsetof(ngx_http_upstream_rr_shard_t, conns)
+           + n * sizeof(ngx_uint_t);
+
+    if (size < ngx_cacheline_size) {
+        size = ngx_cacheline_size;
+        n = (size - offsetof(ngx_http_upstream_rr_shard_t, conns))
+            / sizeof(ngx_uint_t);
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (shard = shared->shards; shard; shard = shard->next) {
+        if (shard->worker == ngx_worker) {
+            for (more = shard; more; more = more->more) {
+                ngx_memzero(more->conns, more->nslots * sizeof(ngx_uint_t));
+            }
+
+            break;
+        }
+    }
+
+    if (shard == NULL) {
+        shard = ngx_slab_calloc_locked(shpool, size);
+        if (shard == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return NULL;
+        }
+
+        shard->worker = ngx_worker;
+        shard->nslots = n;
+        shard->next = shared->shards;
+
+        ngx_memory_barrier();
+
+        shared->shards = shard;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    peers->shards = shard;
+
+    return peers;
+}
+
+
+static ngx_uint_t *
+ngx_http_upstream_round_robin_shard_conns(ngx_http_upstream_rr_shard_t *shard,
+    ngx_uint_t slot)
+{
+    for ( /* void */ ; shard; shard = shard->more) {
+        if (slot < shard->base + shard->nslots) {
+            return &shard->conns[slot - shard->base];
+        }
+    }
+
+    return NULL;
+}
+
+
+void
+ngx_http_upstream_release_round_robin_view(void *data)
+{
+    ngx_http_upstream_rr_peers_t  *view = data;
+
+    ngx_uint_t                     reap;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (--view->refs) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "upstream \"%V\" view version %uA released",
+                   view->name, view->version);
+
+    reap = 0;
+
+    for (peers = view; peers; peers = peers->next) {
+        ngx_http_upstream_merge_round_robin_peers(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (ngx_atomic_fetch_add(&peer->shared->refs, -1) == 1
+                && peers->shared->retired)
+            {
+                reap = 1;
+            }
+        }
+    }
+
+    /*
+     * a peer removed while referenced is freed by whoever drops
+     * the last reference: either here, or on the next update
+     */
+
+    if (reap) {
+        peers = view->shared;
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+
+        for ( /* void */ ; peers; peers = peers->next) {
+            ngx_http_upstream_zone_reap_peers(peers);
+        }
+
+        ngx_http_upstream_rr_peers_unlock(view->shared);
+    }
+
+    ngx_destroy_pool(view->pool);
+}
+
+
+ngx_uint_t
+ngx_http_upstream_round_robin_peer_conns(ngx_http_upstream_rr_peers_t *shared,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t                    *p, conns;
+    ngx_http_upstream_rr_shard_t  *shard;
+
+    conns = 0;
+
+    for (shard = shared->shards; shard; shard = shard->next) {
+        p = ngx_http_upstream_round_robin_shard_conns(shard, peer->slot);
+        conns += *p;
+    }
+
+    return conns;
+}
+
+
+static void
+ngx_http_upstream_sync_round_robin_peers(ngx_http_upstream_rr_peers_t *peers)
+{
+    if (peers->synced == ngx_current_msec) {
+        return;
+    }
+
+    peers->synced = ngx_current_msec;
+
+    ngx_http_upstream_merge_round_robin_peers(peers);
+}
+
+
+static void
+ngx_http_upstream_merge_round_robin_peers(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                   *p, conns;
+    ngx_http_upstream_rr_peer_t  *peer, *shared;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        shared = peer->shared;
+
+        /* publish the connections made since the last sync */
+
+        p = ngx_http_upstream_round_robin_shard_conns(peers->shards,
+                                                      shared->slot);
+        *p += peer->conns - peer->synced_conns;
+
+        conns = ngx_http_upstream_round_robin_peer_conns(peers->shared,
+                                                         shared);
+
+        peer->conns = conns;
+        peer->synced_conns = conns;
+
+        peer->fails = shared->fails;
+        peer->accessed = shared->accessed;
+
+        if (peer->checked > shared->checked) {
+            shared->checked = peer->checked;
+
+        } else {
+            peer->checked = shared->checked;
+        }
+    }
+}
+
+#endif
+
+
 #if (NGX_HTTP_SSL)
 
 ngx_int_t
@@ -693,7 +1206,10 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
 #if (NGX_HTTP_UPSTREAM_ZONE)
     peers = rrp->peers;
 
-    if (peers->shpool) {
+    if (peers->shared) {
+        peers = peers->shared;
+        peer = peer->shared;
+
         ngx_http_upstream_rr_peers_rlock(peers);
         ngx_http_upstream_rr_peer_lock(peers, peer);
 
@@ -753,7 +1269,8 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
 #if (NGX_HTTP_UPSTREAM_ZONE)
     peers = rrp->peers;
 
-    if (peers->shpool) {
+    if (peers->shared) {
+        peers = peers->shared;
 
         ssl_session = ngx_ssl_get0_session(pc->connection);
 
@@ -775,7 +1292,7 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
         p = buf;
         (void) i2d_SSL_SESSION(ssl_session, &p);
 
-        peer = rrp->current;
+        peer = rrp->current->shared;
 
         ngx_http_upstream_rr_peers_rlock(peers);
         ngx_http_upstream_rr_peer_lock(peers, peer);
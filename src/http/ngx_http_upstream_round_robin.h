@@ -15,6 +15,15 @@
 
 
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
+typedef struct ngx_http_upstream_rr_shard_s  ngx_http_upstream_rr_shard_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    ngx_str_t                       service;
+    in_port_t                       port;
+} ngx_http_upstream_host_t;
+
 
 struct ngx_http_upstream_rr_peer_s {
     struct sockaddr                *sockaddr;
@@ -47,6 +56,12 @@ struct ngx_http_upstream_rr_peer_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_atomic_t                    lock;
+    ngx_atomic_t                    refs;
+    ngx_uint_t                      slot;
+    ngx_uint_t                      drain;
+    ngx_http_upstream_rr_peer_t    *shared;
+    ngx_uint_t                      synced_conns;
+    ngx_http_upstream_host_t       *host;
 #endif
 
     ngx_http_upstream_rr_peer_t    *next;
@@ -65,6 +80,16 @@ struct ngx_http_upstream_rr_peers_s {
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
     ngx_http_upstream_rr_peers_t   *zone_next;
+    ngx_atomic_t                    version;
+    ngx_uint_t                      slots;
+    ngx_http_upstream_rr_peer_t    *retired;
+    ngx_http_upstream_rr_peer_t    *resolve;
+
+    ngx_http_upstream_rr_peers_t   *shared;
+    ngx_http_upstream_rr_shard_t   *shards;
+    ngx_msec_t                      synced;
+    ngx_uint_t                      refs;
+    ngx_pool_t                     *pool;
 #endif
 
     ngx_uint_t                      total_weight;
@@ -83,6 +108,37 @@ struct ngx_http_upstream_rr_peers_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
 
+/*
+ * A worker never selects peers from the shared memory copy directly:
+ * it uses a private view of it, with the "shared" pointers referring
+ * to the shared peers.  The view has no shpool, so the locks below
+ * are not taken.  Connection counts are kept in per-worker shards,
+ * indexed by the peer slot, and summed, along with the failure state,
+ * at most once a millisecond.
+ *
+ * The shared peers are changed under the write lock, with the version
+ * of the primary peers incremented; a worker then builds a new view.
+ * Views are referenced by requests, and shared peers by views, so
+ * a removed peer is kept in the retired list until no view uses it.
+ *
+ * A shard is a list of arrays, each covering a range of slots; arrays
+ * are appended to all shards when a peer takes a new slot, so counters
+ * never move while workers use them.
+ *
+ * Servers resolved at run time are kept in the resolve list; peers
+ * created from the addresses found refer to the same host.
+ */
+
+struct ngx_http_upstream_rr_shard_s {
+    ngx_uint_t                      worker;
+    ngx_http_upstream_rr_shard_t   *next;
+    ngx_http_upstream_rr_shard_t   *more;
+    ngx_uint_t                      base;
+    ngx_uint_t                      nslots;
+    ngx_uint_t                      conns[1];
+};
+
+
 #define ngx_http_upstream_rr_peers_rlock(peers)                               \
                                                                               \
     if (peers->shpool) {                                                      \
@@ -145,6 +201,24 @@ ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+ngx_http_upstream_rr_peers_t *ngx_http_upstream_create_round_robin_view(
+    ngx_http_upstream_rr_peers_t *shared, ngx_http_upstream_rr_peers_t *prev,
+    ngx_log_t *log);
+void ngx_http_upstream_release_round_robin_view(void *data);
+ngx_uint_t ngx_http_upstream_round_robin_peer_conns(
+    ngx_http_upstream_rr_peers_t *shared, ngx_http_upstream_rr_peer_t *peer);
+
+ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_add_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src,
+    struct sockaddr *sockaddr, socklen_t socklen);
+void ngx_http_upstream_zone_remove_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+void ngx_http_upstream_zone_update_peers(ngx_http_upstream_rr_peers_t *primary,
+    ngx_http_upstream_rr_peers_t *peers);
+void ngx_http_upstream_zone_reap_peers(ngx_http_upstream_rr_peers_t *peers);
+#endif
+
 #if (NGX_HTTP_SSL)
 ngx_int_t
     ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
@@ -668,6 +668,34 @@ ngx_close_file_mapping(ngx_file_mapping_t *fm)
 }
 
 
+ngx_int_t
+ngx_map_file(ngx_file_mapping_t *fm)
+{
+    /* a read-only view of an open file, it stays valid after the close */
+
+    fm->addr = mmap(NULL, fm->size, PROT_READ, MAP_SHARED, fm->fd, 0);
+
+    if (fm->addr != MAP_FAILED) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                  "mmap(%uz) \"%s\" failed", fm->size, fm->name);
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_unmap_file(ngx_file_mapping_t *fm)
+{
+    if (munmap(fm->addr, fm->size) == -1) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                      "munmap(%uz) \"%s\" failed", fm->size, fm->name);
+    }
+}
+
+
 ngx_int_t
 ngx_open_dir(ngx_str_t *name, ngx_dir_t *dir)
 {
@@ -195,6 +195,8 @@ ngx_int_t ngx_set_file_time(u_char *name, ngx_fd_t fd, time_t s);
 
 ngx_int_t ngx_create_file_mapping(ngx_file_mapping_t *fm);
 void ngx_close_file_mapping(ngx_file_mapping_t *fm);
+ngx_int_t ngx_map_file(ngx_file_mapping_t *fm);
+void ngx_unmap_file(ngx_file_mapping_t *fm);
 
 
 #define ngx_realpath(p, r)       (u_char *) realpath((char *) p, (char *) r)
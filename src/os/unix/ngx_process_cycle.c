@@ -52,6 +52,9 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_event_t  *ngx_wakeup_event;
+ngx_atomic_t *ngx_wakeup_pending;
+
 
 static u_char  master_process[] = "master process";
 
@@ -278,13 +281,20 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
 void
 ngx_single_process_cycle(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t        i;
+    ngx_core_conf_t  *ccf;
 
     if (ngx_set_environment(cycle, NULL) == NULL) {
         /* fatal */
         exit(2);
     }
 
+    /* the process works as a worker, so it uses the pool cache as well */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    ngx_pool_cache_init(ccf->pool_cache);
+
     for (i = 0; cycle->modules[i]; i++) {
         if (cycle->modules[i]->init_process) {
             if (cycle->modules[i]->init_process(cycle) == NGX_ERROR) {
@@ -321,6 +331,11 @@ ngx_single_process_cycle(ngx_cycle_t *cycle)
             }
 
             ngx_cycle = cycle;
+
+            ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                   ngx_core_module);
+
+            ngx_pool_cache_init(ccf->pool_cache);
         }
 
         if (ngx_reopen) {
@@ -785,6 +800,10 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         }
     }
 
+    if (worker >= 0) {
+        ngx_pool_cache_init(ccf->pool_cache);
+    }
+
     if (ccf->rlimit_core != NGX_CONF_UNSET) {
         rlmt.rlim_cur = (rlim_t) ccf->rlimit_core;
         rlmt.rlim_max = (rlim_t) ccf->rlimit_core;
@@ -926,6 +945,12 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
     ngx_last_process = 0;
 #endif
 
+    /* a wakeup sent to a previous process in the slot is lost */
+
+    if (ngx_wakeup_pending) {
+        ngx_wakeup_pending[ngx_process_slot] = 0;
+    }
+
     if (ngx_add_channel_event(cycle, ngx_channel, NGX_READ_EVENT,
                               ngx_channel_handler)
         == NGX_ERROR)
@@ -1056,6 +1081,19 @@ ngx_channel_handler(ngx_event_t *ev)
             ngx_reopen = 1;
             break;
 
+        case NGX_CMD_WAKEUP:
+
+            if (ngx_wakeup_pending) {
+                ngx_wakeup_pending[ngx_process_slot] = 0;
+                ngx_memory_barrier();
+            }
+
+            if (ngx_wakeup_event) {
+                ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+            }
+
+            break;
+
         case NGX_CMD_OPEN_CHANNEL:
 
             ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -1064,6 +1102,11 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1085,6 +1128,59 @@ ngx_channel_handler(ngx_event_t *ev)
 }
 
 
+ngx_int_t
+ngx_wakeup_process(ngx_int_t slot, ngx_log_t *log)
+{
+    ngx_int_t      rc;
+    ngx_channel_t  ch;
+
+    if (slot == ngx_process_slot) {
+
+        if (ngx_wakeup_event) {
+            ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_processes[slot].pid == -1 || ngx_processes[slot].channel[0] == -1) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the channel is shared with the master process commands, so at most
+     * one wakeup is sent until the process receives it: the process then
+     * looks at everything changed in the meantime
+     */
+
+    if (ngx_wakeup_pending
+        && !ngx_atomic_cmp_set(&ngx_wakeup_pending[slot], 0, 1))
+    {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "wakeup process s:%i pid:%P",
+                   slot, ngx_processes[slot].pid);
+
+    rc = ngx_write_channel(ngx_processes[slot].channel[0],
+                           &ch, sizeof(ngx_channel_t), log);
+
+    if (rc != NGX_OK && ngx_wakeup_pending) {
+        ngx_wakeup_pending[slot] = 0;
+    }
+
+    return rc;
+}
+
+
 static void
 ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 {
@@ -10,9 +10,20 @@
 #include <ngx_event.h>
 
 
+#if (NGX_HAVE_SENDMMSG)
+#define NGX_UDP_SEND_BATCH  16
+#else
+#define NGX_UDP_SEND_BATCH  1
+#endif
+
+
 static ngx_chain_t *ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *in, ngx_log_t *log);
 static ssize_t ngx_sendmsg_vec(ngx_connection_t *c, ngx_iovec_t *vec);
+#if (NGX_HAVE_SENDMMSG)
+static ssize_t ngx_sendmmsg_vec(ngx_connection_t *c, ngx_iovec_t *vec,
+    ngx_uint_t nvec);
+#endif
 
 
 ngx_chain_t *
@@ -20,9 +31,10 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
     ssize_t        n;
     off_t          send;
-    ngx_chain_t   *cl;
+    ngx_uint_t     nvec, niovs;
+    ngx_chain_t   *cl, *next;
     ngx_event_t   *wev;
-    ngx_iovec_t    vec;
+    ngx_iovec_t    vec[NGX_UDP_SEND_BATCH];
     struct iovec   iovs[NGX_IOVS_PREALLOCATE];
 
     wev = c->write;
@@ -50,20 +62,43 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     send = 0;
 
-    vec.iovs = iovs;
-    vec.nalloc = NGX_IOVS_PREALLOCATE;
-
     for ( ;; ) {
 
-        /* create the iovec and coalesce the neighbouring bufs */
+        /*
+         * create the iovecs and coalesce the neighbouring bufs,
+         * up to NGX_UDP_SEND_BATCH datagrams share the iovs array
+         */
 
-        cl = ngx_udp_output_chain_to_iovec(&vec, in, c->log);
+        cl = in;
+        nvec = 0;
+        niovs = 0;
 
-        if (cl == NGX_CHAIN_ERROR) {
-            return NGX_CHAIN_ERROR;
-        }
+        do {
+            vec[nvec].iovs = &iovs[niovs];
+            vec[nvec].nalloc = NGX_IOVS_PREALLOCATE - niovs;
+
+            next = ngx_udp_output_chain_to_iovec(&vec[nvec], cl, c->log);
 
-        if (cl && cl->buf->in_file) {
+            if (next == NGX_CHAIN_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (next == cl) {
+                break;
+            }
+
+            send += vec[nvec].size;
+            niovs += vec[nvec].count;
+            nvec++;
+
+            cl = next;
+
+        } while (cl
+                 && nvec < NGX_UDP_SEND_BATCH
+                 && niovs < NGX_IOVS_PREALLOCATE
+                 && send < limit);
+
+        if (nvec == 0 && cl && cl->buf->in_file) {
             ngx_log_error(NGX_LOG_ALERT, c->log, 0,
                           "file buf in sendmsg "
                           "t:%d r:%d f:%d %p %p-%p %p %O-%O",
@@ -82,13 +117,19 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return NGX_CHAIN_ERROR;
         }
 
-        if (cl == in) {
+        if (nvec == 0) {
             return in;
         }
 
-        send += vec.size;
+#if (NGX_HAVE_SENDMMSG)
+        if (nvec > 1) {
+            n = ngx_sendmmsg_vec(c, vec, nvec);
 
-        n = ngx_sendmsg_vec(c, &vec);
+        } else
+#endif
+        {
+            n = ngx_sendmsg_vec(c, &vec[0]);
+        }
 
         if (n == NGX_ERROR) {
             return NGX_CHAIN_ERROR;
@@ -166,6 +207,12 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 
         } else {
             if (n == vec->nalloc) {
+
+                if (vec->nalloc < NGX_IOVS_PREALLOCATE) {
+                    /* the datagram goes to the next batch */
+                    return cl;
+                }
+
                 ngx_log_error(NGX_LOG_ALERT, log, 0,
                               "too many parts in a datagram");
                 return NGX_CHAIN_ERROR;
@@ -240,6 +287,103 @@ ngx_sendmsg_vec(ngx_connection_t *c, ngx_iovec_t *vec)
 }
 
 
+#if (NGX_HAVE_SENDMMSG)
+
+static ssize_t
+ngx_sendmmsg_vec(ngx_connection_t *c, ngx_iovec_t *vec, ngx_uint_t nvec)
+{
+    int              n;
+    size_t           size;
+    ngx_err_t        err;
+    ngx_uint_t       i;
+    struct mmsghdr   msgs[NGX_UDP_SEND_BATCH];
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+    size_t           controllen;
+    struct cmsghdr  *cmsg;
+    u_char           msg_control[CMSG_SPACE(sizeof(ngx_addrinfo_t))];
+#endif
+
+    ngx_memzero(msgs, nvec * sizeof(struct mmsghdr));
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+
+    controllen = 0;
+
+    if (c->listening && c->listening->wildcard && c->local_sockaddr) {
+
+        /* the control message is the same for all datagrams */
+
+        msgs[0].msg_hdr.msg_control = msg_control;
+        msgs[0].msg_hdr.msg_controllen = sizeof(msg_control);
+        ngx_memzero(msg_control, sizeof(msg_control));
+
+        cmsg = CMSG_FIRSTHDR(&msgs[0].msg_hdr);
+
+        controllen = ngx_set_srcaddr_cmsg(cmsg, c->local_sockaddr);
+    }
+
+#endif
+
+    for (i = 0; i < nvec; i++) {
+
+        if (c->socklen) {
+            msgs[i].msg_hdr.msg_name = c->sockaddr;
+            msgs[i].msg_hdr.msg_namelen = c->socklen;
+        }
+
+        msgs[i].msg_hdr.msg_iov = vec[i].iovs;
+        msgs[i].msg_hdr.msg_iovlen = vec[i].count;
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+        if (controllen) {
+            msgs[i].msg_hdr.msg_control = msg_control;
+            msgs[i].msg_hdr.msg_controllen = controllen;
+        }
+#endif
+    }
+
+eintr:
+
+    n = sendmmsg(c->fd, msgs, nvec, 0);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() was interrupted");
+            goto eintr;
+
+        default:
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    size = 0;
+
+    for (i = 0; i < (ngx_uint_t) n; i++) {
+        size += msgs[i].msg_len;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmmsg: %d of %ui datagrams, %uz bytes",
+                   n, nvec, size);
+
+    return size;
+}
+
+#endif
+
+
 #if (NGX_HAVE_ADDRINFO_CMSG)
 
 size_t
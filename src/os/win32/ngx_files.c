@@ -555,6 +555,53 @@ ngx_close_file_mapping(ngx_file_mapping_t *fm)
 }
 
 
+ngx_int_t
+ngx_map_file(ngx_file_mapping_t *fm)
+{
+    /* the view keeps the mapping object, so the handle is closed at once */
+
+    fm->handle = CreateFileMapping(fm->fd, NULL, PAGE_READONLY,
+                                   (u_long) ((off_t) fm->size >> 32),
+                                   (u_long) ((off_t) fm->size & 0xffffffff),
+                                   NULL);
+    if (fm->handle == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                      "CreateFileMapping(%s, %uz) failed",
+                      fm->name, fm->size);
+        return NGX_ERROR;
+    }
+
+    fm->addr = MapViewOfFile(fm->handle, FILE_MAP_READ, 0, 0, 0);
+
+    if (fm->addr == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                      "MapViewOfFile(%uz) of file mapping \"%s\" failed",
+                      fm->size, fm->name);
+    }
+
+    if (CloseHandle(fm->handle) == 0) {
+        ngx_log_error(NGX_LOG_ALERT, fm->log, ngx_errno,
+                      "CloseHandle() of file mapping \"%s\" failed",
+                      fm->name);
+    }
+
+    fm->handle = NULL;
+
+    return (fm->addr != NULL) ? NGX_OK : NGX_ERROR;
+}
+
+
+void
+ngx_unmap_file(ngx_file_mapping_t *fm)
+{
+    if (UnmapViewOfFile(fm->addr) == 0) {
+        ngx_log_error(NGX_LOG_ALERT, fm->log, ngx_errno,
+                      "UnmapViewOfFile(%p) of file mapping \"%s\" failed",
+                      fm->addr, fm->name);
+    }
+}
+
+
 u_char *
 ngx_realpath(u_char *path, u_char *resolved)
 {
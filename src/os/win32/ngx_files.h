@@ -166,6 +166,8 @@ ngx_int_t ngx_file_info(u_char *filename, ngx_file_info_t *fi);
 
 ngx_int_t ngx_create_file_mapping(ngx_file_mapping_t *fm);
 void ngx_close_file_mapping(ngx_file_mapping_t *fm);
+ngx_int_t ngx_map_file(ngx_file_mapping_t *fm);
+void ngx_unmap_file(ngx_file_mapping_t *fm);
 
 
 u_char *ngx_realpath(u_char *path, u_char *resolved);
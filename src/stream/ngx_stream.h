@@ -57,6 +57,7 @@ typedef struct {
     unsigned                       reuseport:1;
     unsigned                       so_keepalive:2;
     unsigned                       proxy_protocol:1;
+    unsigned                       sessionless:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                            tcp_keepidle;
     int                            tcp_keepintvl;
@@ -280,7 +281,8 @@ typedef struct {
         NULL)
 
 
-#define NGX_STREAM_WRITE_BUFFERED  0x10
+#define NGX_STREAM_WRITE_BUFFERED   0x10
+#define NGX_STREAM_SPLICE_BUFFERED  0x20
 
 
 void ngx_stream_core_run_phases(ngx_stream_session_t *s);
@@ -306,6 +308,10 @@ typedef ngx_int_t (*ngx_stream_filter_pt)(ngx_stream_session_t *s,
     ngx_chain_t *chain, ngx_uint_t from_upstream);
 
 
+ngx_int_t ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
+    ngx_uint_t from_upstream);
+
+
 extern ngx_stream_filter_pt  ngx_stream_top_filter;
 
 
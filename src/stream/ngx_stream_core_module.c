@@ -855,6 +855,11 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "sessionless") == 0) {
+            ls->sessionless = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "the invalid \"%V\" parameter", &value[i]);
         return NGX_CONF_ERROR;
@@ -884,6 +889,9 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return "\"fastopen\" parameter is incompatible with \"udp\"";
         }
 #endif
+
+    } else if (ls->sessionless) {
+        return "\"sessionless\" parameter requires \"udp\"";
     }
 
     for (n = 0; n < u.naddrs; n++) {
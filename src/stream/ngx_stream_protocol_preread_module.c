@@ -0,0 +1,390 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+#define NGX_STREAM_PREREAD_UNKNOWN  0
+#define NGX_STREAM_PREREAD_HTTP     1
+#define NGX_STREAM_PREREAD_H2C      2
+#define NGX_STREAM_PREREAD_TLS      3
+#define NGX_STREAM_PREREAD_SSH      4
+#define NGX_STREAM_PREREAD_PROXY    5
+#define NGX_STREAM_PREREAD_QUIC     6
+
+
+#define NGX_STREAM_PREREAD_MAX_METHOD  16
+#define NGX_STREAM_PREREAD_QUIC_MIN    1200
+
+
+typedef struct {
+    ngx_flag_t      enabled;
+} ngx_stream_protocol_preread_srv_conf_t;
+
+
+typedef struct {
+    ngx_str_t       signature;
+    ngx_uint_t      protocol;
+} ngx_stream_protocol_preread_signature_t;
+
+
+static ngx_int_t ngx_stream_protocol_preread_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_protocol_preread_stream(u_char *p, u_char *last);
+static ngx_int_t ngx_stream_protocol_preread_datagram(u_char *p,
+    u_char *last);
+static ngx_int_t ngx_stream_protocol_preread_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_protocol_preread_add_variables(ngx_conf_t *cf);
+static void *ngx_stream_protocol_preread_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_protocol_preread_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_stream_protocol_preread_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_stream_protocol_preread_commands[] = {
+
+    { ngx_string("protocol_preread"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_protocol_preread_srv_conf_t, enabled),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_protocol_preread_module_ctx = {
+    ngx_stream_protocol_preread_add_variables, /* preconfiguration */
+    ngx_stream_protocol_preread_init,          /* postconfiguration */
+
+    NULL,                                      /* create main configuration */
+    NULL,                                      /* init main configuration */
+
+    ngx_stream_protocol_preread_create_conf,   /* create server configuration */
+    ngx_stream_protocol_preread_merge_conf     /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_protocol_preread_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_protocol_preread_module_ctx,   /* module context */
+    ngx_stream_protocol_preread_commands,      /* module directives */
+    NGX_STREAM_MODULE,                         /* module type */
+    NULL,                                      /* init master */
+    NULL,                                      /* init module */
+    NULL,                                      /* init process */
+    NULL,                                      /* init thread */
+    NULL,                                      /* exit thread */
+    NULL,                                      /* exit process */
+    NULL,                                      /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_stream_protocol_preread_names[] = {
+    ngx_null_string,
+    ngx_string("http"),
+    ngx_string("h2c"),
+    ngx_string("tls"),
+    ngx_string("ssh"),
+    ngx_string("proxy"),
+    ngx_string("quic")
+};
+
+
+static ngx_stream_protocol_preread_signature_t
+    ngx_stream_protocol_preread_signatures[] =
+{
+    { ngx_string("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"), NGX_STREAM_PREREAD_H2C },
+    { ngx_string("SSH-"), NGX_STREAM_PREREAD_SSH },
+    { ngx_string("PROXY "), NGX_STREAM_PREREAD_PROXY },
+    { ngx_string("\r\n\r\n\0\r\nQUIT\n"), NGX_STREAM_PREREAD_PROXY },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_stream_variable_t  ngx_stream_protocol_preread_vars[] = {
+
+    { ngx_string("preread_protocol"), NULL,
+      ngx_stream_protocol_preread_variable, 0, 0, 0 },
+
+      ngx_stream_null_variable
+};
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_handler(ngx_stream_session_t *s)
+{
+    ngx_int_t                                rc;
+    ngx_connection_t                        *c;
+    ngx_stream_protocol_preread_srv_conf_t  *ppcf;
+
+    c = s->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "protocol preread handler");
+
+    ppcf = ngx_stream_get_module_srv_conf(s,
+                                          ngx_stream_protocol_preread_module);
+
+    if (!ppcf->enabled) {
+        return NGX_DECLINED;
+    }
+
+    if (c->buffer == NULL) {
+        return NGX_AGAIN;
+    }
+
+    if (c->type == SOCK_STREAM) {
+        rc = ngx_stream_protocol_preread_stream(c->buffer->pos,
+                                                c->buffer->last);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+    } else {
+        rc = ngx_stream_protocol_preread_datagram(c->buffer->pos,
+                                                  c->buffer->last);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "protocol preread: \"%V\"",
+                   &ngx_stream_protocol_preread_names[rc]);
+
+    /*
+     * the detected protocol refers to a static string, so no context
+     * is allocated; the remaining preread handlers, such as ssl_preread,
+     * still see the same data
+     */
+
+    ngx_stream_set_ctx(s, &ngx_stream_protocol_preread_names[rc],
+                       ngx_stream_protocol_preread_module);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_stream(u_char *p, u_char *last)
+{
+    u_char                                    ch, *m;
+    size_t                                    n;
+    ngx_uint_t                                partial;
+    ngx_stream_protocol_preread_signature_t  *sig;
+
+    if (p == last) {
+        return NGX_AGAIN;
+    }
+
+    partial = 0;
+
+    for (sig = ngx_stream_protocol_preread_signatures;
+         sig->signature.len;
+         sig++)
+    {
+        n = ngx_min((size_t) (last - p), sig->signature.len);
+
+        if (ngx_memcmp(p, sig->signature.data, n) != 0) {
+            continue;
+        }
+
+        if (n == sig->signature.len) {
+            return sig->protocol;
+        }
+
+        partial = 1;
+    }
+
+    if (partial) {
+        return NGX_AGAIN;
+    }
+
+    /* TLS record header: handshake, major version 3 */
+
+    if (p[0] == 0x16) {
+
+        if (last - p < 3) {
+            return NGX_AGAIN;
+        }
+
+        if (p[1] == 3 && p[2] <= 4) {
+            return NGX_STREAM_PREREAD_TLS;
+        }
+
+        return NGX_STREAM_PREREAD_UNKNOWN;
+    }
+
+    /* HTTP/1.x request line: method, SP, request target */
+
+    for (m = p; m < last; m++) {
+        ch = *m;
+
+        if (ch == ' ') {
+            break;
+        }
+
+        if ((ch < 'A' || ch > 'Z') && ch != '-' && ch != '_') {
+            return NGX_STREAM_PREREAD_UNKNOWN;
+        }
+
+        if (m - p == NGX_STREAM_PREREAD_MAX_METHOD) {
+            return NGX_STREAM_PREREAD_UNKNOWN;
+        }
+    }
+
+    if (last - m < 2) {
+        return NGX_AGAIN;
+    }
+
+    if (m - p < 3 || m[1] <= ' ' || m[1] >= 0x7f) {
+        return NGX_STREAM_PREREAD_UNKNOWN;
+    }
+
+    return NGX_STREAM_PREREAD_HTTP;
+}
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_datagram(u_char *p, u_char *last)
+{
+    uint32_t  version;
+
+    /*
+     * QUIC Initial packet: long header with the fixed bit set, and
+     * a client datagram carrying it is padded to at least 1200 bytes
+     */
+
+    if (last - p < NGX_STREAM_PREREAD_QUIC_MIN || (p[0] & 0xc0) != 0xc0) {
+        return NGX_STREAM_PREREAD_UNKNOWN;
+    }
+
+    version = ((uint32_t) p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+
+    switch (version) {
+
+    case 0:
+        /* version negotiation */
+        return NGX_STREAM_PREREAD_UNKNOWN;
+
+    case 0x00000001:
+        /* QUIC v1, Initial packet type is 0 */
+        if ((p[0] & 0x30) != 0) {
+            return NGX_STREAM_PREREAD_UNKNOWN;
+        }
+
+        break;
+
+    case 0x6b3343cf:
+        /* QUIC v2, Initial packet type is 1 */
+        if ((p[0] & 0x30) != 0x10) {
+            return NGX_STREAM_PREREAD_UNKNOWN;
+        }
+
+        break;
+    }
+
+    return NGX_STREAM_PREREAD_QUIC;
+}
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_variable(ngx_stream_session_t *s,
+    ngx_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t  *protocol;
+
+    protocol = ngx_stream_get_module_ctx(s, ngx_stream_protocol_preread_module);
+
+    if (protocol == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->len = protocol->len;
+    v->data = protocol->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_add_variables(ngx_conf_t *cf)
+{
+    ngx_stream_variable_t  *var, *v;
+
+    for (v = ngx_stream_protocol_preread_vars; v->name.len; v++) {
+        var = ngx_stream_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_protocol_preread_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_protocol_preread_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_protocol_preread_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enabled = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_protocol_preread_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_protocol_preread_srv_conf_t *prev = parent;
+    ngx_stream_protocol_preread_srv_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enabled, prev->enabled, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_protocol_preread_init(ngx_conf_t *cf)
+{
+    ngx_stream_handler_pt        *h;
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    /*
+     * the handler is registered after ssl_preread, and preread
+     * handlers run in the reverse order, so it is called first
+     */
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREREAD_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_protocol_preread_handler;
+
+    return NGX_OK;
+}
@@ -10,6 +10,9 @@
 #include <ngx_stream.h>
 
 
+#define NGX_STREAM_PROXY_MAX_DATAGRAM  65535
+
+
 typedef struct {
     ngx_addr_t                      *addr;
     ngx_stream_complex_value_t      *value;
@@ -32,6 +35,7 @@ typedef struct {
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
     ngx_flag_t                       half_close;
+    ngx_flag_t                       splice;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
 
@@ -76,6 +80,12 @@ static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+#endif
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
@@ -255,6 +265,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, half_close),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -757,9 +774,19 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
 
     pc = u->peer.connection;
 
+    pc->requests++;
+
+    if (pc->pool == NULL) {
+        pc->pool = ngx_create_pool(128, c->log);
+        if (pc->pool == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
     pc->data = s;
     pc->log = c->log;
-    pc->pool = c->pool;
+    pc->pool->log = c->log;
     pc->read->log = c->log;
     pc->write->log = c->log;
 
@@ -926,6 +953,15 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
     u->connected = 1;
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && ngx_stream_proxy_init_splice(s) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#endif
+
     pc->read->handler = ngx_stream_proxy_upstream_handler;
     pc->write->handler = ngx_stream_proxy_upstream_handler;
 
@@ -1649,8 +1685,44 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         send_action = "proxying and sending to upstream";
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * once the buffered data are sent, the rest goes through the pipe;
+     * nothing is buffered in the other way while the pipe is in use
+     */
+
+    if (u->splice && dst && *out == NULL && *busy == NULL
+        && !(dst->buffered & ~NGX_STREAM_SPLICE_BUFFERED))
+    {
+        if (ngx_stream_proxy_splice(s, from_upstream) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+            return;
+        }
+
+        goto done;
+    }
+
+#endif
+
     for ( ;; ) {
 
+        /*
+         * datagrams read from the upstream in a row are sent together,
+         * with a single sendmmsg(), while the buffer can take another
+         * datagram of the maximum size
+         */
+
+        if (do_write
+            && c->type == SOCK_DGRAM
+            && src->read->ready
+            && !src->read->delayed
+            && !limit_rate
+            && b->end - b->last >= NGX_STREAM_PROXY_MAX_DATAGRAM)
+        {
+            do_write = 0;
+        }
+
         if (do_write && dst) {
 
             if (*out || *busy || dst->buffered) {
@@ -1669,6 +1741,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                 if (*busy == NULL) {
                     b->pos = b->start;
                     b->last = b->start;
+
+                    if (from_upstream && !dst->buffered) {
+                        u->keepalive = 1;
+                    }
                 }
             }
         }
@@ -1698,6 +1774,12 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
             n = src->recv(src, b->last, size);
 
             if (n == NGX_AGAIN) {
+
+                if (c->type == SOCK_DGRAM && *out && dst) {
+                    do_write = 1;
+                    continue;
+                }
+
                 break;
             }
 
@@ -1742,6 +1824,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                 cl->buf->last_buf = src->read->eof;
                 cl->buf->flush = !src->read->eof;
 
+                if (n) {
+                    u->keepalive = 0;
+                }
+
                 (*packets)++;
                 *received += n;
                 b->last += n;
@@ -1754,6 +1840,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         break;
     }
 
+#if (NGX_HAVE_SPLICE)
+done:
+#endif
+
     c->log->action = "proxying connection";
 
     if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
@@ -1801,6 +1891,270 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    ngx_uint_t                    i;
+    ngx_connection_t             *c;
+    ngx_pool_cleanup_t           *cln;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_upstream_pipe_t   *p;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+    u = s->upstream;
+
+    /* data are spliced only between plain TCP sockets without filters */
+
+    if (c->type != SOCK_STREAM
+        || ngx_stream_top_filter != ngx_stream_write_filter)
+    {
+        return NGX_OK;
+    }
+
+#if (NGX_STREAM_SSL)
+    if (c->ssl || u->peer.connection->ssl) {
+        return NGX_OK;
+    }
+#endif
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_pcalloc(c->pool, 2 * sizeof(ngx_stream_upstream_pipe_t));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p[0].fd[0] = -1;
+    p[0].fd[1] = -1;
+    p[1].fd[0] = -1;
+    p[1].fd[1] = -1;
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+    cln->data = p;
+
+    for (i = 0; i < 2; i++) {
+        if (pipe2(p[i].fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                          "pipe2() failed, splicing disabled");
+            return NGX_OK;
+        }
+
+        if (pscf->buffer_size > 65536
+            && fcntl(p[i].fd[0], F_SETPIPE_SZ, pscf->buffer_size) == -1)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, ngx_errno,
+                           "fcntl(F_SETPIPE_SZ, %uz) failed",
+                           pscf->buffer_size);
+        }
+    }
+
+    u->downstream_pipe = &p[0];
+    u->upstream_pipe = &p[1];
+    u->splice = 1;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "stream proxy splice");
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream)
+{
+    off_t                        *received, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_err_t                     err;
+    ngx_uint_t                   *packets;
+    ngx_msec_t                    delay;
+    ngx_connection_t             *c, *pc, *src, *dst;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_upstream_pipe_t   *p;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    u = s->upstream;
+
+    c = s->connection;
+    pc = u->peer.connection;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        p = u->upstream_pipe;
+        limit_rate = u->download_rate;
+        received = &u->received;
+        packets = &u->responses;
+
+    } else {
+        src = c;
+        dst = pc;
+        p = u->downstream_pipe;
+        limit_rate = u->upload_rate;
+        received = &s->received;
+        packets = &u->requests;
+    }
+
+    for ( ;; ) {
+
+        if (p->size && dst->write->ready) {
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to %d: %z of %uz", dst->fd, n, p->size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->write->error = 1;
+                    c->log->action = from_upstream
+                                     ? "proxying and sending to client"
+                                     : "proxying and sending to upstream";
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                p->size -= n;
+                dst->sent += n;
+            }
+
+            if (p->size == 0) {
+                dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+
+                if (from_upstream && !dst->buffered) {
+                    u->keepalive = 1;
+                }
+            }
+        }
+
+        size = pscf->buffer_size - ngx_min(p->size, pscf->buffer_size);
+
+        if (size == 0 || !src->read->ready || src->read->delayed) {
+            break;
+        }
+
+        if (limit_rate) {
+            limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                    - *received;
+
+            if (limit <= 0) {
+                src->read->delayed = 1;
+                delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                ngx_add_timer(src->read, delay);
+                break;
+            }
+
+            if ((off_t) size > limit) {
+                size = (size_t) limit;
+            }
+        }
+
+        n = splice(src->fd, NULL, p->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "splice from %d: %z of %uz", src->fd, n, size);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+
+                /*
+                 * EAGAIN is also returned if the pipe is full,
+                 * the socket is known to be drained only with
+                 * the pipe empty
+                 */
+
+                if (p->size == 0) {
+                    src->read->ready = 0;
+                    break;
+                }
+
+                if (dst->write->ready) {
+                    continue;
+                }
+
+                break;
+            }
+
+            c->log->action = from_upstream
+                             ? "proxying and reading from upstream"
+                             : "proxying and reading from client";
+            ngx_connection_error(src, err, "splice() failed");
+
+            src->read->error = 1;
+            n = 0;
+        }
+
+        if (n == 0) {
+            src->read->ready = 0;
+            src->read->eof = 1;
+            break;
+        }
+
+        if (limit_rate) {
+            delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+            if (delay > 0) {
+                src->read->delayed = 1;
+                ngx_add_timer(src->read, delay);
+            }
+        }
+
+        if (from_upstream) {
+            if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                u->state->first_byte_time = ngx_current_msec - u->start_time;
+            }
+        }
+
+        u->keepalive = 0;
+
+        (*packets)++;
+        *received += n;
+
+        p->size += n;
+        dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_upstream_pipe_t  *p = data;
+
+    ngx_uint_t  i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (p[i].fd[j] != -1 && close(p[i].fd[j]) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                              "close() pipe failed");
+            }
+        }
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream)
@@ -1947,6 +2301,10 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
         u->state->bytes_received = u->received;
         u->state->bytes_sent = pc->sent;
 
+        if (pc->pool) {
+            ngx_destroy_pool(pc->pool);
+        }
+
         ngx_close_connection(pc);
         u->peer.connection = NULL;
     }
@@ -1958,9 +2316,10 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 static void
 ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
 {
-    ngx_uint_t              state;
-    ngx_connection_t       *pc;
-    ngx_stream_upstream_t  *u;
+    ngx_uint_t                    state;
+    ngx_connection_t             *c, *pc;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                    "finalize stream proxy: %i", rc);
@@ -1989,6 +2348,49 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
         }
     }
 
+    if (u->keepalive) {
+        c = s->connection;
+        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+        /*
+         * the upstream connection can be reused if the client closed
+         * the connection after the upstream response: nothing was read
+         * from either side since everything read from the upstream was
+         * sent to the client, see ngx_stream_proxy_process()
+         */
+
+        if (rc != NGX_STREAM_OK
+            || pc == NULL
+            || pc->buffered
+            || u->upstream_out
+            || u->upstream_busy)
+        {
+            u->keepalive = 0;
+
+        } else if (pc->type == SOCK_DGRAM) {
+
+            /*
+             * a datagram upstream socket can be reused once
+             * all the expected responses were received
+             */
+
+            if (pc->read->error
+                || pscf->responses == NGX_MAX_INT32_VALUE
+                || u->responses < pscf->responses * u->requests)
+            {
+                u->keepalive = 0;
+            }
+
+        } else if (!c->read->eof
+                   || c->read->error
+                   || pc->read->eof
+                   || u->half_closed
+                   || pscf->proxy_protocol)
+        {
+            u->keepalive = 0;
+        }
+    }
+
     if (u->peer.free && u->peer.sockaddr) {
         state = 0;
 
@@ -2000,6 +2402,10 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
 
         u->peer.free(&u->peer, u->peer.data, state);
         u->peer.sockaddr = NULL;
+
+        /* the connection is kept by ngx_stream_upstream_keepalive_module */
+
+        pc = u->peer.connection;
     }
 
     if (pc) {
@@ -2013,6 +2419,10 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
         }
 #endif
 
+        if (pc->pool) {
+            ngx_destroy_pool(pc->pool);
+        }
+
         ngx_close_connection(pc);
         u->peer.connection = NULL;
     }
@@ -2091,6 +2501,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
     conf->half_close = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2151,6 +2562,19 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
+#if !(NGX_HAVE_SPLICE)
+
+    if (conf->splice) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_splice\" is not supported "
+                           "on this platform, ignored");
+        conf->splice = 0;
+    }
+
+#endif
+
 #if (NGX_STREAM_SSL)
 
     if (ngx_stream_proxy_merge_ssl(cf, conf, prev) != NGX_OK) {
@@ -8,6 +8,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_stream.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 
 typedef ngx_int_t (*ngx_ssl_variable_handler_pt)(ngx_connection_t *c,
@@ -53,6 +56,8 @@ static char *ngx_stream_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_stream_ssl_alpn(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_stream_ssl_handshake_offload(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 static char *ngx_stream_ssl_conf_command_check(ngx_conf_t *cf, void *post,
     void *data);
@@ -219,6 +224,20 @@ static ngx_command_t  ngx_stream_ssl_commands[] = {
       offsetof(ngx_stream_ssl_conf_t, conf_commands),
       &ngx_stream_ssl_conf_command_post },
 
+    { ngx_string("ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ssl_conf_t, ktls),
+      NULL },
+
+    { ngx_string("ssl_handshake_offload"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_ssl_handshake_offload,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ssl_alpn"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
       ngx_stream_ssl_alpn,
@@ -281,6 +300,24 @@ static ngx_stream_variable_t  ngx_stream_ssl_vars[] = {
     { ngx_string("ssl_session_reused"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_session_reused, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
+    { ngx_string("ssl_session_cache_hits"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_hits,
+      NGX_STREAM_VAR_CHANGEABLE|NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_misses"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_misses,
+      NGX_STREAM_VAR_CHANGEABLE|NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_session_cache_evictions"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_cache_evictions,
+      NGX_STREAM_VAR_CHANGEABLE|NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_ktls_send"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls_send, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_ktls_recv"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls_recv, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
     { ngx_string("ssl_server_name"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_server_name, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
@@ -478,10 +515,17 @@ ngx_stream_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn, const unsigned char **out,
 
     c = ngx_ssl_get_connection(ssl_conn);
 
-    for (i = 0; i < inlen; i += in[i] + 1) {
-        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                       "SSL ALPN supported by client: %*s",
-                       (size_t) in[i], &in[i + 1]);
+    /*
+     * with TLSv1.2, the callback may be called in a thread,
+     * see ngx_ssl_handshake_offload(), and does not log there
+     */
+
+    if (!ngx_ssl_handshake_offloaded(c)) {
+        for (i = 0; i < inlen; i += in[i] + 1) {
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "SSL ALPN supported by client: %*s",
+                           (size_t) in[i], &in[i + 1]);
+        }
     }
 
 #endif
@@ -495,8 +539,12 @@ ngx_stream_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn, const unsigned char **out,
         return SSL_TLSEXT_ERR_ALERT_FATAL;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                   "SSL ALPN selected: %*s", (size_t) *outlen, *out);
+#if (NGX_DEBUG)
+    if (!ngx_ssl_handshake_offloaded(c)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "SSL ALPN selected: %*s", (size_t) *outlen, *out);
+    }
+#endif
 
     return SSL_TLSEXT_ERR_OK;
 }
@@ -522,6 +570,13 @@ ngx_stream_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
         return 0;
     }
 
+#if (NGX_THREADS)
+    if (c->ssl->thread_pool) {
+        /* called again in a thread, see ngx_ssl_handshake_offload() */
+        return 1;
+    }
+#endif
+
     s = c->data;
 
     sslcf = arg;
@@ -554,6 +609,12 @@ ngx_stream_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
         }
     }
 
+#if (NGX_THREADS)
+    if (sslcf->ssl.thread_pool) {
+        return ngx_ssl_handshake_offload(ssl_conn, &sslcf->ssl);
+    }
+#endif
+
     return 1;
 }
 
@@ -674,12 +735,16 @@ ngx_stream_ssl_create_conf(ngx_conf_t *cf)
     scf->passwords = NGX_CONF_UNSET_PTR;
     scf->conf_commands = NGX_CONF_UNSET_PTR;
     scf->prefer_server_ciphers = NGX_CONF_UNSET;
+    scf->ktls = NGX_CONF_UNSET;
     scf->verify = NGX_CONF_UNSET_UINT;
     scf->verify_depth = NGX_CONF_UNSET_UINT;
     scf->builtin_session_cache = NGX_CONF_UNSET;
     scf->session_timeout = NGX_CONF_UNSET;
     scf->session_tickets = NGX_CONF_UNSET;
     scf->session_ticket_keys = NGX_CONF_UNSET_PTR;
+#if (NGX_THREADS)
+    scf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return scf;
 }
@@ -732,6 +797,11 @@ ngx_stream_ssl_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_ptr_value(conf->conf_commands, prev->conf_commands, NULL);
 
+    ngx_conf_merge_value(conf->ktls, prev->ktls, 0);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
 
     conf->ssl.log = cf->log;
 
@@ -900,6 +970,35 @@ ngx_stream_ssl_merge_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_ssl_ktls(cf, &conf->ssl, conf->ktls) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    if (conf->thread_pool) {
+
+#ifdef SSL_R_CERT_CB_ERROR
+
+        conf->ssl.thread_pool = conf->thread_pool;
+
+        /* with variables, the certificate callback suspends the handshake */
+
+        if (conf->certificate_values == NULL) {
+            SSL_CTX_set_cert_cb(conf->ssl.ctx, ngx_ssl_handshake_offload,
+                                &conf->ssl);
+        }
+
+#else
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_handshake_offload\" is not supported "
+                      "on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+#endif
+
     if (ngx_ssl_conf_commands(cf, &conf->ssl, conf->conf_commands) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -1023,10 +1122,12 @@ ngx_stream_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t       len;
     ngx_str_t   *value, name, size;
     ngx_int_t    n;
-    ngx_uint_t   i, j;
+    ngx_uint_t   i, j, sync;
 
     value = cf->args->elts;
 
+    sync = 0;
+
     for (i = 1; i < cf->args->nelts; i++) {
 
         if (ngx_strcmp(value[i].data, "off") == 0) {
@@ -1039,6 +1140,11 @@ ngx_stream_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "builtin") == 0) {
             scf->builtin_session_cache = NGX_SSL_DFLT_BUILTIN_SCACHE;
             continue;
@@ -1112,6 +1218,18 @@ ngx_stream_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         goto invalid;
     }
 
+    if (sync) {
+        if (scf->shm_zone == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"sync\" requires a shared session cache");
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_ssl_session_cache_sync(cf, scf->shm_zone) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     if (scf->shm_zone && scf->builtin_session_cache == NGX_CONF_UNSET) {
         scf->builtin_session_cache = NGX_SSL_NO_BUILTIN_SCACHE;
     }
@@ -1181,6 +1299,63 @@ ngx_stream_ssl_alpn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_stream_ssl_handshake_offload(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+#if (NGX_THREADS)
+    ngx_stream_ssl_conf_t *scf = conf;
+
+    ngx_str_t   name;
+#endif
+    ngx_str_t  *value;
+
+#if (NGX_THREADS)
+    if (scf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+#endif
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+#if (NGX_THREADS)
+        scf->thread_pool = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+        if (value[1].len >= 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            scf->thread_pool = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            scf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (scf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl_handshake_offload threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    return "invalid value";
+}
+
+
 static char *
 ngx_stream_ssl_conf_command_check(ngx_conf_t *cf, void *post, void *data)
 {
@@ -18,6 +18,7 @@ typedef struct {
     ngx_msec_t       handshake_timeout;
 
     ngx_flag_t       prefer_server_ciphers;
+    ngx_flag_t       ktls;
 
     ngx_ssl_t        ssl;
 
@@ -54,6 +55,10 @@ typedef struct {
     ngx_flag_t       session_tickets;
     ngx_array_t     *session_ticket_keys;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t  *thread_pool;
+#endif
+
     u_char          *file;
     ngx_uint_t       line;
 } ngx_stream_ssl_conf_t;
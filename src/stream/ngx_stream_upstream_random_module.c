@@ -186,7 +186,7 @@ ngx_stream_upstream_init_random_peer(ngx_stream_session_t *s,
     ngx_stream_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
+    if (rp->rrp.peers->shared && rcf->ranges == NULL) {
         if (ngx_stream_upstream_update_random(NULL, us) != NGX_OK) {
             ngx_stream_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
@@ -19,6 +19,11 @@ static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_get_peer(
 static void ngx_stream_upstream_notify_round_robin_peer(
     ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+static void ngx_stream_upstream_sync_round_robin_peers(
+    ngx_stream_upstream_rr_peers_t *peers);
+#endif
+
 #if (NGX_STREAM_SSL)
 
 static ngx_int_t ngx_stream_upstream_set_round_robin_peer_session(
@@ -282,6 +287,16 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
     rrp->current = NULL;
     rrp->config = 0;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (rrp->peers->shared) {
+        ngx_stream_upstream_sync_round_robin_peers(rrp->peers);
+
+        if (rrp->peers->next) {
+            ngx_stream_upstream_sync_round_robin_peers(rrp->peers->next);
+        }
+    }
+#endif
+
     n = rrp->peers->number;
 
     if (rrp->peers->next && rrp->peers->next->number > n) {
@@ -613,6 +628,9 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     time_t                          now;
     ngx_stream_upstream_rr_peer_t  *peer;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    ngx_stream_upstream_rr_peer_t  *shared;
+#endif
 
     ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
@@ -628,6 +646,12 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
         ngx_stream_upstream_rr_peers_unlock(rrp->peers);
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+        if (rrp->peers->shared) {
+            ngx_stream_upstream_sync_round_robin_peers(rrp->peers);
+        }
+#endif
+
         pc->tries = 0;
         return;
     }
@@ -639,6 +663,20 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         peer->accessed = now;
         peer->checked = now;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+        if (rrp->peers->shared) {
+
+            /* failures are rare, so they are written through at once */
+
+            shared = peer->shared;
+
+            peer->fails = ngx_atomic_fetch_add(
+                                     (ngx_atomic_t *) &shared->fails, 1) + 1;
+            shared->accessed = now;
+            shared->checked = now;
+        }
+#endif
+
         if (peer->max_fails) {
             peer->effective_weight -= peer->weight / peer->max_fails;
 
@@ -662,6 +700,12 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
         if (peer->accessed < peer->checked) {
             peer->fails = 0;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+            if (rrp->peers->shared) {
+                peer->shared->fails = 0;
+            }
+#endif
         }
     }
 
@@ -670,6 +714,12 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
     ngx_stream_upstream_rr_peers_unlock(rrp->peers);
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (rrp->peers->shared) {
+        ngx_stream_upstream_sync_round_robin_peers(rrp->peers);
+    }
+#endif
+
     if (pc->tries) {
         pc->tries--;
     }
@@ -694,6 +744,12 @@ ngx_stream_upstream_notify_round_robin_peer(ngx_peer_connection_t *pc,
 
         if (peer->accessed < peer->checked) {
             peer->fails = 0;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+            if (rrp->peers->shared) {
+                peer->shared->fails = 0;
+            }
+#endif
         }
 
         ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
@@ -702,6 +758,54 @@ ngx_stream_upstream_notify_round_robin_peer(ngx_peer_connection_t *pc,
 }
 
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+static void
+ngx_stream_upstream_sync_round_robin_peers(
+    ngx_stream_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                       i, conns;
+    ngx_stream_upstream_rr_peer_t   *peer, *shared;
+    ngx_stream_upstream_rr_shard_t  *shard;
+
+    if (peers->synced == ngx_current_msec) {
+        return;
+    }
+
+    peers->synced = ngx_current_msec;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        /* publish the connections made since the last sync */
+
+        peers->shards->conns[i] += peer->conns - peer->synced_conns;
+
+        conns = 0;
+
+        for (shard = peers->shared->shards; shard; shard = shard->next) {
+            conns += shard->conns[i];
+        }
+
+        peer->conns = conns;
+        peer->synced_conns = conns;
+
+        shared = peer->shared;
+
+        peer->fails = shared->fails;
+        peer->accessed = shared->accessed;
+
+        if (peer->checked > shared->checked) {
+            shared->checked = peer->checked;
+
+        } else {
+            peer->checked = shared->checked;
+        }
+    }
+}
+
+#endif
+
+
 #if (NGX_STREAM_SSL)
 
 static ngx_int_t
@@ -725,7 +829,10 @@ ngx_stream_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
 #if (NGX_STREAM_UPSTREAM_ZONE)
     peers = rrp->peers;
 
-    if (peers->shpool) {
+    if (peers->shared) {
+        peers = peers->shared;
+        peer = peer->shared;
+
         ngx_stream_upstream_rr_peers_rlock(peers);
         ngx_stream_upstream_rr_peer_lock(peers, peer);
 
@@ -785,7 +892,8 @@ ngx_stream_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
 #if (NGX_STREAM_UPSTREAM_ZONE)
     peers = rrp->peers;
 
-    if (peers->shpool) {
+    if (peers->shared) {
+        peers = peers->shared;
 
         ssl_session = ngx_ssl_get0_session(pc->connection);
 
@@ -807,7 +915,7 @@ ngx_stream_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
         p = buf;
         (void) i2d_SSL_SESSION(ssl_session, &p);
 
-        peer = rrp->current;
+        peer = rrp->current->shared;
 
         ngx_stream_upstream_rr_peers_rlock(peers);
         ngx_stream_upstream_rr_peer_lock(peers, peer);
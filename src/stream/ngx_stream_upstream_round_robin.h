@@ -15,6 +15,7 @@
 
 
 typedef struct ngx_stream_upstream_rr_peer_s   ngx_stream_upstream_rr_peer_t;
+typedef struct ngx_stream_upstream_rr_shard_s  ngx_stream_upstream_rr_shard_t;
 
 struct ngx_stream_upstream_rr_peer_s {
     struct sockaddr                 *sockaddr;
@@ -45,6 +46,8 @@ struct ngx_stream_upstream_rr_peer_s {
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_atomic_t                     lock;
+    ngx_stream_upstream_rr_peer_t   *shared;
+    ngx_uint_t                       synced_conns;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;
@@ -63,6 +66,10 @@ struct ngx_stream_upstream_rr_peers_s {
     ngx_slab_pool_t                 *shpool;
     ngx_atomic_t                     rwlock;
     ngx_stream_upstream_rr_peers_t  *zone_next;
+
+    ngx_stream_upstream_rr_peers_t  *shared;
+    ngx_stream_upstream_rr_shard_t  *shards;
+    ngx_msec_t                       synced;
 #endif
 
     ngx_uint_t                       total_weight;
@@ -81,6 +88,21 @@ struct ngx_stream_upstream_rr_peers_s {
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
 
+/*
+ * A worker never selects peers from the shared memory copy directly:
+ * it uses a private view of it, with the "shared" pointers referring
+ * to the shared peers.  The view has no shpool, so the locks below
+ * are not taken.  Connection counts are kept in per-worker shards
+ * and summed, along with the failure state, at most once a millisecond.
+ */
+
+struct ngx_stream_upstream_rr_shard_s {
+    ngx_uint_t                       worker;
+    ngx_stream_upstream_rr_shard_t  *next;
+    ngx_uint_t                       conns[1];
+};
+
+
 #define ngx_stream_upstream_rr_peers_rlock(peers)                             \
                                                                               \
     if (peers->shpool) {                                                      \
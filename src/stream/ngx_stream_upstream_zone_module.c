@@ -18,6 +18,9 @@ static ngx_stream_upstream_rr_peers_t *ngx_stream_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
 static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_zone_copy_peer(
     ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *src);
+static ngx_int_t ngx_stream_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static ngx_stream_upstream_rr_peers_t *ngx_stream_upstream_zone_view_peers(
+    ngx_cycle_t *cycle, ngx_stream_upstream_rr_peers_t *shared);
 
 
 static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
@@ -52,7 +55,7 @@ ngx_module_t  ngx_stream_upstream_zone_module = {
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_stream_upstream_zone_init_worker,  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -320,3 +323,142 @@ failed:
 
     return NULL;
 }
+
+
+static ngx_int_t
+ngx_stream_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_stream_upstream_rr_peers_t   *peers, *backup;
+    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        peers = ngx_stream_upstream_zone_view_peers(cycle, uscf->peer.data);
+        if (peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (peers->next) {
+            backup = ngx_stream_upstream_zone_view_peers(cycle, peers->next);
+            if (backup == NULL) {
+                return NGX_ERROR;
+            }
+
+            peers->next = backup;
+        }
+
+        uscf->peer.data = peers;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_upstream_rr_peers_t *
+ngx_stream_upstream_zone_view_peers(ngx_cycle_t *cycle,
+    ngx_stream_upstream_rr_peers_t *shared)
+{
+    size_t                           size;
+    ngx_uint_t                       n;
+    ngx_slab_pool_t                 *shpool;
+    ngx_stream_upstream_rr_peer_t   *peer, *src, **peerp;
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_stream_upstream_rr_shard_t  *shard;
+
+    peers = ngx_palloc(cycle->pool, sizeof(ngx_stream_upstream_rr_peers_t));
+    if (peers == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(peers, shared, sizeof(ngx_stream_upstream_rr_peers_t));
+
+    peers->shpool = NULL;
+    peers->shared = shared;
+    peers->synced = 0;
+
+    peer = ngx_palloc(cycle->pool,
+                      sizeof(ngx_stream_upstream_rr_peer_t) * peers->number);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    peerp = &peers->peer;
+
+    for (src = shared->peer, n = 0; src; src = src->next, n++) {
+        ngx_memcpy(&peer[n], src, sizeof(ngx_stream_upstream_rr_peer_t));
+
+        peer[n].shared = src;
+        peer[n].conns = 0;
+        peer[n].synced_conns = 0;
+
+        *peerp = &peer[n];
+        peerp = &peer[n].next;
+    }
+
+    /*
+     * each worker counts connections in a shard of its own; the shard
+     * of a respawned worker is reused, as the connections it counted
+     * are gone along with the process
+     */
+
+    shpool = shared->shpool;
+
+    size = offsetof(ngx_stream_upstream_rr_shard_t, conns)
+           + n * sizeof(ngx_uint_t);
+
+    if (size < ngx_cacheline_size) {
+        size = ngx_cacheline_size;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (shard = shared->shards; shard; shard = shard->next) {
+        if (shard->worker == ngx_worker) {
+            ngx_memzero(shard->conns, n * sizeof(ngx_uint_t));
+            break;
+        }
+    }
+
+    if (shard == NULL) {
+        shard = ngx_slab_calloc_locked(shpool, size);
+        if (shard == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            return NULL;
+        }
+
+        shard->worker = ngx_worker;
+        shard->next = shared->shards;
+
+        ngx_memory_barrier();
+
+        shared->shards = shard;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    peers->shards = shard;
+
+    return peers;
+}
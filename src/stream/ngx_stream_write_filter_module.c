@@ -16,8 +16,6 @@ typedef struct {
 } ngx_stream_write_filter_ctx_t;
 
 
-static ngx_int_t ngx_stream_write_filter(ngx_stream_session_t *s,
-    ngx_chain_t *in, ngx_uint_t from_upstream);
 static ngx_int_t ngx_stream_write_filter_init(ngx_conf_t *cf);
 
 
@@ -49,7 +47,7 @@ ngx_module_t  ngx_stream_write_filter_module = {
 };
 
 
-static ngx_int_t
+ngx_int_t
 ngx_stream_write_filter(ngx_stream_session_t *s, ngx_chain_t *in,
     ngx_uint_t from_upstream)
 {